@@ -15,11 +15,13 @@
 #define PORT 1883
 
 #define SUB "server/live/+"
+#define JOIN_PUB "camera/join/"
 
 Mqtt_t mqtt(DEVICE_NAME);
 
 P2P p2p;
 std::string mac_device; 
+std::string viewer_id;      // empty answers the camera's default session
 
 std::string parse_candidate_type(const std::string& candidate_str) {
     std::regex regex(R"(a=candidate:\d+ \d+ \w+ \d+ [\d\.a-f:]+ \d+ typ (\w+))");
@@ -102,11 +104,35 @@ int main(int argc, char* argv[]) {
     p2p.SetMaxMessageSize(MAX_MESSAGE);
     p2p.CreatePeerConnection();
     p2p.HandleIncomingDataChannel();
+    p2p.HandleIncomingTrack([](const uint8_t* data, size_t size, uint32_t timestamp) {
+        LOG_EVERY_N(INFO, 30) << "[video track] access unit " << size << " bytes, rtp time " << timestamp;
+    });
+    p2p.onMediaFrame([](const std::string& label, const MediaFrame& frame) {
+        if (frame.lost > 0) {
+            LOG(WARNING) << "[" << label << "] " << frame.lost << " frames lost before " << frame.sequence;
+        }
+        // Send time is the camera's wall clock, only meaningful with both sides NTP synced
+        LOG_EVERY_N(INFO, 30) << "[" << label << "] stream " << frame.streamId << " frame " << frame.sequence
+                              << " " << frame.data.size() << " bytes" << ((frame.flags & FRAME_FLAG_KEY) ? " key" : "")
+                              << " latency " << (mediaWallClockUs() - frame.sendTimeUs) / 1000 << " ms";
+    });
 
     mqtt.set_callback(mqtt_callback);
     mqtt.setup(BROKER, PORT, 45);
-    mqtt.subscribe(SUB , 1);
+    // "./app <camera mac> <viewer id>" joins next to other viewers instead of taking the default session
+    if (argc > 2) {
+        mac_device = argv[1];
+        viewer_id = argv[2];
+        std::string topic_offer = "server/live/" + mac_device + "/" + viewer_id;
+        mqtt.subscribe(topic_offer.c_str(), 1);
+    } else {
+        mqtt.subscribe(SUB , 1);
+    }
     mqtt.connect();
+    if (!viewer_id.empty()) {
+        std::string topic_join = JOIN_PUB + mac_device;
+        mqtt.publish(topic_join.c_str(), (const uint8_t*)viewer_id.data(), viewer_id.size());
+    }
 
     Event event;
 
@@ -158,7 +184,7 @@ int main(int argc, char* argv[]) {
 
                         transport.SerializeToArray(&serialized_data, sizeof(serialized_data));
                         LOG(INFO) << "Byte: " << transport.ByteSizeLong();
-                        std::string topic = "camera/live/" + mac_device;
+                        std::string topic = "camera/live/" + mac_device + (viewer_id.empty() ? "" : "/" + viewer_id);
 
                         int ret = mqtt.publish(topic.c_str(), serialized_data, transport.ByteSizeLong());
                         if (ret != MOSQ_ERR_SUCCESS) {
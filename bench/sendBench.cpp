@@ -0,0 +1,186 @@
+#include "sendQueue.h"
+#include <algorithm>
+#include <cstdio>
+
+// Live send path against a loopback peer connection: both peers live in this process,
+// signaling is handed across directly and frames are reassembled on the far side.
+//
+// usage: send_bench [frames] [coalesce_us]
+
+#define BENCH_LABEL         "bench"
+#define BENCH_FRAMES        3000
+#define BENCH_FPS           25
+#define BENCH_GOP           50
+#define BENCH_KEY_SIZE      60000       // bytes, roughly an x264 ultrafast 720p IDR
+#define BENCH_REF_SIZE      6000
+#define BENCH_NONREF_SIZE   800         // disposable frames, small enough to be coalesced
+#define BENCH_CONNECT_MS    10000
+
+struct Received {
+    std::mutex mutex;
+    uint64_t frames = 0;
+    uint64_t bytes = 0;
+    uint64_t lost = 0;
+    std::vector<int64_t> latencies;
+};
+
+static int64_t steadyClockUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void forwardSignaling(P2P& from, P2P& to) {
+    Event event;
+    while (from.popEvent(event)) {
+        if (event.type == Event::Type::LocalDescription) {
+            to.setRemoteDescription(event.data);
+        } else if (event.type == Event::Type::LocalCandidate) {
+            to.addRemoteCandidate(event.data);
+        }
+    }
+}
+
+static std::shared_ptr<MediaChannel> connect(std::shared_ptr<P2P> camera, std::shared_ptr<P2P> viewer) {
+    viewer->CreatePeerConnection();
+    viewer->HandleIncomingDataChannel();
+    camera->CreatePeerConnection();
+    camera->CreateDataChannel(BENCH_LABEL);
+
+    int64_t deadline = steadyClockUs() + BENCH_CONNECT_MS * 1000LL;
+    while (steadyClockUs() < deadline) {
+        forwardSignaling(*camera, *viewer);
+        forwardSignaling(*viewer, *camera);
+        auto channel = camera->openMediaChannel(BENCH_LABEL, MEDIA_STREAM_LIVE);
+        if (channel && channel->isOpen()) {
+            return channel;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return nullptr;
+}
+
+// Same GOP shape every run: IDR, then reference and disposable frames alternating
+static EncodedFrame makeFrame(int index, const std::vector<std::shared_ptr<const uint8_t>>& buffers) {
+    EncodedFrame frame;
+    if (index % BENCH_GOP == 0) {
+        frame.size = BENCH_KEY_SIZE;
+        frame.flags = FRAME_FLAG_KEY | FRAME_FLAG_REFERENCE;
+        frame.data = buffers[0];
+    } else if (index % 2 == 1) {
+        frame.size = BENCH_REF_SIZE;
+        frame.flags = FRAME_FLAG_REFERENCE;
+        frame.data = buffers[1];
+    } else {
+        frame.size = BENCH_NONREF_SIZE;
+        frame.flags = 0;
+        frame.data = buffers[2];
+    }
+    frame.pts = (int64_t)index * 1000000 / BENCH_FPS;
+    return frame;
+}
+
+static bool waitReceived(Received& received, uint64_t frames, int64_t timeoutUs) {
+    int64_t deadline = steadyClockUs() + timeoutUs;
+    while (steadyClockUs() < deadline) {
+        {
+            std::lock_guard<std::mutex> lock(received.mutex);
+            if (received.frames >= frames) {
+                return true;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return false;
+}
+
+static void resetReceived(Received& received) {
+    std::lock_guard<std::mutex> lock(received.mutex);
+    received.frames = 0;
+    received.bytes = 0;
+    received.lost = 0;
+    received.latencies.clear();
+}
+
+int main(int argc, char* argv[]) {
+    google::InitGoogleLogging(argv[0]);
+    FLAGS_minloglevel = google::WARNING;
+
+    int frames = argc > 1 ? atoi(argv[1]) : BENCH_FRAMES;
+    int64_t coalesceUs = argc > 2 ? atoll(argv[2]) : 0;
+
+    auto camera = std::make_shared<P2P>();
+    auto viewer = std::make_shared<P2P>();
+    Received received;
+    viewer->onMediaFrame([&received](const std::string& label, const MediaFrame& frame) {
+        int64_t latency = mediaWallClockUs() - frame.sendTimeUs;
+        std::lock_guard<std::mutex> lock(received.mutex);
+        received.frames++;
+        received.bytes += frame.data.size();
+        received.lost += frame.lost;
+        received.latencies.push_back(latency);
+    });
+
+    auto channel = connect(camera, viewer);
+    if (!channel) {
+        fprintf(stderr, "loopback connection did not open\n");
+        return 1;
+    }
+
+    std::vector<std::shared_ptr<const uint8_t>> buffers;
+    for (size_t size : {BENCH_KEY_SIZE, BENCH_REF_SIZE, BENCH_NONREF_SIZE}) {
+        std::vector<uint8_t> data(size, 0xA5);
+        buffers.push_back(copyFrameData(data.data(), data.size()));
+    }
+
+    // 1. MediaChannel alone, as fast as SCTP drains: sender CPU per frame and throughput
+    int64_t sendUs = 0;
+    int64_t start = steadyClockUs();
+    for (int i = 0; i < frames; i++) {
+        while (channel->bufferedAmount() > SEND_QUEUE_HIGH_WATER) {
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+        EncodedFrame frame = makeFrame(i, buffers);
+        int64_t before = steadyClockUs();
+        channel->send(frame.data.get(), frame.size, frame.pts, frame.flags);
+        sendUs += steadyClockUs() - before;
+    }
+    bool complete = waitReceived(received, frames, 5000000);
+    int64_t elapsed = steadyClockUs() - start;
+    {
+        std::lock_guard<std::mutex> lock(received.mutex);
+        printf("MediaChannel: %d frames, %.2f us/frame in send, %.1f MB/s delivered, %llu received%s\n",
+               frames, (double)sendUs / frames, received.bytes / (double)elapsed,
+               (unsigned long long)received.frames, complete ? "" : " (timed out)");
+    }
+    resetReceived(received);
+
+    // 2. SendQueue in real time: latency from send to reassembly, and what gets dropped
+    SendQueue queue(camera, BENCH_LABEL);
+    queue.setCoalescing(coalesceUs);
+    queue.start();
+    start = steadyClockUs();
+    for (int i = 0; i < frames; i++) {
+        queue.push(makeFrame(i, buffers));
+        int64_t next = start + (int64_t)(i + 1) * 1000000 / BENCH_FPS;
+        std::this_thread::sleep_for(std::chrono::microseconds(std::max<int64_t>(0, next - steadyClockUs())));
+    }
+    waitReceived(received, queue.getSentFrames(), 2000000);
+    queue.stop();
+
+    {
+        std::lock_guard<std::mutex> lock(received.mutex);
+        std::vector<int64_t>& latencies = received.latencies;
+        std::sort(latencies.begin(), latencies.end());
+        int64_t p50 = latencies.empty() ? 0 : latencies[latencies.size() / 2];
+        int64_t p99 = latencies.empty() ? 0 : latencies[latencies.size() * 99 / 100];
+        printf("SendQueue @%d fps, coalesce %lld us: sent %llu dropped %llu received %llu lost %llu, "
+               "latency p50 %lld us p99 %lld us\n",
+               BENCH_FPS, (long long)coalesceUs, (unsigned long long)queue.getSentFrames(),
+               (unsigned long long)queue.getDroppedFrames(), (unsigned long long)received.frames,
+               (unsigned long long)received.lost, (long long)p50, (long long)p99);
+    }
+
+    camera->ClosePeerConnection();
+    viewer->ClosePeerConnection();
+    return 0;
+}
@@ -2,11 +2,14 @@
 #include <iostream>
 #include "mqtt.h"
 #include "p2p.h"
+#include "sessionManager.h"
+#include "mosaicStream.h"
 #include "typedef.pb.h"
 #include <ifaddrs.h>
 #include <netpacket/packet.h> 
 #include <vector>
 #include <regex>
+#include <sstream>
 
 #define MAX_BUFFER 1024
 
@@ -18,6 +21,18 @@
 #define PORT 1883
 
 #define SUB "camera/live/"
+#define PUB "server/live/"
+#define JOIN_SUB "camera/join/"
+#define LIVE_LABEL "camera/live"
+#define TRIGGER_SUB "camera/trigger/"
+#define PLAYBACK_SUB "camera/playback/"
+#define PLAYBACK_LABEL "camera/playback"
+#define CLIP_SUB "camera/clip/"
+#define CLIP_PUB "server/clip/"
+#define EVENTS_SUB "camera/events/"
+#define EVENTS_PUB "server/events/"
+#define MOSAIC_SUB "camera/mosaic/"
+#define MOSAIC_LABEL "camera/mosaic"
 
 #define CAMERA_DEVICE_FILE "/dev/video2"
 
@@ -62,7 +77,24 @@ std::string get_mac_address(const std::string& interface) {
 
 Mqtt_t mqtt(DEVICE_NAME);
 
-std::shared_ptr<P2P> p2p = std::make_shared<P2P>();  
+void setup_session(std::shared_ptr<P2P> p2p) {
+    p2p->SetStunServer("stun.l.google.com:19302");
+    p2p->SetMaxMessageSize(MAX_MESSAGE);
+    p2p->CreatePeerConnection();
+    //p2p->AddVideoTrack();                     // RTP H.264 to browsers, pairs with streamLiveTrack
+    p2p->CreateDataChannel(LIVE_LABEL);
+    //p2p->CreateDataChannel(LIVE_LABEL, true); // lossy Wi-Fi: unordered, no retransmits, FEC
+    p2p->CreateDataChannel(PLAYBACK_LABEL);
+    p2p->CreateDataChannel(MOSAIC_LABEL);
+}
+
+// Viewer "" is the single viewer of the plain "<prefix><mac>" topics
+SessionManager sessions(setup_session);
+
+CameraStream camera(CAMERA_DEVICE_FILE, 640, 480, 30);
+
+// Every local camera in one grid, started for its viewer and stopped when it leaves
+MosaicStream mosaic(640, 480, 15);
 
 std::string parse_candidate_type(const std::string& candidate_str) {
     std::regex regex(R"(a=candidate:\d+ \d+ \w+ \d+ [\d\.a-f:]+ \d+ typ (\w+))");
@@ -93,7 +125,13 @@ std::string select_best_candidate(const std::vector<std::string>& candidate_stri
     return best_candidate;
 }
 
-void process_received_p2p(const ProtoP2p_t& p2p_proto) {
+// "<prefix><mac>/<viewer>" names a viewer, "<prefix><mac>" the default one
+std::string viewer_from_topic(const std::string& topic, const std::string& prefix) {
+    size_t slash = topic.find('/', prefix.size());
+    return slash == std::string::npos ? "" : topic.substr(slash + 1);
+}
+
+void process_received_p2p(std::shared_ptr<P2P> p2p, const ProtoP2p_t& p2p_proto) {
     auto description = p2p_proto.description();
     LOG(INFO) << "Description: " << description;
     Event event_des = {Event::Type::SetLocalDescription, description};
@@ -117,6 +155,99 @@ void mqtt_callback(struct mosquitto *mosq, void *userdata, const struct mosquitt
     LOG(INFO) << "<-- " << message->topic << " : " << (const char*)message->payload;
     std::string payload = (const char*)message->payload;
 
+    // Plain text payload carries the trigger reason, e.g. "door"; "motion start" and
+    // "motion stop" from a detector are logged as motion events, the start also records
+    if (std::string(message->topic).rfind(TRIGGER_SUB, 0) == 0) {
+        std::string reason((const char*)message->payload, message->payloadlen);
+        std::string source = camera.getSource();
+        if (reason == "motion start") {
+            EventLog::instance().append(EventMotionStart, source, "");
+            camera.trigger("motion");
+        } else if (reason == "motion stop") {
+            EventLog::instance().append(EventMotionStop, source, "");
+        } else {
+            camera.trigger(reason);
+        }
+        return;
+    }
+
+    // "<from_us> <to_us>" in wall clock, one "<time_us> <type> <camera> <detail> <segment> <offset_us>" line per event
+    if (std::string(message->topic).rfind(EVENTS_SUB, 0) == 0) {
+        std::istringstream request(std::string((const char*)message->payload, message->payloadlen));
+        int64_t from = 0, to = 0;
+        request >> from >> to;
+
+        std::ostringstream reply;
+        for (const EventMatch& match : EventLog::instance().query(from, to)) {
+            std::string detail(match.record.detail, strnlen(match.record.detail, sizeof(match.record.detail)));
+            reply << match.record.timeUs << " " << EventLog::typeToString((EventType)match.record.type) << " "
+                  << match.record.source << " " << (detail.empty() ? "-" : detail) << " "
+                  << (match.segment.empty() ? "-" : match.segment) << " " << match.offsetUs << "\n";
+        }
+        std::string topic = EVENTS_PUB + std::string(message->topic).substr(strlen(EVENTS_SUB));
+        std::string payload = reply.str();
+        mqtt.publish(topic.c_str(), (const uint8_t*)payload.data(), payload.size());
+        return;
+    }
+
+    // Payload is the viewer id, its offer goes out on "server/live/<mac>/<viewer>"
+    if (std::string(message->topic).rfind(JOIN_SUB, 0) == 0) {
+        std::string viewer((const char*)message->payload, message->payloadlen);
+        if (viewer.empty() || viewer.find('/') != std::string::npos) {
+            LOG(ERROR) << "Invalid viewer id: " << viewer;
+            return;
+        }
+        sessions.open(viewer);
+        return;
+    }
+
+    // "<segment> <offset>" resumes a download, "<segment> <start_ms> <end_ms>" sends a range
+    if (std::string(message->topic).rfind(PLAYBACK_SUB, 0) == 0) {
+        std::shared_ptr<P2P> p2p = sessions.get(viewer_from_topic(message->topic, PLAYBACK_SUB));
+        if (!p2p) {
+            LOG(ERROR) << "No session for " << message->topic;
+            return;
+        }
+        std::istringstream request(std::string((const char*)message->payload, message->payloadlen));
+        std::string name;
+        int64_t first = 0, last = -1;
+        request >> name >> first >> last;
+        if (last >= 0) {
+            camera.streamPlaybackRange(p2p, PLAYBACK_LABEL, name, first * 1000, last * 1000);
+        } else {
+            camera.streamPlayback(p2p, PLAYBACK_LABEL, name, first);
+        }
+        return;
+    }
+
+    // Any payload, the grid goes out on MOSAIC_LABEL of the viewer's session
+    if (std::string(message->topic).rfind(MOSAIC_SUB, 0) == 0) {
+        std::shared_ptr<P2P> p2p = sessions.get(viewer_from_topic(message->topic, MOSAIC_SUB));
+        if (!p2p) {
+            LOG(ERROR) << "No session for " << message->topic;
+            return;
+        }
+        // Starts the grid if needed, under the mosaic's lock against the session thread's stopStream
+        if (mosaic.stream(p2p, MOSAIC_LABEL) != Result::SUCCESS) {
+            LOG(ERROR) << "Failed to stream mosaic";
+        }
+        return;
+    }
+
+    // "<segment> <start_ms> <end_ms>", the clip name is published when it is ready
+    if (std::string(message->topic).rfind(CLIP_SUB, 0) == 0) {
+        std::istringstream request(std::string((const char*)message->payload, message->payloadlen));
+        std::string name;
+        int64_t first = 0, last = 0;
+        request >> name >> first >> last;
+        std::string topic = CLIP_PUB + std::string(message->topic).substr(strlen(CLIP_SUB));
+        camera.exportClip(name, first * 1000, last * 1000, [topic](Result result, const std::string& clip) {
+            std::string reply = result == Result::SUCCESS ? clip : "";
+            mqtt.publish(topic.c_str(), (const uint8_t*)reply.data(), reply.size());
+        });
+        return;
+    }
+
     Transport_t receivedTransport;
 
     if (!receivedTransport.ParseFromArray(message->payload, message->payloadlen)) {
@@ -127,9 +258,22 @@ void mqtt_callback(struct mosquitto *mosq, void *userdata, const struct mosquitt
     LOG(INFO) << "Received MAC: " << receivedTransport.mac();
     
     //compare mac here
+    std::string viewer = viewer_from_topic(message->topic, SUB);
+    std::shared_ptr<P2P> session = sessions.get(viewer);
+    if (!session && viewer.empty()) {
+        // The default session went away with its connection, this answered the old offer.
+        // Open it again the way a join does, the viewer answers the new offer
+        LOG(INFO) << "Reopening the default session for " << message->topic;
+        sessions.open("");
+        return;
+    }
+    if (!session) {
+        LOG(ERROR) << "No session for " << message->topic;
+        return;
+    }
     if (receivedTransport.p2p_size() > 0) {
         const ProtoP2p_t& p2p = receivedTransport.p2p(0);  // Get the first P2P object
-        process_received_p2p(p2p);
+        process_received_p2p(session, p2p);
     }
 }
 
@@ -141,16 +285,31 @@ int main(int argc, char* argv[]) {
 
     std::string mac = "ec:2e:98:e3:d6:a5";
 
-    p2p->SetStunServer("stun.l.google.com:19302");
-    p2p->SetMaxMessageSize(MAX_MESSAGE);
-    p2p->CreatePeerConnection();
-    std::string label = "camera/live";
-    p2p->CreateDataChannel(label);
+    std::string label = LIVE_LABEL;
+    sessions.open("");
 
     mqtt.set_callback(mqtt_callback);
     mqtt.setup(BROKER, PORT, 45);
     std::string topic_sub = SUB + mac;
     mqtt.subscribe(topic_sub.c_str() , 1);
+    std::string topic_viewers = SUB + mac + "/+";
+    mqtt.subscribe(topic_viewers.c_str() , 1);
+    std::string topic_join = JOIN_SUB + mac;
+    mqtt.subscribe(topic_join.c_str() , 1);
+    std::string topic_trigger = TRIGGER_SUB + mac;
+    mqtt.subscribe(topic_trigger.c_str() , 1);
+    std::string topic_playback = PLAYBACK_SUB + mac;
+    mqtt.subscribe(topic_playback.c_str() , 1);
+    std::string topic_playback_viewers = PLAYBACK_SUB + mac + "/+";
+    mqtt.subscribe(topic_playback_viewers.c_str() , 1);
+    std::string topic_clip = CLIP_SUB + mac;
+    mqtt.subscribe(topic_clip.c_str() , 1);
+    std::string topic_events = EVENTS_SUB + mac;
+    mqtt.subscribe(topic_events.c_str() , 1);
+    std::string topic_mosaic = MOSAIC_SUB + mac;
+    mqtt.subscribe(topic_mosaic.c_str() , 1);
+    std::string topic_mosaic_viewers = MOSAIC_SUB + mac + "/+";
+    mqtt.subscribe(topic_mosaic_viewers.c_str() , 1);
     mqtt.connect();
 
     google::InitGoogleLogging(argv[0]);
@@ -166,71 +325,94 @@ int main(int argc, char* argv[]) {
     //av_log_set_level(AV_LOG_DEBUG);
 
     /*config stream camera*/
-    CameraStream camera(CAMERA_DEVICE_FILE, 640, 480, 30);
     camera.configure();
+    //camera.setFragmentedMp4(true);
+    //camera.setTimelapse(RECORD_TIMELAPSE_INTERVAL_US);
+    //camera.setThumbnailInterval(0);
+    //camera.setRawArchive(true);
+    //camera.setCompaction(COMPACT_AGE_US, AV_CODEC_ID_HEVC);
     camera.open();
     //camera.setSupportRecord(true);
+    //camera.setEventRecording(true);
+    //camera.setLiveIntraRefresh(true);
+    //camera.setLiveCoalescing(MEDIA_COALESCE_DEADLINE_US);
     camera.start(LiveMode);
+    // More cameras join the grid with their own addTile
+    mosaic.addTile(camera.getBaseStream());
 
-	Transport_t transport;
-	transport.set_mac(mac);  
-	ProtoP2p_t* p2p_info = transport.add_p2p();
-    Event event;
+    // Offer and candidates gathered per viewer until ICE gathering completes
+    std::map<std::string, Transport_t> signaling;
 
-    while (true) {
-        if (p2p->popEvent(event)) {
-            switch (event.type) {
-                case Event::Type::SetLocalDescription:
-                    LOG(INFO) << "=====Processing Set Local Description=====: " << event.data;
-                    p2p->setRemoteDescription(event.data);
-                    break;
-                case Event::Type::SetLocalCandidate:
-                    LOG(INFO) << "=====Processing Set Local Candidate=======: " << event.data;
-                    p2p->addRemoteCandidate(event.data);                
-                    break;
+    auto handle_event = [&](const std::string& viewer, std::shared_ptr<P2P> p2p, const Event& event) {
+        Transport_t& transport = signaling[viewer];
+        if (transport.p2p_size() == 0) {
+            transport.set_mac(mac);
+            transport.add_p2p();
+        }
+        ProtoP2p_t* p2p_info = transport.mutable_p2p(0);
+
+        switch (event.type) {
+            case Event::Type::SetLocalDescription:
+                LOG(INFO) << "=====Processing Set Local Description=====: " << event.data;
+                p2p->setRemoteDescription(event.data);
+                break;
+            case Event::Type::SetLocalCandidate:
+                LOG(INFO) << "=====Processing Set Local Candidate=======: " << event.data;
+                p2p->addRemoteCandidate(event.data);                
+                break;
+            
+            case Event::Type::LocalDescription:
+                LOG(INFO) << "Processing Local Description: " << event.data;
+                p2p_info->set_description(event.data);
+                break;
                 
-                case Event::Type::LocalDescription:
-                    LOG(INFO) << "Processing Local Description: " << event.data;
-                    p2p_info->set_description(event.data);
-                    break;
-                    
-                case Event::Type::LocalCandidate:
-                    LOG(INFO) << "Processing Local Candidate: " << event.data;
-                    p2p_info->add_candidate(event.data);                
-                    break;
-
-                case Event::Type::StateChange:
-                    LOG(INFO) << "Processing State Change: " << event.data;
-                    if (event.data.find("Connected") != std::string::npos) { 
-                        p2p->sendMessageToChannel(label, "BUI DINH HIEN");
-                    
-                        LOG(INFO) << "[REMOTE max message size:"  << p2p->pc->remoteMaxMessageSize() << "]";
-                        camera.streamLive(p2p, label);
-                        //camera.streamRecord(p2p, label);
-                    }
-                    break;
+            case Event::Type::LocalCandidate:
+                LOG(INFO) << "Processing Local Candidate: " << event.data;
+                p2p_info->add_candidate(event.data);                
+                break;
+
+            case Event::Type::StateChange:
+                LOG(INFO) << "Processing State Change: " << event.data << " viewer '" << viewer << "'";
+                EventLog::instance().append(EventConnection, "p2p", viewer.empty() ? event.data : viewer + " " + event.data);
+                if (event.data.find("Connected") != std::string::npos) { 
+                    p2p->sendMessageToChannel(label, "BUI DINH HIEN");
+                
+                    LOG(INFO) << "[REMOTE max message size:"  << p2p->pc->remoteMaxMessageSize() << "]";
+                    // Every viewer hangs off the one live encoder
+                    camera.streamLive(p2p, label);
+                    //camera.streamLiveTrack(p2p);
+                    //camera.streamRecord(p2p, label);
+                } else if (event.data == "Failed" || event.data == "Closed") {
+                    camera.stopLive(p2p);
+                    mosaic.stopStream(p2p);
+                    signaling.erase(viewer);
+                }
+                break;
 
-                case Event::Type::GatheringStateChange:
-                    LOG(INFO) << "Processing Gathering State Change: " << event.data;
-                    if (event.data.find("Complete") != std::string::npos) { 
-                        LOG(INFO) << "ICE Gathering is complete!";
+            case Event::Type::GatheringStateChange:
+                LOG(INFO) << "Processing Gathering State Change: " << event.data;
+                if (event.data.find("Complete") != std::string::npos) { 
+                    LOG(INFO) << "ICE Gathering is complete!";
 
-                        uint8_t serialized_data[MAX_BUFFER];
-                        memset(serialized_data , 0, sizeof(serialized_data));    
+                    uint8_t serialized_data[MAX_BUFFER];
+                    memset(serialized_data , 0, sizeof(serialized_data));    
 
-                        transport.SerializeToArray(&serialized_data, sizeof(serialized_data));
-                        LOG(INFO) << "Byte: " << transport.ByteSizeLong();
-                        std::string topic = "server/live/" + mac;
+                    transport.SerializeToArray(&serialized_data, sizeof(serialized_data));
+                    LOG(INFO) << "Byte: " << transport.ByteSizeLong();
+                    std::string topic = PUB + mac + (viewer.empty() ? "" : "/" + viewer);
 
-                        int ret = mqtt.publish(topic.c_str(), serialized_data, transport.ByteSizeLong());
-                        if (ret != MOSQ_ERR_SUCCESS) {
-                            LOG(ERROR) << "Failed to send message: " << mosquitto_strerror(ret) << std::endl;
-                        }
-                        p2p_info->Clear(); 
+                    int ret = mqtt.publish(topic.c_str(), serialized_data, transport.ByteSizeLong());
+                    if (ret != MOSQ_ERR_SUCCESS) {
+                        LOG(ERROR) << "Failed to send message: " << mosquitto_strerror(ret) << std::endl;
                     }
-                    break;
-            }
-        }else {
+                    p2p_info->Clear(); 
+                }
+                break;
+        }
+    };
+
+    while (true) {
+        if (!sessions.poll(handle_event)) {
             std::this_thread::sleep_for(std::chrono::milliseconds(100)); 
         }
     }
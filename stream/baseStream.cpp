@@ -1,6 +1,15 @@
 #include "baseStream.h"
 
 
+std::shared_ptr<const uint8_t> sharePacketData(const AVPacket* packet) {
+    AVPacket* ref = av_packet_clone(packet);
+    if (!ref) {
+        return nullptr;
+    }
+    std::shared_ptr<AVPacket> owner(ref, [](AVPacket* p) { av_packet_free(&p); });
+    return std::shared_ptr<const uint8_t>(owner, ref->data);
+}
+
 Result BaseStream::configure() {
     std::string video_size = std::to_string(info.width) + "x" + std::to_string(info.height);
 
@@ -55,8 +64,64 @@ uint8_t BaseStream::getFps(){
     return info.fps;
 }
 
+Result BaseStream::startCapture() {
+    CAMERA_ASSERT(mState == CameraOpened);
+
+    if (mCapturing) {
+        return Result::SUCCESS;
+    }
+    mCapturing = true;
+    mCaptureThread = std::thread(&BaseStream::captureThread, this);
+    return Result::SUCCESS;
+}
+
+Result BaseStream::stopCapture() {
+    mCapturing = false;
+    if (mCaptureThread.joinable()) {
+        mCaptureThread.join();
+    }
+    return Result::SUCCESS;
+}
+
+void BaseStream::addPacketListener(const void* owner, PacketListener listener) {
+    std::lock_guard<std::mutex> lock(mListenerMutex);
+    mListeners[owner] = listener;
+}
+
+void BaseStream::removePacketListener(const void* owner) {
+    std::lock_guard<std::mutex> lock(mListenerMutex);
+    mListeners.erase(owner);
+}
+
+// One reader per device: live and record both get every packet from here
+void BaseStream::captureThread() {
+    AVPacket* packet = av_packet_alloc();
+
+    while (mCapturing) {
+        int ret = av_read_frame(format_ctx, packet);
+        if (ret == AVERROR(EAGAIN)) {
+            continue;
+        }
+        if (ret < 0) {
+            LOG(ERROR) << "Failed to read frame from " << file_name;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            continue;
+        }
+
+        if (packet->stream_index == video_stream_index && packet->size > 0) {
+            std::lock_guard<std::mutex> lock(mListenerMutex);
+            for (auto& listener : mListeners) {
+                listener.second(packet);
+            }
+        }
+        av_packet_unref(packet);
+    }
+    av_packet_free(&packet);
+}
+
 Result BaseStream::close() {
     CAMERA_ASSERT(mState != CameraClosed);
+    stopCapture();
     if (format_ctx) {
         avformat_close_input(&format_ctx);  
         format_ctx = nullptr;      
@@ -19,16 +19,24 @@ extern "C" {
 #include <iomanip> 
 
 #include <queue>
+#include <map>
 #include <mutex>
+#include <functional>
 #include <condition_variable>
 
 #include "p2p.h"
+#include "loadGovernor.h"
 
 
 #define CAMERA_INPUT_FORMAT "v4l2"
 #define CAMERA_RECORD_FORMAT "mpegts"
+#define CAMERA_RECORD_FORMAT_FMP4 "mp4"
+#define CAMERA_RECORD_FORMAT_RAW "matroska"  // camera MJPEG as captured, transcoded to CAMERA_RECORD_FORMAT later
+#define CAMERA_RECORD_EXT ".ts"              // file extensions of the formats above, muxer names aren't
+#define CAMERA_RECORD_EXT_FMP4 ".mp4"
+#define CAMERA_RECORD_EXT_RAW ".mkv"
 #define CAMERA_LIVE_FORMAT "mjpeg"
-#define CAMERA_RECORD_FILE "/home/bhien/output.ts"
+#define CAMERA_RECORD_DIR "/home/bhien/record"
 
 #define LOG_TAG_INFO(TAG, MESSAGE)    LOG(INFO) << "[" << TAG << "] " << MESSAGE
 #define LOG_TAG_WARNING(TAG, MESSAGE) LOG(WARNING) << "[" << TAG << "] " << MESSAGE
@@ -86,33 +94,11 @@ struct CameraInfo {
 };
 
 
-// Thread-safe queue
-class PacketQueue {
-public:
-    void push(AVPacket* packet) {
-        std::lock_guard<std::mutex> lock(mMutex);
-        mQueue.push(packet);
-        mCondVar.notify_one();  // Notify record thread when packet is available
-    }
-
-    AVPacket* pop() {
-        std::unique_lock<std::mutex> lock(mMutex);
-        mCondVar.wait(lock, [this]() { return !mQueue.empty(); });  // Wait if queue is empty
-        AVPacket* packet = mQueue.front();
-        mQueue.pop();
-        return packet;
-    }
-
-    bool empty() {
-        std::lock_guard<std::mutex> lock(mMutex);
-        return mQueue.empty();
-    }
+// Called on the capture thread for every video packet, the packet is only valid during the call
+typedef std::function<void(const AVPacket* packet)> PacketListener;
 
-private:
-    std::queue<AVPacket*> mQueue;
-    std::mutex mMutex;
-    std::condition_variable mCondVar;
-};
+// Packet payload kept alive by a new reference to its buffer, no copy for ref-counted packets
+std::shared_ptr<const uint8_t> sharePacketData(const AVPacket* packet);
 
 class BaseStream {
 public:
@@ -122,6 +108,11 @@ public:
     bool isSupportVideo();
     bool isSupportAudio();
     uint8_t getFps();
+    Result startCapture();
+    Result stopCapture();
+    bool isCapturing() const { return mCapturing; }
+    void addPacketListener(const void* owner, PacketListener listener);
+    void removePacketListener(const void* owner);
 
     BaseStream(const std::string& device_name, int width, int height, int fps) {  
         file_name = device_name; 
@@ -136,8 +127,15 @@ public:
     int video_stream_index;
     int audio_stream_index;
     AVFormatContext* format_ctx = nullptr;
-    PacketQueue packetQueue;
+    LoadGovernor governor;
 private:
+    void captureThread();
+
+    std::thread mCaptureThread;
+    std::atomic<bool> mCapturing{false};
+    std::mutex mListenerMutex;
+    std::map<const void*, PacketListener> mListeners;
+
     CameraState mState;
     AVDictionary* options = nullptr;
     struct CameraInfo info;
@@ -54,6 +54,12 @@ Result CameraStream::start(CameraStreamMode mode) {
             break;
     }
 
+    Result result = baseStream->startCapture();
+    if (result != Result::SUCCESS) {
+        LOG_TAG_ERROR(baseStream->file_name, "Failed to start capture");
+        return result;
+    }
+
     mState = CameraStarted;
     return Result::SUCCESS;
 }
@@ -61,6 +67,13 @@ Result CameraStream::start(CameraStreamMode mode) {
 Result CameraStream::close() {
     CAMERA_ASSERT(mState != CameraClosed);
 
+    // Nothing may still be queued on the executor once the device is gone
+    baseStream->stopCapture();
+    if (mState == CameraStarted) {
+        live->stop();
+        record->stop();
+    }
+
     Result result = baseStream->close();
     if (result != Result::SUCCESS) {
         LOG_TAG_ERROR(baseStream->file_name, "Failed to close the stream");
@@ -77,6 +90,16 @@ Result CameraStream::streamLive(std::shared_ptr<P2P> p2p, std::string label) {
     return live->stream(p2p, label);
 }
 
+Result CameraStream::stopLive(std::shared_ptr<P2P> p2p) {
+    CAMERA_ASSERT(mState != CameraClosed);
+    return live->stopStream(p2p);
+}
+
+Result CameraStream::streamLiveTrack(std::shared_ptr<P2P> p2p) {
+    CAMERA_ASSERT(mState != CameraClosed);
+    return live->streamTrack(p2p);
+}
+
 Result CameraStream::streamRecord(std::shared_ptr<P2P> p2p, std::string label) {
     CAMERA_ASSERT(mState != CameraClosed);
     return record->stream(p2p, label);
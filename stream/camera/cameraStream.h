@@ -30,9 +30,54 @@ public:
     void setSupportRecord(bool status){
         mSupportRecord = status;
     }
+    void setLiveCoalescing(int64_t deadlineUs){
+        live->setCoalescing(deadlineUs);
+    }
+    void setLiveIntraRefresh(bool status){
+        live->setIntraRefresh(status);
+    }
+
+    void setTimelapse(int64_t intervalUs){
+        record->setTimelapse(intervalUs);
+    }
+    void setFragmentedMp4(bool status){
+        record->setFragmentedMp4(status);
+    }
+    void setRawArchive(bool status){
+        record->setRawArchive(status);
+    }
+    void setCompaction(int64_t ageUs, AVCodecID codec = AV_CODEC_ID_H264){
+        record->setCompaction(ageUs, codec);
+    }
+    void setThumbnailInterval(int64_t intervalUs){
+        record->setThumbnailInterval(intervalUs);
+    }
+    void setEventRecording(bool status){
+        record->setContinuous(!status);
+    }
+    Result trigger(const std::string& reason){
+        return record->trigger(reason);
+    }
+    std::string getSource(){
+        return record->getSource();
+    }
+    std::shared_ptr<BaseStream> getBaseStream(){
+        return baseStream;
+    }
 
     Result streamLive(std::shared_ptr<P2P> p2p, std::string label);
+    Result streamLiveTrack(std::shared_ptr<P2P> p2p);
+    Result stopLive(std::shared_ptr<P2P> p2p);
     Result streamRecord(std::shared_ptr<P2P> p2p, std::string label);
+    Result streamPlayback(std::shared_ptr<P2P> p2p, std::string label, const std::string& name, size_t offset){
+        return record->playback(p2p, label, name, offset);
+    }
+    Result exportClip(const std::string& name, int64_t startUs, int64_t endUs, RecordStream::ClipCallback done){
+        return record->exportClip(name, startUs, endUs, done);
+    }
+    Result streamPlaybackRange(std::shared_ptr<P2P> p2p, std::string label, const std::string& name, int64_t startUs, int64_t endUs){
+        return record->playbackRange(p2p, label, name, startUs, endUs);
+    }
 private:
     bool mCameraAvailable = false;
     bool mSupportRecord = false;
@@ -0,0 +1,199 @@
+#include "executor.h"
+#include <glog/logging.h>
+
+#define STRAND_BATCH 4  // tasks a strand runs before yielding to other cameras
+
+static thread_local int sWorkerIndex = -1;
+static thread_local bool sRanLocal = false;  // last task came off the local deque
+
+Executor& Executor::instance() {
+    static Executor executor;
+    return executor;
+}
+
+Executor::Executor() {
+    size_t count = std::thread::hardware_concurrency();
+    if (count == 0) {
+        count = 1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        mWorkers.push_back(std::make_unique<Worker>());
+    }
+    for (size_t i = 0; i < count; i++) {
+        mWorkers[i]->thread = std::thread(&Executor::workerThread, this, i);
+    }
+    LOG(INFO) << "Executor started with " << count << " worker threads";
+}
+
+Executor::~Executor() {
+    {
+        std::lock_guard<std::mutex> lock(mSleepMutex);
+        mRunning = false;
+    }
+    mSleepCondVar.notify_all();
+    for (auto& worker : mWorkers) {
+        if (worker->thread.joinable()) {
+            worker->thread.join();
+        }
+    }
+}
+
+void Executor::submit(TaskPriority priority, const void* owner, std::function<void()> task) {
+    ExecutorTask entry = {owner, std::move(task)};
+
+    if (sWorkerIndex >= 0 && (size_t)sWorkerIndex < mWorkers.size()) {
+        // Follow-up work stays hot in this worker's cache unless someone steals it
+        Worker& worker = *mWorkers[sWorkerIndex];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.local[priority].push_back(std::move(entry));
+    } else {
+        inject(priority, std::move(entry));
+        return;
+    }
+    wakeWorker();
+}
+
+void Executor::requeue(TaskPriority priority, const void* owner, std::function<void()> task) {
+    inject(priority, {owner, std::move(task)});
+}
+
+void Executor::inject(TaskPriority priority, ExecutorTask&& task) {
+    {
+        std::lock_guard<std::mutex> lock(mInjectionMutex);
+        mInjection[priority].cameras[task.owner].push_back(std::move(task));
+    }
+    wakeWorker();
+}
+
+void Executor::wakeWorker() {
+    mPending++;
+    {
+        std::lock_guard<std::mutex> lock(mSleepMutex);
+    }
+    mSleepCondVar.notify_one();
+}
+
+bool Executor::popInjected(TaskPriority priority, ExecutorTask& task) {
+    std::lock_guard<std::mutex> lock(mInjectionMutex);
+    Injection& injection = mInjection[priority];
+    if (injection.cameras.empty()) {
+        return false;
+    }
+
+    // Next camera after the one served last, so a busy camera can't starve the others
+    auto it = injection.cameras.upper_bound(injection.lastOwner);
+    if (it == injection.cameras.end()) {
+        it = injection.cameras.begin();
+    }
+
+    task = std::move(it->second.front());
+    it->second.pop_front();
+    injection.lastOwner = it->first;
+    if (it->second.empty()) {
+        injection.cameras.erase(it);
+    }
+    return true;
+}
+
+bool Executor::findTask(size_t index, ExecutorTask& task) {
+    for (int priority = 0; priority < TaskPriorityCount; priority++) {
+        // Local and round-robin work take turns, a camera's chain of follow-ups on
+        // this worker can't keep the other cameras waiting
+        if (sRanLocal && popInjected((TaskPriority)priority, task)) {
+            mPending--;
+            sRanLocal = false;
+            return true;
+        }
+
+        {
+            Worker& self = *mWorkers[index];
+            std::lock_guard<std::mutex> lock(self.mutex);
+            if (!self.local[priority].empty()) {
+                task = std::move(self.local[priority].back());
+                self.local[priority].pop_back();
+                mPending--;
+                sRanLocal = true;
+                return true;
+            }
+        }
+
+        if (popInjected((TaskPriority)priority, task)) {
+            mPending--;
+            sRanLocal = false;
+            return true;
+        }
+
+        // Steal the oldest task of another worker
+        for (size_t i = 1; i < mWorkers.size(); i++) {
+            Worker& victim = *mWorkers[(index + i) % mWorkers.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.local[priority].empty()) {
+                task = std::move(victim.local[priority].front());
+                victim.local[priority].pop_front();
+                mPending--;
+                sRanLocal = false;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void Executor::workerThread(size_t index) {
+    sWorkerIndex = (int)index;
+
+    while (true) {
+        ExecutorTask task;
+        if (findTask(index, task)) {
+            task.run();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(mSleepMutex);
+        mSleepCondVar.wait(lock, [this]() { return mPending > 0 || !mRunning; });
+        if (!mRunning) {
+            break;
+        }
+    }
+}
+
+void Strand::post(std::function<void()> task) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mTasks.push_back(std::move(task));
+    if (!mScheduled) {
+        mScheduled = true;
+        Executor::instance().submit(mPriority, mOwner, [this]() { drain(); });
+    }
+}
+
+void Strand::drain() {
+    for (int i = 0; i < STRAND_BATCH; i++) {
+        std::function<void()> task;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (mTasks.empty()) {
+                mScheduled = false;
+                mIdleCondVar.notify_all();
+                return;
+            }
+            task = std::move(mTasks.front());
+            mTasks.pop_front();
+        }
+        task();
+    }
+
+    // Still scheduled: through the round-robin, so the next camera in line runs before
+    // this strand's next batch
+    Executor::instance().requeue(mPriority, mOwner, [this]() { drain(); });
+}
+
+void Strand::waitIdle() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mIdleCondVar.wait(lock, [this]() { return !mScheduled && mTasks.empty(); });
+}
+
+size_t Strand::getPending() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mTasks.size();
+}
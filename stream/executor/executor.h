@@ -0,0 +1,97 @@
+#ifndef EXECUTOR
+#define EXECUTOR
+
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <map>
+#include <memory>
+
+// Lower value runs first: live frames always win over record transcoding
+typedef enum {
+    TaskLive,
+    TaskRecord,
+    TaskPriorityCount,
+} TaskPriority;
+
+struct ExecutorTask {
+    const void* owner;  // camera the task belongs to, for round-robin fairness
+    std::function<void()> run;
+};
+
+// Process-wide work-stealing pool sized to the core count, shared by all cameras.
+// Tasks queued from a worker stay on its local deque and idle workers steal them;
+// tasks from other threads go to per-camera queues served round-robin. A worker takes
+// from the round-robin between local tasks, so follow-up work can't starve other cameras.
+class Executor {
+public:
+    static Executor& instance();
+
+    void submit(TaskPriority priority, const void* owner, std::function<void()> task);
+    // Always through the per-camera round-robin, even from a worker: the task goes
+    // behind the other cameras' work instead of onto the hot local deque
+    void requeue(TaskPriority priority, const void* owner, std::function<void()> task);
+    size_t getThreadCount() const { return mWorkers.size(); }
+
+    Executor(const Executor&) = delete;
+    Executor& operator=(const Executor&) = delete;
+
+private:
+    Executor();
+    ~Executor();
+
+    struct Worker {
+        std::mutex mutex;
+        std::deque<ExecutorTask> local[TaskPriorityCount];
+        std::thread thread;
+    };
+
+    struct Injection {
+        std::map<const void*, std::deque<ExecutorTask>> cameras;
+        const void* lastOwner = nullptr;
+    };
+
+    void inject(TaskPriority priority, ExecutorTask&& task);
+    void wakeWorker();
+    void workerThread(size_t index);
+    bool findTask(size_t index, ExecutorTask& task);
+    bool popInjected(TaskPriority priority, ExecutorTask& task);
+
+    std::vector<std::unique_ptr<Worker>> mWorkers;
+    std::mutex mInjectionMutex;
+    Injection mInjection[TaskPriorityCount];
+
+    std::mutex mSleepMutex;
+    std::condition_variable mSleepCondVar;
+    std::atomic<size_t> mPending{0};
+    std::atomic<bool> mRunning{true};
+};
+
+// Runs posted tasks one at a time and in order on the shared executor, for state such
+// as codec contexts that must not be touched from two threads at once
+class Strand {
+public:
+    Strand(TaskPriority priority, const void* owner)
+        : mPriority(priority), mOwner(owner) {
+    }
+
+    void post(std::function<void()> task);
+    void waitIdle();
+    size_t getPending();
+
+private:
+    void drain();
+
+    TaskPriority mPriority;
+    const void* mOwner;
+    std::mutex mMutex;
+    std::condition_variable mIdleCondVar;
+    std::deque<std::function<void()>> mTasks;
+    bool mScheduled = false;
+};
+
+#endif
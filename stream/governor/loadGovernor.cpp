@@ -0,0 +1,85 @@
+#include "loadGovernor.h"
+#include "baseStream.h"
+
+#define GOVERNOR_TAG "governor"
+
+const char* LoadGovernor::levelToString(LoadLevel level) {
+    switch (level) {
+        case LoadNormal: return "Normal";
+        case LoadDropFrames: return "DropFrames";
+        case LoadLowerPreset: return "LowerPreset";
+        case LoadReduceResolution: return "ReduceResolution";
+        case LoadPauseRecord: return "PauseRecord";
+        default: return "Unknown";
+    }
+}
+
+void LoadGovernor::report(int64_t latencyUs, int64_t nowUs) {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    // EWMA with 1/8 weight, enough to ride out a single slow frame
+    int64_t smoothed = mSmoothedUs;
+    smoothed = smoothed == 0 ? latencyUs : smoothed + (latencyUs - smoothed) / 8;
+    mSmoothedUs = smoothed;
+
+    if (smoothed > mBudgetUs) {
+        mUnderSinceUs = -1;
+        if (mOverSinceUs < 0) {
+            mOverSinceUs = nowUs;
+        }
+    } else if (smoothed < mBudgetUs / 2) {
+        mOverSinceUs = -1;
+        if (mUnderSinceUs < 0) {
+            mUnderSinceUs = nowUs;
+        }
+    } else {
+        mOverSinceUs = -1;
+        mUnderSinceUs = -1;
+    }
+
+    if (nowUs - mLastChangeUs < GOVERNOR_SETTLE_US) {
+        return;
+    }
+
+    LoadLevel current = mLevel;
+    if (mOverSinceUs >= 0 && nowUs - mOverSinceUs >= GOVERNOR_SHED_HOLD_US && current < LoadPauseRecord) {
+        setLevel((LoadLevel)(current + 1), nowUs);
+    } else if (mUnderSinceUs >= 0 && nowUs - mUnderSinceUs >= GOVERNOR_RECOVER_HOLD_US && current > LoadNormal) {
+        setLevel((LoadLevel)(current - 1), nowUs);
+    }
+}
+
+void LoadGovernor::setLevel(LoadLevel level, int64_t nowUs) {
+    LoadLevel previous = mLevel;
+    mLevel = level;
+    mLastChangeUs = nowUs;
+    mOverSinceUs = -1;
+    mUnderSinceUs = -1;
+
+    if (level > previous) {
+        mShedCount[level]++;
+        LOG_TAG_WARNING(GOVERNOR_TAG, "Shed load " << levelToString(previous) << " -> " << levelToString(level)
+            << " (latency " << mSmoothedUs / 1000 << " ms, budget " << mBudgetUs / 1000 << " ms, count " << mShedCount[level] << ")");
+    } else {
+        mRecoverCount[previous]++;
+        LOG_TAG_INFO(GOVERNOR_TAG, "Recover load " << levelToString(previous) << " -> " << levelToString(level)
+            << " (latency " << mSmoothedUs / 1000 << " ms, count " << mRecoverCount[previous] << ")");
+    }
+}
+
+bool LoadGovernor::shouldDropFrame() {
+    if (mLevel < LoadDropFrames) {
+        return false;
+    }
+
+    // MJPEG frames are all intra, so dropping every other one is always safe
+    if ((mFrameCounter++ & 1) == 0) {
+        return false;
+    }
+
+    uint64_t dropped = ++mDroppedFrames;
+    if (dropped % 100 == 1) {
+        LOG_TAG_WARNING(GOVERNOR_TAG, "Dropped " << dropped << " frames before decode");
+    }
+    return true;
+}
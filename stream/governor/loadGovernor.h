@@ -0,0 +1,62 @@
+#ifndef LOAD_GOVERNOR
+#define LOAD_GOVERNOR
+
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+
+#define GOVERNOR_LATENCY_BUDGET_US   200000  // capture-to-send budget: 200 ms
+#define GOVERNOR_SHED_HOLD_US        1000000 // over budget for 1 s before shedding
+#define GOVERNOR_RECOVER_HOLD_US     3000000 // under half budget for 3 s before recovering
+#define GOVERNOR_SETTLE_US           2000000 // let a step take effect before the next one
+
+// Load shedding steps, applied in order and undone in reverse
+typedef enum {
+    LoadNormal,
+    LoadDropFrames,
+    LoadLowerPreset,
+    LoadReduceResolution,
+    LoadPauseRecord,
+    LoadLevelCount,
+} LoadLevel;
+
+class LoadGovernor {
+public:
+    LoadGovernor(int64_t budgetUs = GOVERNOR_LATENCY_BUDGET_US)
+        : mBudgetUs(budgetUs) {
+    }
+
+    // Called once per sent frame with its capture-to-send latency
+    void report(int64_t latencyUs, int64_t nowUs);
+
+    // Called for every captured packet, true if it should be dropped before decode
+    bool shouldDropFrame();
+
+    LoadLevel level() const { return mLevel; }
+    bool isRecordPaused() const { return mLevel >= LoadPauseRecord; }
+    int64_t getLatency() const { return mSmoothedUs; }
+
+    uint64_t getShedCount(LoadLevel level) const { return mShedCount[level]; }
+    uint64_t getRecoverCount(LoadLevel level) const { return mRecoverCount[level]; }
+    uint64_t getDroppedFrames() const { return mDroppedFrames; }
+
+    static const char* levelToString(LoadLevel level);
+
+private:
+    void setLevel(LoadLevel level, int64_t nowUs);
+
+    std::mutex mMutex;
+    int64_t mBudgetUs;
+    std::atomic<int64_t> mSmoothedUs{0};
+    std::atomic<LoadLevel> mLevel{LoadNormal};
+    int64_t mOverSinceUs = -1;
+    int64_t mUnderSinceUs = -1;
+    int64_t mLastChangeUs = 0;
+    uint32_t mFrameCounter = 0;
+
+    std::atomic<uint64_t> mShedCount[LoadLevelCount] = {};
+    std::atomic<uint64_t> mRecoverCount[LoadLevelCount] = {};
+    std::atomic<uint64_t> mDroppedFrames{0};
+};
+
+#endif
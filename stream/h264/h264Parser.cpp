@@ -0,0 +1,202 @@
+#include "h264Parser.h"
+
+std::vector<H264Nal> splitH264Nals(const uint8_t* data, size_t size) {
+    std::vector<H264Nal> nals;
+    size_t pos = 0;
+    size_t start = 0;
+    bool found = false;
+
+    while (pos + 3 <= size) {
+        // Both 3 and 4 byte start codes end with 00 00 01
+        if (data[pos] == 0x00 && data[pos + 1] == 0x00 && data[pos + 2] == 0x01) {
+            if (found) {
+                size_t end = pos;
+                if (end > start && data[end - 1] == 0x00) {
+                    end--;
+                }
+                nals.push_back({data + start, end - start, (uint8_t)(data[start] & 0x1F), (uint8_t)((data[start] >> 5) & 0x03)});
+            }
+            pos += 3;
+            start = pos;
+            found = pos < size;
+        } else {
+            pos++;
+        }
+    }
+
+    if (found && start < size) {
+        nals.push_back({data + start, size - start, (uint8_t)(data[start] & 0x1F), (uint8_t)((data[start] >> 5) & 0x03)});
+    }
+    return nals;
+}
+
+std::vector<uint8_t> unescapeH264Rbsp(const uint8_t* data, size_t size) {
+    std::vector<uint8_t> rbsp;
+    rbsp.reserve(size);
+    int zeros = 0;
+
+    for (size_t i = 0; i < size; i++) {
+        if (zeros >= 2 && data[i] == 0x03) {
+            zeros = 0;
+            continue;
+        }
+        zeros = data[i] == 0x00 ? zeros + 1 : 0;
+        rbsp.push_back(data[i]);
+    }
+    return rbsp;
+}
+
+bool hasH264RecoveryPoint(const H264Nal& nal) {
+    if (nal.type != H264_NAL_SEI || nal.size < 2) {
+        return false;
+    }
+
+    std::vector<uint8_t> rbsp = unescapeH264Rbsp(nal.data + 1, nal.size - 1);
+    size_t pos = 0;
+
+    // sei_message(): ff-coded payload type and size, then the payload
+    while (pos < rbsp.size() && rbsp[pos] != 0x80) {
+        uint32_t type = 0;
+        while (pos < rbsp.size() && rbsp[pos] == 0xFF) {
+            type += 255;
+            pos++;
+        }
+        if (pos >= rbsp.size()) {
+            break;
+        }
+        type += rbsp[pos++];
+
+        uint32_t payloadSize = 0;
+        while (pos < rbsp.size() && rbsp[pos] == 0xFF) {
+            payloadSize += 255;
+            pos++;
+        }
+        if (pos >= rbsp.size()) {
+            break;
+        }
+        payloadSize += rbsp[pos++];
+
+        if (type == H264_SEI_RECOVERY_POINT) {
+            return true;
+        }
+        pos += payloadSize;
+    }
+    return false;
+}
+
+bool isH264EntryPoint(const uint8_t* data, size_t size) {
+    for (const H264Nal& nal : splitH264Nals(data, size)) {
+        if (nal.type == H264_NAL_IDR || hasH264RecoveryPoint(nal)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Exp-Golomb ue(v) reader, enough for the first fields of a slice header
+static bool readH264Ue(const std::vector<uint8_t>& rbsp, size_t& bit, uint32_t& value) {
+    int zeros = 0;
+    while (bit < rbsp.size() * 8 && !((rbsp[bit / 8] >> (7 - bit % 8)) & 1)) {
+        zeros++;
+        bit++;
+    }
+    if (zeros > 31 || bit + zeros >= rbsp.size() * 8) {
+        return false;
+    }
+    bit++;
+
+    value = 0;
+    for (int i = 0; i < zeros; i++, bit++) {
+        value = (value << 1) | ((rbsp[bit / 8] >> (7 - bit % 8)) & 1);
+    }
+    value += (1u << zeros) - 1;
+    return true;
+}
+
+int parseH264SliceType(const H264Nal& nal) {
+    if ((nal.type != H264_NAL_SLICE && nal.type != H264_NAL_IDR) || nal.size < 2) {
+        return -1;
+    }
+
+    // first_mb_in_slice and slice_type fit in the first few bytes
+    std::vector<uint8_t> rbsp = unescapeH264Rbsp(nal.data + 1, nal.size - 1 < 16 ? nal.size - 1 : 16);
+    size_t bit = 0;
+    uint32_t firstMb = 0;
+    uint32_t sliceType = 0;
+    if (!readH264Ue(rbsp, bit, firstMb) || !readH264Ue(rbsp, bit, sliceType)) {
+        return -1;
+    }
+    return (int)(sliceType % 5);
+}
+
+H264FrameInfo classifyH264Frame(const uint8_t* data, size_t size) {
+    H264FrameInfo info = {false, false, false, -1};
+
+    for (const H264Nal& nal : splitH264Nals(data, size)) {
+        if (nal.type == H264_NAL_SLICE || nal.type == H264_NAL_IDR) {
+            info.idr |= nal.type == H264_NAL_IDR;
+            info.reference |= nal.refIdc != 0;
+            if (info.sliceType < 0) {
+                info.sliceType = parseH264SliceType(nal);
+            }
+        } else if (hasH264RecoveryPoint(nal)) {
+            info.entryPoint = true;
+        }
+    }
+    info.entryPoint |= info.idr;
+    return info;
+}
+
+std::vector<uint8_t> buildH264AvcC(const uint8_t* data, size_t size) {
+    std::vector<H264Nal> sps;
+    std::vector<H264Nal> pps;
+    for (const H264Nal& nal : splitH264Nals(data, size)) {
+        if (nal.type == H264_NAL_SPS && nal.size >= 4) {
+            sps.push_back(nal);
+        } else if (nal.type == H264_NAL_PPS) {
+            pps.push_back(nal);
+        }
+    }
+
+    std::vector<uint8_t> avcc;
+    if (sps.empty() || pps.empty()) {
+        return avcc;
+    }
+
+    // version, profile, compatibility, level, then 4 byte NAL lengths
+    avcc.push_back(1);
+    avcc.push_back(sps[0].data[1]);
+    avcc.push_back(sps[0].data[2]);
+    avcc.push_back(sps[0].data[3]);
+    avcc.push_back(0xFF);
+
+    avcc.push_back(0xE0 | (uint8_t)sps.size());
+    for (const H264Nal& nal : sps) {
+        avcc.push_back((uint8_t)(nal.size >> 8));
+        avcc.push_back((uint8_t)nal.size);
+        avcc.insert(avcc.end(), nal.data, nal.data + nal.size);
+    }
+    avcc.push_back((uint8_t)pps.size());
+    for (const H264Nal& nal : pps) {
+        avcc.push_back((uint8_t)(nal.size >> 8));
+        avcc.push_back((uint8_t)nal.size);
+        avcc.insert(avcc.end(), nal.data, nal.data + nal.size);
+    }
+    return avcc;
+}
+
+void convertH264ToAvcc(const uint8_t* data, size_t size, std::vector<uint8_t>& out) {
+    out.clear();
+    out.reserve(size + 16);
+
+    for (const H264Nal& nal : splitH264Nals(data, size)) {
+        if (nal.type == H264_NAL_AUD) {
+            continue;
+        }
+        out.push_back((uint8_t)(nal.size >> 24));
+        out.push_back((uint8_t)(nal.size >> 16));
+        out.push_back((uint8_t)(nal.size >> 8));
+        out.push_back((uint8_t)nal.size);
+        out.insert(out.end(), nal.data, nal.data + nal.size);
+    }
+}
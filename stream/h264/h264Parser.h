@@ -0,0 +1,59 @@
+#ifndef H264_PARSER
+#define H264_PARSER
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#define H264_NAL_SLICE  1
+#define H264_NAL_IDR    5
+#define H264_NAL_SEI    6
+#define H264_NAL_SPS    7
+#define H264_NAL_PPS    8
+#define H264_NAL_AUD    9
+
+#define H264_SEI_RECOVERY_POINT 6
+
+#define H264_SLICE_P 0
+#define H264_SLICE_B 1
+#define H264_SLICE_I 2
+
+// One NAL unit inside an Annex-B buffer, data points past the start code
+struct H264Nal {
+    const uint8_t* data;
+    size_t size;
+    uint8_t type;
+    uint8_t refIdc;
+};
+
+// Summary of one encoded access unit, used to decide what can be dropped
+struct H264FrameInfo {
+    bool idr;
+    bool entryPoint;   // IDR or recovery point, a decoder can start here
+    bool reference;    // nal_ref_idc != 0, later frames depend on it
+    int sliceType;     // H264_SLICE_*, -1 if no slice was found
+};
+
+std::vector<H264Nal> splitH264Nals(const uint8_t* data, size_t size);
+
+// Strip emulation prevention bytes (00 00 03) from a NAL payload
+std::vector<uint8_t> unescapeH264Rbsp(const uint8_t* data, size_t size);
+
+// True if the SEI NAL carries a recovery point message (periodic intra refresh)
+bool hasH264RecoveryPoint(const H264Nal& nal);
+
+// True if a decoder can start from this access unit: an IDR or a recovery point
+bool isH264EntryPoint(const uint8_t* data, size_t size);
+
+// Slice type of a VCL NAL from its slice header, -1 if not a slice
+int parseH264SliceType(const H264Nal& nal);
+
+H264FrameInfo classifyH264Frame(const uint8_t* data, size_t size);
+
+// AVCDecoderConfigurationRecord from the SPS/PPS of an Annex-B buffer, empty if none
+std::vector<uint8_t> buildH264AvcC(const uint8_t* data, size_t size);
+
+// Annex-B to 4 byte length prefixed NALs as stored in MP4, access unit delimiters are dropped
+void convertH264ToAvcc(const uint8_t* data, size_t size, std::vector<uint8_t>& out);
+
+#endif
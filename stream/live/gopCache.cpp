@@ -0,0 +1,36 @@
+#include "gopCache.h"
+#include "h264Parser.h"
+
+void GopCache::push(const AVPacket* packet) {
+    if (isH264EntryPoint(packet->data, packet->size)) {
+        clear();
+        mValid = true;
+    }
+
+    if (!mValid) {
+        return;
+    }
+
+    // A refresh period that outgrows the cache can't be replayed, wait for the next entry point
+    if (mBytes + packet->size > GOP_CACHE_MAX_BYTES) {
+        LOG(WARNING) << "GOP cache overflow (" << mBytes << " bytes), waiting for next entry point";
+        clear();
+        return;
+    }
+
+    // Cloning only takes a reference on the encoder buffer
+    AVPacket* cached = av_packet_clone(packet);
+    if (cached) {
+        mPackets.push_back(cached);
+        mBytes += packet->size;
+    }
+}
+
+void GopCache::clear() {
+    for (AVPacket* cached : mPackets) {
+        av_packet_free(&cached);
+    }
+    mPackets.clear();
+    mBytes = 0;
+    mValid = false;
+}
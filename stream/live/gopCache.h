@@ -0,0 +1,28 @@
+#ifndef GOP_CACHE
+#define GOP_CACHE
+
+#include "baseStream.h"
+#include <vector>
+
+#define GOP_CACHE_MAX_BYTES (4 * 1024 * 1024)
+
+// Encoded packets since the last decoder entry point (IDR or recovery point SEI),
+// replayed to a viewer that joins mid-stream
+class GopCache {
+public:
+    ~GopCache() {
+        clear();
+    }
+
+    void push(const AVPacket* packet);
+    void clear();
+    bool isValid() const { return mValid; }
+    const std::vector<AVPacket*>& packets() const { return mPackets; }
+
+private:
+    std::vector<AVPacket*> mPackets;
+    size_t mBytes = 0;
+    bool mValid = false;
+};
+
+#endif
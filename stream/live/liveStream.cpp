@@ -1,8 +1,14 @@
 #include "liveStream.h"
+#include "h264Parser.h"
+#include <algorithm>
 #include <cstring>
 #include <iomanip>
 #include <stdio.h>
 
+extern "C" {
+#include <libavutil/time.h>
+}
+
 
 #define av_err2str_cpp(errnum) \
     ({ char error_string[AV_ERROR_MAX_STRING_SIZE] = {0}; \
@@ -35,10 +41,37 @@ static void log_packet_tb(AVRational *time_base_ctx, const AVPacket *pkt)
 Result LiveStream::start() {
     CAMERA_ASSERT(mState != CameraStarted);
 
+    Result result = openDecoder();
+    if (result != Result::SUCCESS) {
+        return result;
+    }
+
+    // // Optional: Send SPS/PPS once
+    // if (encoder_ctx->extradata && encoder_ctx->extradata_size > 0) {
+    //     transport->streamBuffereToChannel(mLabel, encoder_ctx->extradata, encoder_ctx->extradata_size);
+    // }
+
+    output_file = fopen("output.h264", "wb");
+
+    // 2. Encoder: H246
+    result = openEncoder(decoder_ctx->width, decoder_ctx->height, LIVE_ENCODER_PRESET, LIVE_ENCODER_B_FRAMES);
+    if (result != Result::SUCCESS) {
+        return result;
+    }
+
+    // 3. SWS context: MJPEG may not be YUV420P
+    result = openScaler(LoadNormal);
+    if (result != Result::SUCCESS) {
+        return result;
+    }
+
+    frame = av_frame_alloc();
+    encoded_packet = av_packet_alloc();
+
     mRunning = true; 
-    mThread = std::thread(&LiveStream::liveThread, this);
+    baseStream->addPacketListener(this, [this](const AVPacket* packet) { onPacket(packet); });
 
-    LOG(INFO) << "Streaming started on a separate thread!";
+    LOG(INFO) << "Streaming started on the shared executor!";
     mState = CameraStarted;
 
     return Result::SUCCESS;
@@ -48,8 +81,39 @@ Result LiveStream::stop() {
     CAMERA_ASSERT(mState != CameraClosed);
 
     mRunning = false;  
-    if (mThread.joinable()) {
-        mThread.join();  
+    baseStream->removePacketListener(this);
+    mDecodeStrand.waitIdle();
+    mEncodeStrand.waitIdle();
+    {
+        // A later start begins with no viewers, nothing is pushed into these queues again
+        std::lock_guard<std::mutex> lock(mViewerMutex);
+        for (Viewer& viewer : mViewers) {
+            viewer.queue->stop();
+        }
+        mViewers.clear();
+        mP2P = false;
+
+        if (mTrackTransport) {
+            mTrackTransport->onKeyframeRequest(nullptr);
+        }
+        mTrack = false;
+        mTrackTransport = nullptr;
+        mTrackWaitKeyframe = true;
+    }
+
+    closeEncoder();
+    if (sws_ctx) {
+        sws_freeContext(sws_ctx);
+        sws_ctx = nullptr;
+    }
+    av_frame_free(&frame);
+    av_packet_free(&encoded_packet);
+    if (decoder_ctx) {
+        avcodec_free_context(&decoder_ctx);
+    }
+    if (output_file) {
+        fclose(output_file);
+        output_file = nullptr;
     }
     mState = CameraClosed;
 
@@ -130,59 +194,100 @@ void showExtradata(uint8_t *extradata, size_t extradata_size) {
     std::cout << std::endl;  
 }
 
-void LiveStream::liveThread() {
-    AVPacket* packet = av_packet_alloc(); 
-    int64_t last_pts = AV_NOPTS_VALUE;  // Track last PTS to ensure monotonic increase
-
+Result LiveStream::openDecoder() {
     // 1. Decoder: MJPEG
-    // const AVCodec* decoder = avcodec_find_decoder(AV_CODEC_ID_MJPEG);
-    // if (!decoder) {
-    //     LOG(ERROR) << "MJPEG decoder not found";
-    //     return;
-    // }
     const AVCodec* decoder = avcodec_find_decoder(baseStream->format_ctx->streams[baseStream->video_stream_index]->codecpar->codec_id);
     if (!decoder) {
         LOG(ERROR) << "Failed to find decoder for input.";
-        return; 
+        return Result::INVALID_ARGUMENT; 
     }
 
-
     decoder_ctx = avcodec_alloc_context3(decoder);
     avcodec_parameters_to_context(decoder_ctx, baseStream->format_ctx->streams[baseStream->video_stream_index]->codecpar);
     if (avcodec_open2(decoder_ctx, decoder, nullptr) < 0) {
         LOG(ERROR) << "Failed to open MJPEG decoder";
-        return;
+        avcodec_free_context(&decoder_ctx);
+        return Result::INVALID_ARGUMENT;
     }
 
-    // 2. Encoder: H246
+    if (decoder_ctx->pix_fmt == AV_PIX_FMT_YUVJ420P ||
+        decoder_ctx->pix_fmt == AV_PIX_FMT_YUVJ422P ||
+        decoder_ctx->pix_fmt == AV_PIX_FMT_YUVJ444P) {
+        LOG(WARNING) << "Converting JPEG-based pixel format to YUV420P.";
+        decoder_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+    }
+    return Result::SUCCESS;
+}
+
+void LiveStream::getEncodeSize(LoadLevel level, int& width, int& height) {
+    bool reduceResolution = level >= LoadReduceResolution;
+    width = reduceResolution ? (decoder_ctx->width / 2) & ~1 : decoder_ctx->width;
+    height = reduceResolution ? (decoder_ctx->height / 2) & ~1 : decoder_ctx->height;
+}
+
+Result LiveStream::openScaler(LoadLevel level) {
+    getEncodeSize(level, mScaleWidth, mScaleHeight);
+
+    if (sws_ctx) {
+        sws_freeContext(sws_ctx);
+    }
+    sws_ctx = sws_getContext(
+        decoder_ctx->width, decoder_ctx->height, decoder_ctx->pix_fmt,
+        mScaleWidth, mScaleHeight, AV_PIX_FMT_YUV420P,
+        SWS_BILINEAR, nullptr, nullptr, nullptr
+    );
+    mScaleLevel = level;
+    return sws_ctx ? Result::SUCCESS : Result::INVALID_ARGUMENT;
+}
+
+Result LiveStream::openEncoder(int width, int height, const char* preset, int maxBFrames) {
     const AVCodec* encoder = avcodec_find_encoder(AV_CODEC_ID_H264);
     if (!encoder) {
         LOG(ERROR) << "H264 encoder not found";
-        return;
+        return Result::INVALID_ARGUMENT;
     }
 
     encoder_ctx = avcodec_alloc_context3(encoder);
 
     uint8_t fps = baseStream->getFps();
-    // Lower resolution and bitrate for lightweight encoding
-    encoder_ctx->bit_rate = 5000000; // Lower bitrate: 5000 kbps (360p)
-    encoder_ctx->width = decoder_ctx->width;       // Downscale to 640x360 (360p)
-    encoder_ctx->height = decoder_ctx->height;
+    encoder_ctx->bit_rate = LIVE_ENCODER_BITRATE;
+    encoder_ctx->width = width;
+    encoder_ctx->height = height;
     encoder_ctx->time_base = AVRational{1, fps}; 
     encoder_ctx->framerate = AVRational{fps, 1};
-    encoder_ctx->gop_size = 50;      
-    encoder_ctx->max_b_frames = 2;   
+    encoder_ctx->gop_size = LIVE_ENCODER_GOP;      
+    encoder_ctx->max_b_frames = maxBFrames;   
     encoder_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
     encoder_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    encoder_ctx->thread_count = 1; // parallelism comes from the shared executor, not x264 threads
 
     // Set encoder options for fast encoding
-    av_opt_set(encoder_ctx->priv_data, "preset", "ultrafast", 0); // Fastest encoding preset
+    av_opt_set(encoder_ctx->priv_data, "preset", preset, 0);
     av_opt_set(encoder_ctx->priv_data, "tune", "zerolatency", 0); // Low latency
     av_opt_set(encoder_ctx->priv_data, "flags", "+cgop", 0);      // Closed GOP
+    av_opt_set(encoder_ctx->priv_data, "forced-idr", "1", 0);     // Keyframes asked for by PLI are IDRs
+
+    if (mIntraRefresh) {
+        // Sweep an intra column across each second of frames instead of sending IDR bursts,
+        // and cap the VBV at one frame so every frame lands near the average size
+        encoder_ctx->gop_size = fps;
+        encoder_ctx->max_b_frames = 0;
+        encoder_ctx->rc_max_rate = LIVE_ENCODER_BITRATE;
+        encoder_ctx->rc_buffer_size = LIVE_ENCODER_BITRATE / fps;
+        av_opt_set(encoder_ctx->priv_data, "intra-refresh", "1", 0);
+    }
+
+    if (mTrack) {
+        // The track's SDP offers constrained baseline and the RTP timestamp follows pts,
+        // so reordered frames would step it backwards
+        encoder_ctx->max_b_frames = 0;
+        av_opt_set(encoder_ctx->priv_data, "profile", "baseline", 0);
+    }
 
     if (avcodec_open2(encoder_ctx, encoder, nullptr) < 0) {
         LOG(ERROR) << "Failed to open H264 encoder";
-        return;
+        avcodec_free_context(&encoder_ctx);
+        return Result::INVALID_ARGUMENT;
     }
 
     if (encoder_ctx->extradata_size > 0) {
@@ -193,95 +298,342 @@ void LiveStream::liveThread() {
         LOG(ERROR) << "Encoder extradata is still empty!";
     }
 
-    if (decoder_ctx->pix_fmt == AV_PIX_FMT_YUVJ420P ||
-        decoder_ctx->pix_fmt == AV_PIX_FMT_YUVJ422P ||
-        decoder_ctx->pix_fmt == AV_PIX_FMT_YUVJ444P) {
-        LOG(WARNING) << "Converting JPEG-based pixel format to YUV420P.";
-        decoder_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+    if (output_file && encoder_ctx->extradata && encoder_ctx->extradata_size > 0) {
+        fwrite(encoder_ctx->extradata, 1, encoder_ctx->extradata_size, output_file);
     }
 
+    // New parameter sets: viewers need the extradata again before the next entry point
+    mGopCache.clear();
+    {
+        std::lock_guard<std::mutex> lock(mViewerMutex);
+        for (Viewer& viewer : mViewers) {
+            viewer.joinPending = true;
+        }
+    }
 
-    // 3. SWS context: MJPEG may not be YUV420P
-    sws_ctx = sws_getContext(
-        decoder_ctx->width, decoder_ctx->height, decoder_ctx->pix_fmt,
-        encoder_ctx->width, encoder_ctx->height, encoder_ctx->pix_fmt,
-        SWS_BILINEAR, nullptr, nullptr, nullptr
-    );
-    
-    frame = av_frame_alloc();
-    yuv_frame = av_frame_alloc();
-    yuv_frame->format = encoder_ctx->pix_fmt;
-    yuv_frame->width = encoder_ctx->width;
-    yuv_frame->height = encoder_ctx->height;
-    av_image_alloc(yuv_frame->data, yuv_frame->linesize, yuv_frame->width, yuv_frame->height, encoder_ctx->pix_fmt, 32);
+    LOG(INFO) << "Live encoder " << width << "x" << height << " preset " << preset
+              << " b-frames " << encoder_ctx->max_b_frames << (mIntraRefresh ? " intra-refresh" : "")
+              << (mTrack ? " baseline" : "");
+    return Result::SUCCESS;
+}
 
-    // // Optional: Send SPS/PPS once
-    // if (encoder_ctx->extradata && encoder_ctx->extradata_size > 0) {
-    //     transport->streamBuffereToChannel(mLabel, encoder_ctx->extradata, encoder_ctx->extradata_size);
-    // }
+void LiveStream::closeEncoder() {
+    if (encoder_ctx) {
+        avcodec_free_context(&encoder_ctx);
+        encoder_ctx = nullptr;
+    }
+    mCaptureTimes.clear();
+}
 
-    FILE *output_file = fopen("output.h264", "wb");
+Result LiveStream::applyLoadLevel(LoadLevel level) {
+    bool lowerPreset = level >= LoadLowerPreset;
+    bool reduceResolution = level >= LoadReduceResolution;
 
+    // DropFrames and PauseRecord need no encoder change
+    if (encoder_ctx && lowerPreset == (mLoadLevel >= LoadLowerPreset) && reduceResolution == (mLoadLevel >= LoadReduceResolution)) {
+        mLoadLevel = level;
+        return Result::SUCCESS;
+    }
+
+    LOG_TAG_INFO(baseStream->file_name, "Reconfigure live encoder for load level " << LoadGovernor::levelToString(level));
+    mLoadLevel = level;
+    return reopenEncoder();
+}
+
+Result LiveStream::reopenEncoder() {
+    // "ultrafast" is already the floor for x264, so the cheaper step also drops the B-frame lookahead
+    bool lowerPreset = mLoadLevel >= LoadLowerPreset;
+    int width, height;
+    getEncodeSize(mLoadLevel, width, height);
+    const char* preset = lowerPreset ? "ultrafast" : LIVE_ENCODER_PRESET;
+    int maxBFrames = lowerPreset ? 0 : LIVE_ENCODER_B_FRAMES;
+
+    closeEncoder();
+    return openEncoder(width, height, preset, maxBFrames);
+}
+
+int64_t LiveStream::getCaptureTime(const AVPacket* packet) {
+    int64_t now = av_gettime_relative();
+    if (packet->pts == AV_NOPTS_VALUE) {
+        return now;
+    }
+
+    // v4l2 stamps buffers with CLOCK_MONOTONIC, so kernel-side queueing shows up as latency
+    AVRational time_base = baseStream->format_ctx->streams[baseStream->video_stream_index]->time_base;
+    int64_t captured = av_rescale_q(packet->pts, time_base, AVRational{1, 1000000});
+    if (captured > now || now - captured > 10 * 1000000) {
+        return now;
+    }
+    return captured;
+}
+
+EncodedFrame LiveStream::makeFrame(const AVPacket* packet) {
+    H264FrameInfo info = classifyH264Frame(packet->data, packet->size);
+    EncodedFrame encoded;
+    encoded.data = sharePacketData(packet);
+    encoded.size = packet->size;
+    encoded.pts = av_rescale_q(packet->pts, encoder_ctx->time_base, AVRational{1, 1000000});
+    encoded.flags = (info.entryPoint ? FRAME_FLAG_KEY : 0) | (info.reference ? FRAME_FLAG_REFERENCE : 0);
+    return encoded;
+}
+
+EncodedFrame LiveStream::makeConfigFrame() {
+    EncodedFrame encoded;
+    encoded.data = copyFrameData(encoder_ctx->extradata, encoder_ctx->extradata_size);
+    encoded.size = encoder_ctx->extradata_size;
+    encoded.pts = MEDIA_NO_PTS;
+    encoded.flags = FRAME_FLAG_CONFIG;
+    return encoded;
+}
+
+void LiveStream::sendTrackPacket(const AVPacket* packet) {
+    if (!mTrackTransport->isVideoTrackOpen()) {
+        mTrackWaitKeyframe = true;
+        return;
+    }
+    bool key = packet->flags & AV_PKT_FLAG_KEY;
+    if (mTrackWaitKeyframe) {
+        // A receiver that just connected can only start on an IDR
+        if (!key) {
+            mForceKeyframe = true;
+            return;
+        }
+        mTrackWaitKeyframe = false;
+    }
+
+    int64_t pts = av_rescale_q(packet->pts, encoder_ctx->time_base, AVRational{1, 1000000});
+    if (key && encoder_ctx->extradata && encoder_ctx->extradata_size > 0) {
+        // Global headers keep SPS/PPS out of band, RTP carries them in front of every IDR
+        mTrackBuffer.assign(encoder_ctx->extradata, encoder_ctx->extradata + encoder_ctx->extradata_size);
+        mTrackBuffer.insert(mTrackBuffer.end(), packet->data, packet->data + packet->size);
+        mTrackTransport->sendVideoFrame(mTrackBuffer.data(), mTrackBuffer.size(), pts);
+    } else {
+        mTrackTransport->sendVideoFrame(packet->data, packet->size, pts);
+    }
+}
+
+void LiveStream::sendGopCache(Viewer& viewer) {
+    // Nothing decodable yet, keep the viewer waiting for the next entry point
+    if (!mGopCache.isValid()) {
+        return;
+    }
+
+    // One burst, pushed frame by frame the queue limits would cut it off mid GOP
+    std::vector<EncodedFrame> replay;
     if (encoder_ctx->extradata && encoder_ctx->extradata_size > 0) {
-        fwrite(encoder_ctx->extradata, 1, encoder_ctx->extradata_size, output_file);
+        replay.push_back(makeConfigFrame());
+    }
+    for (const AVPacket* cached : mGopCache.packets()) {
+        replay.push_back(makeFrame(cached));
+    }
+    viewer.queue->pushReplay(replay);
+    LOG(INFO) << "Sent " << mGopCache.packets().size() << " cached packets to joining viewer on " << viewer.label;
+    viewer.joinPending = false;
+}
+
+void LiveStream::sendToViewers(const AVPacket* packet) {
+    std::lock_guard<std::mutex> lock(mViewerMutex);
+    // One reference to the encoder's buffer, shared by every queue that takes it
+    EncodedFrame encoded;
+    bool made = false;
+    for (Viewer& viewer : mViewers) {
+        if (viewer.joinPending) {
+            sendGopCache(viewer);  // the cache already holds this packet
+            continue;
+        }
+        if (!made) {
+            encoded = makeFrame(packet);
+            made = true;
+        }
+        viewer.queue->push(encoded);
     }
+}
 
-    while (mRunning) {
-        if (av_read_frame(baseStream->format_ctx, packet) >= 0 && (mState == CameraStarted)) {
-            if (packet->stream_index == baseStream->video_stream_index) {\
-                // video
-                if(packet->size > 0){
-                avcodec_send_packet(decoder_ctx, packet);
-                while (avcodec_receive_frame(decoder_ctx, frame) >= 0) {
-                    sws_scale(sws_ctx, frame->data, frame->linesize, 0, frame->height, yuv_frame->data, yuv_frame->linesize);
+void LiveStream::onPacket(const AVPacket* packet) {
+    if (!mRunning || baseStream->governor.shouldDropFrame()) {
+        return;
+    }
 
-                    yuv_frame->pts = av_rescale_q(frame->pts, baseStream->format_ctx->streams[baseStream->video_stream_index]->time_base, encoder_ctx->time_base);
-                    if (yuv_frame->pts != AV_NOPTS_VALUE && yuv_frame->pts <= last_pts) {
-                        yuv_frame->pts = last_pts + 1;  
-                    }
-                    last_pts = yuv_frame->pts;
-
-                    avcodec_send_frame(encoder_ctx, yuv_frame);
-                    while (avcodec_receive_packet(encoder_ctx, packet) >= 0) {
-                        if (packet->pts < packet->dts) {
-                            packet->pts = packet->dts;
-                        }
-                        //LOG(INFO) << "[Revice packet size: " << packet->size << " pts:" << packet->pts << " dts:" << packet->dts << "]";
-                        //log_packet_tb(&encoder_ctx->time_base, packet);
-                        if (output_file) {
-                            uint8_t *buffer = (uint8_t *)malloc(packet->size);
-                            if (buffer) {
-                                memcpy(buffer, packet->data, packet->size);  
-                                fwrite(buffer, 1, packet->size, output_file); 
-                                free(buffer); 
-                            } else {
-                                LOG(ERROR) << "Failed to allocate memory for buffer!";
-                            }
-                        }
-
-                        if (mP2P) {
-                            std::vector<uint8_t> packet_copy(packet->data, packet->data + packet->size);
-                            if (!transport->streamBuffereToChannel(mLabel, packet_copy.data(), packet_copy.size())) {
-                                LOG(ERROR) << "Failed to send file data over DataChannel";
-                            }
-                        }
-
-                        av_packet_unref(packet);
-                    }
-                }
-            }
-            av_packet_unref(packet);
+    // Encoding fell behind: drop compressed input here instead of queueing raw frames without bound
+    if (mDecodeStrand.getPending() + mEncodeStrand.getPending() >= LIVE_MAX_PENDING) {
+        if (++mBacklogDrops % 100 == 1) {
+            LOG_TAG_WARNING(baseStream->file_name, "Live pipeline backlog, dropped " << mBacklogDrops << " packets");
+        }
+        return;
+    }
+
+    int64_t capture_time = getCaptureTime(packet);
+    AVPacket* cloned = av_packet_clone(packet);
+    if (!cloned) {
+        return;
+    }
+    mDecodeStrand.post([this, cloned, capture_time]() { decodePacket(cloned, capture_time); });
+}
+
+void LiveStream::decodePacket(AVPacket* packet, int64_t capture_time) {
+    LoadLevel level = baseStream->governor.level();
+    if (level != mScaleLevel) {
+        if (openScaler(level) != Result::SUCCESS) {
+            LOG(ERROR) << "Failed to create scaler for load level " << LoadGovernor::levelToString(level);
+        }
+        // Queued behind the frames already scaled at the old size
+        mEncodeStrand.post([this, level]() {
+            if (applyLoadLevel(level) != Result::SUCCESS) {
+                LOG(ERROR) << "Failed to apply load level " << LoadGovernor::levelToString(level);
             }
+        });
+    }
+
+    avcodec_send_packet(decoder_ctx, packet);
+    av_packet_free(&packet);
+
+    AVRational input_time_base = baseStream->format_ctx->streams[baseStream->video_stream_index]->time_base;
+    AVRational encode_time_base = AVRational{1, baseStream->getFps()};
+
+    while (avcodec_receive_frame(decoder_ctx, frame) >= 0) {
+        if (!sws_ctx) {
+            continue;
         }
+
+        AVFrame* yuv_frame = av_frame_alloc();
+        yuv_frame->format = AV_PIX_FMT_YUV420P;
+        yuv_frame->width = mScaleWidth;
+        yuv_frame->height = mScaleHeight;
+        if (av_frame_get_buffer(yuv_frame, 32) < 0) {
+            LOG(ERROR) << "Failed to allocate scaled frame";
+            av_frame_free(&yuv_frame);
+            continue;
+        }
+        sws_scale(sws_ctx, frame->data, frame->linesize, 0, frame->height, yuv_frame->data, yuv_frame->linesize);
+
+        yuv_frame->pts = av_rescale_q(frame->pts, input_time_base, encode_time_base);
+        if (yuv_frame->pts != AV_NOPTS_VALUE && yuv_frame->pts <= mLastPts) {
+            yuv_frame->pts = mLastPts + 1;  
+        }
+        mLastPts = yuv_frame->pts;
+
+        mEncodeStrand.post([this, yuv_frame, capture_time]() { encodeFrame(yuv_frame, capture_time); });
     }
 }
 
+void LiveStream::encodeFrame(AVFrame* yuv_frame, int64_t capture_time) {
+    if (!encoder_ctx) {
+        av_frame_free(&yuv_frame);
+        return;
+    }
+
+    if (mForceKeyframe) {
+        int64_t now = av_gettime_relative();
+        if (now - mLastForcedKeyframe >= LIVE_KEYFRAME_MIN_INTERVAL_US) {
+            mForceKeyframe = false;
+            mLastForcedKeyframe = now;
+            yuv_frame->pict_type = AV_PICTURE_TYPE_I;
+        }
+    }
+
+    mCaptureTimes[yuv_frame->pts] = capture_time;
+    avcodec_send_frame(encoder_ctx, yuv_frame);
+    av_frame_free(&yuv_frame);
+
+    AVPacket* packet = encoded_packet;
+    while (avcodec_receive_packet(encoder_ctx, packet) >= 0) {
+        if (packet->pts < packet->dts) {
+            packet->pts = packet->dts;
+        }
+        //LOG(INFO) << "[Revice packet size: " << packet->size << " pts:" << packet->pts << " dts:" << packet->dts << "]";
+        //log_packet_tb(&encoder_ctx->time_base, packet);
+        if (output_file) {
+            fwrite(packet->data, 1, packet->size, output_file); 
+        }
+
+        mGopCache.push(packet);
+        if (mP2P) {
+            sendToViewers(packet);
+        }
+        if (mTrack) {
+            sendTrackPacket(packet);
+        }
+
+        auto captured = mCaptureTimes.find(packet->pts);
+        if (captured != mCaptureTimes.end()) {
+            int64_t now = av_gettime_relative();
+            baseStream->governor.report(now - captured->second, now);
+            mCaptureTimes.erase(captured);
+        }
+        // Frames with pts up to dts have all left the encoder
+        mCaptureTimes.erase(mCaptureTimes.begin(), mCaptureTimes.upper_bound(packet->dts));
+
+        av_packet_unref(packet);
+    }
+}
 
 Result LiveStream::stream(std::shared_ptr<P2P> p2p, std::string label){
     CAMERA_ASSERT(mState != CameraClosed);
 
-    mLabel = label;
-    transport = p2p;
+    std::lock_guard<std::mutex> lock(mViewerMutex);
+    for (const Viewer& viewer : mViewers) {
+        if (viewer.transport == p2p) {
+            LOG(WARNING) << "Live stream already sent to " << viewer.label;
+            return Result::INVALID_STATE;
+        }
+    }
+
+    Viewer viewer;
+    viewer.transport = p2p;
+    viewer.label = label;
+    viewer.queue = std::make_unique<SendQueue>(p2p, label);
+    viewer.queue->setCoalescing(mCoalesceUs);
+    viewer.queue->start();
+    mViewers.push_back(std::move(viewer));
     mP2P = true;
+    LOG(INFO) << "Live viewer added on " << label << ", " << mViewers.size() << " watching";
     return Result::SUCCESS;
-}
\ No newline at end of file
+}
+
+Result LiveStream::stopStream(std::shared_ptr<P2P> p2p) {
+    std::unique_ptr<SendQueue> queue;
+    {
+        std::lock_guard<std::mutex> lock(mViewerMutex);
+        auto it = std::find_if(mViewers.begin(), mViewers.end(),
+                               [&p2p](const Viewer& viewer) { return viewer.transport == p2p; });
+        if (it == mViewers.end()) {
+            return Result::INVALID_ARGUMENT;
+        }
+        queue = std::move(it->queue);
+        LOG(INFO) << "Live viewer removed from " << it->label << ", sent " << queue->getSentFrames()
+                  << " dropped " << queue->getDroppedFrames() << " frames";
+        mViewers.erase(it);
+        mP2P = !mViewers.empty();
+    }
+    // Joins the sender outside the lock, the encoder keeps feeding the others meanwhile
+    queue->stop();
+    return Result::SUCCESS;
+}
+
+size_t LiveStream::getViewerCount() {
+    std::lock_guard<std::mutex> lock(mViewerMutex);
+    return mViewers.size();
+}
+
+Result LiveStream::streamTrack(std::shared_ptr<P2P> p2p) {
+    CAMERA_ASSERT(mState != CameraClosed);
+
+    if (mTrack) {
+        LOG(WARNING) << "Live stream already sent to the video track";
+        return Result::INVALID_STATE;
+    }
+
+    mTrackTransport = p2p;
+    mTrackTransport->onKeyframeRequest([this]() { mForceKeyframe = true; });
+    mTrack = true;
+
+    // The running encoder may emit B-frames, queued behind the frames already in flight
+    if (mState == CameraStarted) {
+        mEncodeStrand.post([this]() {
+            if (reopenEncoder() != Result::SUCCESS) {
+                LOG(ERROR) << "Failed to reopen live encoder for the video track";
+            }
+        });
+    }
+    return Result::SUCCESS;
+}
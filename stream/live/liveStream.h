@@ -3,24 +3,53 @@
 
 
 #include "baseStream.h"
+#include "gopCache.h"
+#include "sendQueue.h"
+#include "executor.h"
+#include <map>
+
+#define LIVE_ENCODER_PRESET "ultrafast"
+#define LIVE_ENCODER_BITRATE 5000000
+#define LIVE_ENCODER_GOP 50
+#define LIVE_ENCODER_B_FRAMES 2
+#define LIVE_MAX_PENDING 8 // packets and frames queued between capture and encode
+#define LIVE_KEYFRAME_MIN_INTERVAL_US 500000 // PLI bursts after one loss collapse into one IDR
 
 class LiveStream {
 public:
     LiveStream(std::shared_ptr<BaseStream> base) 
-        : baseStream(base), mRunning(false) {         
+        : baseStream(base), mRunning(false),
+          mDecodeStrand(TaskLive, base.get()), mEncodeStrand(TaskLive, base.get()) {         
     }
     Result stop();
     Result start();
+    // Adds one viewer, every viewer gets the same encoded packets through its own send queue
     Result stream(std::shared_ptr<P2P> p2p, std::string label);
+    Result stopStream(std::shared_ptr<P2P> p2p);
+    size_t getViewerCount();
+    // RTP over the peer connection's video track, next to or instead of the DataChannel
+    Result streamTrack(std::shared_ptr<P2P> p2p);
+    void setIntraRefresh(bool status){
+        mIntraRefresh = status;
+    }
+    // Applies to viewers added afterwards, 0 sends every packet as its own message
+    void setCoalescing(int64_t deadlineUs){
+        mCoalesceUs = deadlineUs;
+    }
 
 private:
-    std::thread mThread;      
     std::atomic<bool> mRunning; 
     CameraState mState;
     std::shared_ptr<BaseStream> baseStream; 
-    std::shared_ptr<P2P> transport;
+    struct Viewer {
+        std::shared_ptr<P2P> transport;
+        std::string label;
+        std::unique_ptr<SendQueue> queue;   // drop state is per viewer, a slow one thins only itself
+        bool joinPending = true;            // waiting for the GOP cache
+    };
+    std::mutex mViewerMutex;
+    std::vector<Viewer> mViewers;
     std::atomic<bool> mP2P = false;
-    std::string mLabel;
 
 
     struct SwsContext* sws_ctx = nullptr;
@@ -29,9 +58,49 @@ private:
 
 
     AVFrame* frame = nullptr;
-    AVFrame* yuv_frame = nullptr;
+    AVPacket* encoded_packet = nullptr;
+    FILE* output_file = nullptr;
+
+    // Decode strand owns decoder_ctx, sws_ctx and frame; encode strand owns the encoder side
+    Strand mDecodeStrand;
+    Strand mEncodeStrand;
+    LoadLevel mScaleLevel = LoadNormal;
+    int mScaleWidth = 0;
+    int mScaleHeight = 0;
+    int64_t mLastPts = AV_NOPTS_VALUE;  // Track last PTS to ensure monotonic increase
+    uint64_t mBacklogDrops = 0;
+
+    bool mIntraRefresh = false;
+    int64_t mCoalesceUs = 0;
+    GopCache mGopCache;
+
+    std::shared_ptr<P2P> mTrackTransport;
+    std::atomic<bool> mTrack = false;
+    std::atomic<bool> mForceKeyframe = false;   // set from PLI on the libdatachannel thread
+    int64_t mLastForcedKeyframe = 0;
+    bool mTrackWaitKeyframe = true;
+    std::vector<uint8_t> mTrackBuffer;
+
+    LoadLevel mLoadLevel = LoadNormal;
+    std::map<int64_t, int64_t> mCaptureTimes; // encoder pts -> capture time (us)
 
-    void liveThread();
+    void onPacket(const AVPacket* packet);
+    void decodePacket(AVPacket* packet, int64_t capture_time);
+    void encodeFrame(AVFrame* yuv_frame, int64_t capture_time);
+    Result openDecoder();
+    Result openScaler(LoadLevel level);
+    void getEncodeSize(LoadLevel level, int& width, int& height);
+    Result openEncoder(int width, int height, const char* preset, int maxBFrames);
+    void closeEncoder();
+    // Same size and preset as the current load level, picks up a changed mTrack
+    Result reopenEncoder();
+    Result applyLoadLevel(LoadLevel level);
+    int64_t getCaptureTime(const AVPacket* packet);
+    EncodedFrame makeFrame(const AVPacket* packet);
+    EncodedFrame makeConfigFrame();
+    void sendGopCache(Viewer& viewer);
+    void sendToViewers(const AVPacket* packet);
+    void sendTrackPacket(const AVPacket* packet);
 };
 
 
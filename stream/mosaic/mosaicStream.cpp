@@ -0,0 +1,301 @@
+#include "mosaicStream.h"
+#include "h264Parser.h"
+#include <cmath>
+#include <cstring>
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+Result MosaicStream::addTile(std::shared_ptr<BaseStream> camera) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    CAMERA_ASSERT(!mRunning);
+
+    auto tile = std::make_unique<Tile>();
+    tile->camera = camera;
+    tile->strand = std::make_unique<Strand>(TaskLive, camera.get());
+    mTiles.push_back(std::move(tile));
+    return Result::SUCCESS;
+}
+
+Result MosaicStream::openTile(Tile& tile, size_t index, int columns, int rows) {
+    // Slot in the grid, kept even so the chroma planes line up
+    tile.width = (mWidth / columns) & ~1;
+    tile.height = (mHeight / rows) & ~1;
+    tile.x = (int)(index % columns) * tile.width;
+    tile.y = (int)(index / columns) * tile.height;
+
+    AVCodecParameters* codecpar = tile.camera->format_ctx->streams[tile.camera->video_stream_index]->codecpar;
+    const AVCodec* decoder = avcodec_find_decoder(codecpar->codec_id);
+    if (!decoder) {
+        LOG(ERROR) << "Failed to find decoder for mosaic tile " << tile.camera->file_name;
+        return Result::INVALID_ARGUMENT;
+    }
+
+    tile.decoder_ctx = avcodec_alloc_context3(decoder);
+    avcodec_parameters_to_context(tile.decoder_ctx, codecpar);
+
+    // MJPEG can decode straight at 1/2, 1/4 or 1/8 size, skip the pixels the slot can't show
+    int lowres = 0;
+    while (lowres < 3 && (codecpar->width >> (lowres + 1)) >= tile.width && (codecpar->height >> (lowres + 1)) >= tile.height) {
+        lowres++;
+    }
+    if (codecpar->codec_id == AV_CODEC_ID_MJPEG) {
+        tile.decoder_ctx->lowres = lowres;
+    }
+
+    if (avcodec_open2(tile.decoder_ctx, decoder, nullptr) < 0) {
+        LOG(ERROR) << "Failed to open decoder for mosaic tile " << tile.camera->file_name;
+        avcodec_free_context(&tile.decoder_ctx);
+        return Result::INVALID_ARGUMENT;
+    }
+
+    LOG_TAG_INFO(tile.camera->file_name, "Mosaic tile " << tile.width << "x" << tile.height << " at " << tile.x << "," << tile.y
+                 << " lowres " << tile.decoder_ctx->lowres);
+    return Result::SUCCESS;
+}
+
+Result MosaicStream::start() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return startLocked();
+}
+
+Result MosaicStream::startLocked() {
+    CAMERA_ASSERT(!mRunning && !mTiles.empty());
+
+    int columns = (int)std::ceil(std::sqrt((double)mTiles.size()));
+    int rows = ((int)mTiles.size() + columns - 1) / columns;
+
+    grid_frame = av_frame_alloc();
+    grid_frame->format = AV_PIX_FMT_YUV420P;
+    grid_frame->width = mWidth;
+    grid_frame->height = mHeight;
+    if (av_frame_get_buffer(grid_frame, 32) < 0) {
+        LOG(ERROR) << "Failed to allocate mosaic frame";
+        return Result::INVALID_ARGUMENT;
+    }
+
+    // Black until a camera delivers its first frame
+    for (int y = 0; y < mHeight; y++) {
+        memset(grid_frame->data[0] + y * grid_frame->linesize[0], 16, mWidth);
+    }
+    for (int y = 0; y < mHeight / 2; y++) {
+        memset(grid_frame->data[1] + y * grid_frame->linesize[1], 128, mWidth / 2);
+        memset(grid_frame->data[2] + y * grid_frame->linesize[2], 128, mWidth / 2);
+    }
+
+    const AVCodec* encoder = avcodec_find_encoder(AV_CODEC_ID_H264);
+    if (!encoder) {
+        LOG(ERROR) << "H264 encoder not found";
+        return Result::INVALID_ARGUMENT;
+    }
+
+    encoder_ctx = avcodec_alloc_context3(encoder);
+    encoder_ctx->bit_rate = MOSAIC_ENCODER_BITRATE;
+    encoder_ctx->width = mWidth;
+    encoder_ctx->height = mHeight;
+    encoder_ctx->time_base = AVRational{1, mFps};
+    encoder_ctx->framerate = AVRational{mFps, 1};
+    encoder_ctx->gop_size = mFps * 2;
+    encoder_ctx->max_b_frames = 0;
+    encoder_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+    encoder_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    encoder_ctx->thread_count = 1; // parallelism comes from the shared executor, not x264 threads
+    av_opt_set(encoder_ctx->priv_data, "preset", "ultrafast", 0);
+    av_opt_set(encoder_ctx->priv_data, "tune", "zerolatency", 0);
+
+    if (avcodec_open2(encoder_ctx, encoder, nullptr) < 0) {
+        LOG(ERROR) << "Failed to open mosaic H264 encoder";
+        avcodec_free_context(&encoder_ctx);
+        return Result::INVALID_ARGUMENT;
+    }
+
+    for (size_t i = 0; i < mTiles.size(); i++) {
+        Result result = openTile(*mTiles[i], i, columns, rows);
+        if (result != Result::SUCCESS) {
+            return result;
+        }
+    }
+
+    encoded_packet = av_packet_alloc();
+    mStartTime = av_gettime_relative();
+    mLastPts = -1;
+    mRunning = true;
+
+    for (auto& tile : mTiles) {
+        Tile* slot = tile.get();
+        tile->camera->addPacketListener(slot, [this, slot](const AVPacket* packet) { onPacket(*slot, packet); });
+        // A camera already live or recording keeps capturing after the mosaic stops
+        tile->startedCapture = !tile->camera->isCapturing();
+        tile->camera->startCapture();
+    }
+
+    LOG(INFO) << "Mosaic " << columns << "x" << rows << " started at " << mWidth << "x" << mHeight;
+    return Result::SUCCESS;
+}
+
+Result MosaicStream::stop() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return stopLocked();
+}
+
+Result MosaicStream::stopLocked() {
+    if (!mRunning) {
+        return Result::SUCCESS;
+    }
+    mRunning = false;
+
+    for (auto& tile : mTiles) {
+        tile->camera->removePacketListener(tile.get());
+        if (tile->startedCapture) {
+            tile->camera->stopCapture();
+            tile->startedCapture = false;
+        }
+        tile->strand->waitIdle();
+    }
+    mStrand.waitIdle();
+    mP2P = false;
+    if (mSendQueue) {
+        mSendQueue->stop();
+        mSendQueue.reset();
+    }
+    mTransport = nullptr;
+
+    for (auto& tile : mTiles) {
+        avcodec_free_context(&tile->decoder_ctx);
+        if (tile->sws_ctx) {
+            sws_freeContext(tile->sws_ctx);
+            tile->sws_ctx = nullptr;
+        }
+    }
+    avcodec_free_context(&encoder_ctx);
+    av_frame_free(&grid_frame);
+    av_packet_free(&encoded_packet);
+    return Result::SUCCESS;
+}
+
+void MosaicStream::onPacket(Tile& tile, const AVPacket* packet) {
+    if (!mRunning || tile.strand->getPending() >= MOSAIC_MAX_PENDING) {
+        return;
+    }
+
+    AVPacket* cloned = av_packet_clone(packet);
+    if (cloned) {
+        tile.strand->post([this, &tile, cloned]() { decodeTile(tile, cloned); });
+    }
+}
+
+void MosaicStream::decodeTile(Tile& tile, AVPacket* packet) {
+    avcodec_send_packet(tile.decoder_ctx, packet);
+    av_packet_free(&packet);
+
+    while (true) {
+        AVFrame* decoded = av_frame_alloc();
+        if (avcodec_receive_frame(tile.decoder_ctx, decoded) < 0) {
+            av_frame_free(&decoded);
+            break;
+        }
+        // The compose strand serves every tile, drop here rather than queue behind it
+        if (tile.composePending >= MOSAIC_MAX_COMPOSE) {
+            av_frame_free(&decoded);
+            continue;
+        }
+        tile.composePending++;
+        mStrand.post([this, &tile, decoded]() { composeTile(tile, decoded); });
+    }
+}
+
+void MosaicStream::composeTile(Tile& tile, AVFrame* decoded) {
+    tile.composePending--;
+    tile.sws_ctx = sws_getCachedContext(tile.sws_ctx,
+        decoded->width, decoded->height, (AVPixelFormat)decoded->format,
+        tile.width, tile.height, AV_PIX_FMT_YUV420P,
+        SWS_FAST_BILINEAR, nullptr, nullptr, nullptr);
+
+    if (tile.sws_ctx && av_frame_make_writable(grid_frame) >= 0) {
+        // Scale straight into the tile's slot of the grid planes, no intermediate frame
+        uint8_t* slot[4] = {
+            grid_frame->data[0] + tile.y * grid_frame->linesize[0] + tile.x,
+            grid_frame->data[1] + (tile.y / 2) * grid_frame->linesize[1] + tile.x / 2,
+            grid_frame->data[2] + (tile.y / 2) * grid_frame->linesize[2] + tile.x / 2,
+            nullptr,
+        };
+        sws_scale(tile.sws_ctx, decoded->data, decoded->linesize, 0, decoded->height, slot, grid_frame->linesize);
+    }
+    av_frame_free(&decoded);
+
+    encodeGrid();
+}
+
+void MosaicStream::encodeGrid() {
+    // Tiles arrive at the cameras' rates, the grid goes out at the mosaic rate
+    int64_t pts = (av_gettime_relative() - mStartTime) * mFps / 1000000;
+    if (pts <= mLastPts) {
+        return;
+    }
+    mLastPts = pts;
+
+    grid_frame->pts = pts;
+    grid_frame->pict_type = mForceKeyframe.exchange(false) ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+    avcodec_send_frame(encoder_ctx, grid_frame);
+
+    while (avcodec_receive_packet(encoder_ctx, encoded_packet) >= 0) {
+        if (mP2P) {
+            H264FrameInfo info = classifyH264Frame(encoded_packet->data, encoded_packet->size);
+            EncodedFrame encoded;
+            encoded.data = sharePacketData(encoded_packet);
+            encoded.size = encoded_packet->size;
+            encoded.pts = av_rescale_q(encoded_packet->pts, encoder_ctx->time_base, AVRational{1, 1000000});
+            encoded.flags = (info.entryPoint ? FRAME_FLAG_KEY : 0) | (info.reference ? FRAME_FLAG_REFERENCE : 0);
+            mSendQueue->push(encoded);
+        }
+        av_packet_unref(encoded_packet);
+    }
+}
+
+Result MosaicStream::stream(std::shared_ptr<P2P> p2p, std::string label) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mRunning) {
+        Result result = startLocked();
+        if (result != Result::SUCCESS) {
+            return result;
+        }
+    }
+
+    if (mP2P) {
+        LOG(WARNING) << "Mosaic already sent to a viewer";
+        return Result::INVALID_STATE;
+    }
+
+    mTransport = p2p;
+    mSendQueue = std::make_unique<SendQueue>(p2p, label, MEDIA_STREAM_MOSAIC);
+    mSendQueue->start();
+
+    // Parameter sets first, then start the viewer on a fresh IDR
+    EncodedFrame config;
+    config.data = copyFrameData(encoder_ctx->extradata, encoder_ctx->extradata_size);
+    config.size = encoder_ctx->extradata_size;
+    config.pts = MEDIA_NO_PTS;
+    config.flags = FRAME_FLAG_CONFIG;
+    mSendQueue->push(config);
+
+    mForceKeyframe = true;
+    mP2P = true;
+    return Result::SUCCESS;
+}
+
+Result MosaicStream::stopStream(std::shared_ptr<P2P> p2p) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mP2P || mTransport != p2p) {
+        return Result::INVALID_ARGUMENT;
+    }
+
+    mP2P = false;
+    // Compose strand may be pushing, the queue goes once it is idle
+    mStrand.waitIdle();
+    mSendQueue->stop();
+    mSendQueue.reset();
+    mTransport = nullptr;
+    // Nobody else watches the grid
+    return stopLocked();
+}
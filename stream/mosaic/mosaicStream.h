@@ -0,0 +1,78 @@
+#ifndef MOSAIC_STREAM
+#define MOSAIC_STREAM
+
+#include "baseStream.h"
+#include "executor.h"
+#include "sendQueue.h"
+#include <mutex>
+#include <vector>
+
+#define MOSAIC_ENCODER_BITRATE 2000000
+#define MOSAIC_MAX_PENDING 4 // packets waiting for a tile's decode strand
+#define MOSAIC_MAX_COMPOSE 2 // decoded frames of one tile waiting for the compose strand
+
+// Several cameras composed into one grid and encoded once, so an overview of N cameras
+// costs one encoder and one DataChannel instead of N. Requests come from the MQTT and the
+// session threads, every public call holds mMutex
+class MosaicStream {
+public:
+    MosaicStream(int width, int height, int fps)
+        : mWidth(width), mHeight(height), mFps(fps), mRunning(false), mStrand(TaskLive, this) {
+    }
+
+    ~MosaicStream() {
+        stop();
+    }
+
+    Result addTile(std::shared_ptr<BaseStream> camera);
+    Result start();
+    Result stop();
+    // Starts the grid first if it isn't running
+    Result stream(std::shared_ptr<P2P> p2p, std::string label);
+    // Stops the grid with its viewer, INVALID_ARGUMENT if p2p is not the mosaic's viewer
+    Result stopStream(std::shared_ptr<P2P> p2p);
+    bool isRunning() const { return mRunning; }
+
+private:
+    struct Tile {
+        std::shared_ptr<BaseStream> camera;
+        std::unique_ptr<Strand> strand;  // decoder_ctx
+        AVCodecContext* decoder_ctx = nullptr;
+        struct SwsContext* sws_ctx = nullptr;  // used on the compose strand only
+        int x = 0;
+        int y = 0;
+        int width = 0;
+        int height = 0;
+        bool startedCapture = false;            // capture was off, stop undoes it
+        std::atomic<int> composePending{0};     // a fast camera can't crowd out the others
+    };
+
+    Result startLocked();
+    Result stopLocked();
+    Result openTile(Tile& tile, size_t index, int columns, int rows);
+    void onPacket(Tile& tile, const AVPacket* packet);
+    void decodeTile(Tile& tile, AVPacket* packet);
+    void composeTile(Tile& tile, AVFrame* decoded);
+    void encodeGrid();
+
+    int mWidth;
+    int mHeight;
+    int mFps;
+    std::mutex mMutex;  // start, stop, stream and stopStream
+    std::atomic<bool> mRunning;
+    Strand mStrand;  // grid frame, sws contexts and encoder
+    std::vector<std::unique_ptr<Tile>> mTiles;
+
+    AVFrame* grid_frame = nullptr;
+    AVCodecContext* encoder_ctx = nullptr;
+    AVPacket* encoded_packet = nullptr;
+    int64_t mStartTime = 0;
+    int64_t mLastPts = -1;
+
+    std::unique_ptr<SendQueue> mSendQueue;
+    std::shared_ptr<P2P> mTransport;
+    std::atomic<bool> mP2P = false;
+    std::atomic<bool> mForceKeyframe = false;
+};
+
+#endif
@@ -0,0 +1,287 @@
+#include "archiveTranscoder.h"
+#include "retentionManager.h"
+#include <dirent.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+static bool hasSuffix(const std::string& name, const std::string& suffix) {
+    return name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+void ArchiveTranscoder::start() {
+    if (mRunning) {
+        return;
+    }
+    mRunning = true;
+    mThread = std::thread(&ArchiveTranscoder::transcodeThread, this);
+}
+
+void ArchiveTranscoder::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mRunning = false;
+    }
+    mCondVar.notify_all();
+    if (mThread.joinable()) {
+        mThread.join();
+    }
+}
+
+void ArchiveTranscoder::wake() {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mWake = true;
+    }
+    mCondVar.notify_all();
+}
+
+bool ArchiveTranscoder::waitForIdle() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (mRunning && mGovernor.level() != LoadNormal) {
+        if (!mPaused) {
+            mPaused = true;
+            LOG_TAG_INFO(mSource, "Archive transcode paused by load governor");
+        }
+        mCondVar.wait_for(lock, std::chrono::milliseconds(ARCHIVE_PAUSE_MS));
+    }
+    if (mPaused && mRunning) {
+        mPaused = false;
+        LOG_TAG_INFO(mSource, "Archive transcode resumed");
+    }
+    return mRunning;
+}
+
+std::vector<std::string> ArchiveTranscoder::findArchives() {
+    std::vector<std::string> archives;
+    DIR* handle = opendir(mDir.c_str());
+    if (!handle) {
+        return archives;
+    }
+
+    std::string prefix = mSource + "_";
+    while (struct dirent* entry = readdir(handle)) {
+        std::string name = entry->d_name;
+        if (name.compare(0, prefix.size(), prefix) != 0) {
+            continue;
+        }
+        std::string path = mDir + "/" + name;
+        if (hasSuffix(name, ARCHIVE_TEMP_EXT)) {
+            // Left by a transcode that never finished, nothing of ours is running now
+            unlink(path.c_str());
+        } else if (hasSuffix(name, CAMERA_RECORD_EXT_RAW) && mFailed.count(path) == 0 &&
+                   !RetentionManager::instance().isActive(path)) {
+            archives.push_back(path);
+        }
+    }
+    closedir(handle);
+
+    // Names carry the start time, oldest first
+    std::sort(archives.begin(), archives.end());
+    return archives;
+}
+
+Result ArchiveTranscoder::transcode(const std::string& path) {
+    int64_t startTimeUs;
+    {
+        // Only archives closed cleanly, the index end marker is written last
+        SegmentIndex index;
+        if (index.open(path) != Result::SUCCESS || !index.isComplete()) {
+            return Result::INVALID_STATE;
+        }
+        startTimeUs = index.getStartTime();
+    }
+
+    std::string out = path.substr(0, path.size() - strlen(CAMERA_RECORD_EXT_RAW)) + CAMERA_RECORD_EXT;
+    std::string temp = out + ARCHIVE_TEMP_EXT;
+    RetentionManager::instance().addActive(path);
+    RetentionManager::instance().addActive(temp);
+
+    int64_t begin = av_gettime_relative();
+    SegmentTranscoder transcoder(path, temp);
+    transcoder.setYield([this]() { return waitForIdle(); });
+    // Raw recording skips the decode, the previews come from this one
+    transcoder.setThumbnails(THUMBNAIL_INTERVAL_US, out);
+    Result result = transcoder.run();
+    if (result == Result::SUCCESS) {
+        result = transcoder.verify();
+    }
+
+    if (result == Result::SUCCESS && rename(temp.c_str(), out.c_str()) < 0) {
+        LOG_TAG_ERROR(mSource, "Failed to rename " << temp);
+        result = Result::UNKNOWN_ERROR;
+    }
+    if (result == Result::SUCCESS) {
+        // A crash before the index lands leaves a segment startup recovery re-indexes
+        writeSegmentIndex(out, startTimeUs, transcoder.getEntries(), transcoder.getEndPts(), transcoder.getEndOffset());
+        unlink(segmentIndexPath(path).c_str());
+        unlink(path.c_str());
+        mTranscoded++;
+        LOG_TAG_INFO(mSource, "Transcoded archive " << path << " to " << out << ", " << transcoder.getFrames()
+                     << " frames in " << (av_gettime_relative() - begin) / 1000 << " ms");
+    } else {
+        unlink(temp.c_str());
+        if (mRunning) {
+            LOG_TAG_ERROR(mSource, "Failed to transcode archive " << path);
+        }
+    }
+
+    RetentionManager::instance().removeActive(temp);
+    RetentionManager::instance().removeActive(path);
+    return result;
+}
+
+bool ArchiveTranscoder::throttle() {
+    int64_t now = av_gettime_relative();
+    if (mWorkStartUs > 0) {
+        int64_t work = now - mWorkStartUs;
+        int64_t pause = std::max(work * (100 - COMPACT_CPU_PERCENT) / COMPACT_CPU_PERCENT,
+                                 1000000 / COMPACT_MAX_FPS - work);
+        std::unique_lock<std::mutex> lock(mMutex);
+        mCondVar.wait_for(lock, std::chrono::microseconds(pause), [this]() { return !mRunning; });
+    }
+    mWorkStartUs = av_gettime_relative();
+    return mRunning;
+}
+
+std::vector<std::string> ArchiveTranscoder::findCompactable() {
+    std::vector<std::string> segments;
+    if (mCompactAgeUs <= 0) {
+        return segments;
+    }
+    DIR* handle = opendir(mDir.c_str());
+    if (!handle) {
+        return segments;
+    }
+
+    std::string prefix = mSource + "_";
+    int64_t now = av_gettime();
+    while (struct dirent* entry = readdir(handle)) {
+        std::string name = entry->d_name;
+        if (name.compare(0, prefix.size(), prefix) != 0 || !hasSuffix(name, CAMERA_RECORD_EXT)) {
+            continue;
+        }
+        std::string path = mDir + "/" + name;
+        if (mFailed.count(path) > 0 || RetentionManager::instance().isActive(path)) {
+            continue;
+        }
+        SegmentIndex index;
+        if (index.open(path) == Result::SUCCESS && index.isComplete() && !index.isCompacted() &&
+            now - index.getStartTime() >= mCompactAgeUs) {
+            segments.push_back(path);
+        }
+    }
+    closedir(handle);
+
+    std::sort(segments.begin(), segments.end());
+    return segments;
+}
+
+Result ArchiveTranscoder::compact(const std::string& path) {
+    int64_t startTimeUs;
+    std::vector<SegmentIndexEntry> entries;
+    SegmentIndexEntry end;
+    {
+        SegmentIndex index;
+        if (index.open(path) != Result::SUCCESS || !index.isComplete()) {
+            return Result::INVALID_STATE;
+        }
+        startTimeUs = index.getStartTime();
+        entries.assign(index.entries(), index.entries() + index.size());
+        end = *index.getEnd();
+    }
+
+    // Same stem, retention counts and removes it with the segment
+    std::string temp = path + ARCHIVE_TEMP_EXT;
+    RetentionManager::instance().addActive(path);
+    RetentionManager::instance().addActive(temp);
+
+    int64_t begin = av_gettime_relative();
+    SegmentTranscoder transcoder(path, temp);
+    transcoder.setEncoder(mCompactCodec, COMPACT_PRESET, COMPACT_BITRATE);
+    transcoder.setYield([this]() { return waitForIdle() && throttle(); });
+    mWorkStartUs = 0;
+    Result result = transcoder.run();
+    if (result == Result::SUCCESS) {
+        result = transcoder.verify();
+    }
+
+    struct stat before, after;
+    bool smaller = result == Result::SUCCESS && stat(path.c_str(), &before) == 0 &&
+                   stat(temp.c_str(), &after) == 0 && after.st_size < before.st_size;
+    if (smaller) {
+        // Index out first: a crash between the steps leaves a segment recovery re-indexes,
+        // never an index that points into the other file
+        unlink(segmentIndexPath(path).c_str());
+        if (rename(temp.c_str(), path.c_str()) < 0) {
+            LOG_TAG_ERROR(mSource, "Failed to swap in compacted " << path);
+            unlink(temp.c_str());
+            writeSegmentIndex(path, startTimeUs, entries, end.ptsUs, end.offset);
+            result = Result::UNKNOWN_ERROR;
+        } else {
+            writeSegmentIndex(path, startTimeUs, transcoder.getEntries(), transcoder.getEndPts(),
+                              transcoder.getEndOffset(), SEGMENT_INDEX_FLAG_COMPACTED);
+            mCompacted++;
+            mCompactSavedBytes += before.st_size - after.st_size;
+            LOG_TAG_INFO(mSource, "Compacted " << path << " " << before.st_size << " -> " << after.st_size
+                         << " bytes in " << (av_gettime_relative() - begin) / 1000 << " ms");
+        }
+    } else {
+        unlink(temp.c_str());
+        if (result == Result::SUCCESS) {
+            // Already as small as it gets, mark it so it is not tried again
+            writeSegmentIndex(path, startTimeUs, entries, end.ptsUs, end.offset, SEGMENT_INDEX_FLAG_COMPACTED);
+        } else if (mRunning) {
+            LOG_TAG_ERROR(mSource, "Failed to compact " << path);
+        }
+    }
+
+    RetentionManager::instance().removeActive(temp);
+    RetentionManager::instance().removeActive(path);
+    return result;
+}
+
+void ArchiveTranscoder::transcodeThread() {
+    // Below every normal thread, the scheduler only runs it on otherwise idle cores
+    struct sched_param param = {};
+    if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0) {
+        LOG_TAG_WARNING(mSource, "Failed to lower archive transcode priority");
+    }
+
+    while (mRunning) {
+        for (const std::string& path : findArchives()) {
+            if (!waitForIdle()) {
+                break;
+            }
+            // Not closed yet or interrupted is retried, a broken file is not
+            Result result = transcode(path);
+            if (result != Result::SUCCESS && result != Result::INVALID_STATE) {
+                mFailed.insert(path);
+            }
+        }
+
+        // Old footage last, one segment per pass so new archives are not kept waiting
+        std::vector<std::string> segments = findCompactable();
+        if (!segments.empty() && waitForIdle()) {
+            Result result = compact(segments.front());
+            if (result != Result::SUCCESS && result != Result::INVALID_STATE) {
+                mFailed.insert(segments.front());
+            }
+            if (segments.size() > 1) {
+                std::lock_guard<std::mutex> lock(mMutex);
+                mWake = true;
+            }
+        }
+
+        std::unique_lock<std::mutex> lock(mMutex);
+        mCondVar.wait_for(lock, std::chrono::milliseconds(ARCHIVE_SCAN_MS), [this]() { return !mRunning || mWake; });
+        mWake = false;
+    }
+}
@@ -0,0 +1,82 @@
+#ifndef ARCHIVE_TRANSCODER
+#define ARCHIVE_TRANSCODER
+
+#include "baseStream.h"
+#include "segmentTranscoder.h"
+#include <set>
+
+#define ARCHIVE_SCAN_MS     60000   // look for finished raw archives this often
+#define ARCHIVE_PAUSE_MS    500     // recheck the governor while live load is high
+#define ARCHIVE_TEMP_EXT    ".transcode"
+
+#define COMPACT_AGE_US      (24LL * 3600 * 1000000)  // segments older than a day
+#define COMPACT_PRESET      "slow"
+#define COMPACT_BITRATE     250000   // half the live record rate, the slower preset keeps the quality
+#define COMPACT_CPU_PERCENT 25       // of one core, sleeps after each packet to stay under it
+#define COMPACT_MAX_FPS     60       // caps card reads and writes when the CPU would allow more
+
+// Background transcoding for one camera, raw MJPEG archives first, then compaction of
+// old segments to a slower preset or HEVC. The thread runs under SCHED_IDLE, so it only
+// gets CPU nobody else wants, and stops between packets while the load governor reports
+// anything above normal.
+class ArchiveTranscoder {
+public:
+    ArchiveTranscoder(const std::string& dir, const std::string& source, LoadGovernor& governor)
+        : mDir(dir), mSource(source), mGovernor(governor) {
+    }
+
+    // Re-encode finished segments older than ageUs with codec, 0 disables. HEVC needs a
+    // libx265 build and HEVC capable clients, clip export assumes H.264
+    void setCompaction(int64_t ageUs, AVCodecID codec = AV_CODEC_ID_H264) {
+        mCompactAgeUs = ageUs;
+        mCompactCodec = codec;
+    }
+
+    ~ArchiveTranscoder() {
+        stop();
+    }
+
+    void start();
+    void stop();
+    // Scan now instead of at the next interval, e.g. after an archive segment closed
+    void wake();
+
+    uint64_t getTranscoded() const { return mTranscoded; }
+    uint64_t getCompacted() const { return mCompacted; }
+    int64_t getCompactSavedBytes() const { return mCompactSavedBytes; }
+
+    ArchiveTranscoder(const ArchiveTranscoder&) = delete;
+    ArchiveTranscoder& operator=(const ArchiveTranscoder&) = delete;
+
+private:
+    void transcodeThread();
+    std::vector<std::string> findArchives();
+    Result transcode(const std::string& path);
+    std::vector<std::string> findCompactable();
+    Result compact(const std::string& path);
+    // Blocks while the governor sheds load, false once stopped
+    bool waitForIdle();
+    // Sleeps off the work since the last call to hold COMPACT_CPU_PERCENT and COMPACT_MAX_FPS
+    bool throttle();
+
+    std::string mDir;
+    std::string mSource;
+    LoadGovernor& mGovernor;
+
+    std::thread mThread;
+    std::atomic<bool> mRunning{false};
+    std::mutex mMutex;
+    std::condition_variable mCondVar;
+    bool mWake = false;
+    bool mPaused = false;
+    std::set<std::string> mFailed;  // not retried until restart
+    std::atomic<uint64_t> mTranscoded{0};
+
+    int64_t mCompactAgeUs = COMPACT_AGE_US;
+    AVCodecID mCompactCodec = AV_CODEC_ID_H264;
+    int64_t mWorkStartUs = 0;
+    std::atomic<uint64_t> mCompacted{0};
+    std::atomic<int64_t> mCompactSavedBytes{0};
+};
+
+#endif
@@ -0,0 +1,277 @@
+#include "asyncWriter.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+AsyncWriter& AsyncWriter::instance() {
+    static AsyncWriter writer;
+    return writer;
+}
+
+AsyncWriter::AsyncWriter() {
+    mThread = std::thread(&AsyncWriter::writerThread, this);
+}
+
+AsyncWriter::~AsyncWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mRunning = false;
+    }
+    mCondVar.notify_all();
+    mDrained.notify_all();
+    if (mThread.joinable()) {
+        mThread.join();
+    }
+}
+
+AVIOContext* AsyncWriter::open(const std::string& path, int64_t preallocate) {
+    AsyncFile* file = new AsyncFile();
+    file->path = path;
+    file->preallocate = preallocate;
+
+    uint8_t* buffer = (uint8_t*)av_malloc(ASYNC_AVIO_BUFFER);
+    AVIOContext* pb = avio_alloc_context(buffer, ASYNC_AVIO_BUFFER, 1, file, nullptr,
+                                         &AsyncWriter::writePacket, &AsyncWriter::seek);
+    if (!pb) {
+        av_free(buffer);
+        delete file;
+        return nullptr;
+    }
+
+    push({OpOpen, file, nullptr, 0, 0});
+    return pb;
+}
+
+void AsyncWriter::close(AVIOContext** pb) {
+    if (!pb || !*pb) {
+        return;
+    }
+
+    avio_flush(*pb);
+    AsyncFile* file = (AsyncFile*)(*pb)->opaque;
+    flushChunk(file);
+    push({OpClose, file, nullptr, 0, 0});
+
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+}
+
+void AsyncWriter::sync(AVIOContext* pb) {
+    if (!pb) {
+        return;
+    }
+
+    avio_flush(pb);
+    AsyncFile* file = (AsyncFile*)pb->opaque;
+    flushChunk(file);
+    push({OpSync, file, nullptr, 0, 0});
+}
+
+int AsyncWriter::writePacket(void* opaque, uint8_t* buf, int size) {
+    AsyncFile* file = (AsyncFile*)opaque;
+
+    // Data after a seek does not continue the pending chunk
+    if (file->chunkLen > 0 && file->chunkOffset + (int64_t)file->chunkLen != file->position) {
+        instance().flushChunk(file);
+    }
+
+    int remaining = size;
+    while (remaining > 0) {
+        if (!file->chunk) {
+            if (posix_memalign((void**)&file->chunk, ASYNC_WRITE_ALIGN, ASYNC_WRITE_CHUNK) != 0) {
+                file->chunk = nullptr;
+                return AVERROR(ENOMEM);
+            }
+            file->chunkLen = 0;
+        }
+        if (file->chunkLen == 0) {
+            file->chunkOffset = file->position;
+        }
+
+        size_t count = std::min((size_t)remaining, ASYNC_WRITE_CHUNK - file->chunkLen);
+        memcpy(file->chunk + file->chunkLen, buf, count);
+        file->chunkLen += count;
+        file->position += count;
+        file->size = std::max(file->size, file->position);
+        buf += count;
+        remaining -= count;
+
+        if (file->chunkLen == ASYNC_WRITE_CHUNK) {
+            instance().flushChunk(file);
+        }
+    }
+    return size;
+}
+
+int64_t AsyncWriter::seek(void* opaque, int64_t offset, int whence) {
+    AsyncFile* file = (AsyncFile*)opaque;
+
+    switch (whence & ~AVSEEK_FORCE) {
+        case AVSEEK_SIZE:
+            return file->size;
+        case SEEK_SET:
+            break;
+        case SEEK_CUR:
+            offset += file->position;
+            break;
+        case SEEK_END:
+            offset += file->size;
+            break;
+        default:
+            return AVERROR(EINVAL);
+    }
+    if (offset < 0) {
+        return AVERROR(EINVAL);
+    }
+    file->position = offset;
+    return offset;
+}
+
+void AsyncWriter::flushChunk(AsyncFile* file) {
+    if (!file->chunk || file->chunkLen == 0) {
+        return;
+    }
+
+    // A dropped chunk would leave a hole mid packet, so the muxer waits instead
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        if (mQueuedBytes + file->chunkLen > ASYNC_WRITE_MAX_QUEUED) {
+            if (++mStalls % 100 == 1) {
+                LOG(WARNING) << "Storage too slow, waited on it " << mStalls << " times";
+            }
+            mDrained.wait(lock, [this, file]() {
+                return mQueuedBytes + file->chunkLen <= ASYNC_WRITE_MAX_QUEUED || !mRunning;
+            });
+        }
+        mQueuedBytes += file->chunkLen;
+    }
+    push({OpWrite, file, file->chunk, file->chunkLen, file->chunkOffset});
+    file->chunk = nullptr;
+    file->chunkLen = 0;
+}
+
+void AsyncWriter::push(const Op& op) {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mOps.push_back(op);
+    }
+    mCondVar.notify_one();
+}
+
+void AsyncWriter::writerThread() {
+    mLastSync = av_gettime_relative();
+
+    while (true) {
+        Op op;
+        bool hasOp = false;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mCondVar.wait_for(lock, std::chrono::milliseconds(ASYNC_SYNC_MS),
+                              [this]() { return !mOps.empty() || !mRunning; });
+            // Finish every queued file before exiting
+            if (mOps.empty() && !mRunning) {
+                break;
+            }
+            if (!mOps.empty()) {
+                op = mOps.front();
+                mOps.pop_front();
+                hasOp = true;
+            }
+        }
+
+        if (hasOp) {
+            process(op);
+        }
+
+        if (mUnsynced >= ASYNC_SYNC_BYTES ||
+            (!mDirty.empty() && av_gettime_relative() - mLastSync >= ASYNC_SYNC_MS * 1000LL)) {
+            syncDirty();
+        }
+    }
+    syncDirty();
+}
+
+void AsyncWriter::process(const Op& op) {
+    AsyncFile* file = op.file;
+
+    switch (op.type) {
+        case OpOpen:
+            file->fd = ::open(file->path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (file->fd < 0) {
+                LOG(ERROR) << "Failed to open " << file->path << ": " << strerror(errno);
+                break;
+            }
+            // Reserve the whole segment up front so the card does not fragment it,
+            // not every filesystem supports it
+            if (file->preallocate > 0 &&
+                fallocate(file->fd, FALLOC_FL_KEEP_SIZE, 0, file->preallocate) < 0 && errno != EOPNOTSUPP) {
+                LOG(WARNING) << "Failed to preallocate " << file->path << ": " << strerror(errno);
+            }
+            break;
+
+        case OpWrite:
+            if (file->fd >= 0) {
+                size_t written = 0;
+                while (written < op.size) {
+                    ssize_t ret = pwrite(file->fd, op.data + written, op.size - written, op.offset + written);
+                    if (ret < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    if (ret <= 0) {
+                        LOG(ERROR) << "Failed to write " << file->path << ": " << strerror(errno);
+                        break;
+                    }
+                    written += ret;
+                }
+                file->unsynced += written;
+                mUnsynced += written;
+                if (std::find(mDirty.begin(), mDirty.end(), file) == mDirty.end()) {
+                    mDirty.push_back(file);
+                }
+            }
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                mQueuedBytes -= op.size;
+            }
+            mDrained.notify_all();
+            free(op.data);
+            break;
+
+        case OpSync:
+            if (file->fd >= 0 && file->unsynced > 0) {
+                fdatasync(file->fd);
+                file->unsynced = 0;
+            }
+            break;
+
+        case OpClose:
+            if (file->fd >= 0) {
+                // Give back the preallocated tail that was never used
+                if (ftruncate(file->fd, file->size) < 0) {
+                    LOG(WARNING) << "Failed to truncate " << file->path << ": " << strerror(errno);
+                }
+                fdatasync(file->fd);
+                ::close(file->fd);
+            }
+            mDirty.erase(std::remove(mDirty.begin(), mDirty.end(), file), mDirty.end());
+            free(file->chunk);
+            delete file;
+            break;
+    }
+}
+
+void AsyncWriter::syncDirty() {
+    for (AsyncFile* file : mDirty) {
+        if (file->unsynced > 0 && file->fd >= 0) {
+            fdatasync(file->fd);
+            file->unsynced = 0;
+        }
+    }
+    mDirty.clear();
+    mUnsynced = 0;
+    mLastSync = av_gettime_relative();
+}
@@ -0,0 +1,95 @@
+#ifndef ASYNC_WRITER
+#define ASYNC_WRITER
+
+#include "baseStream.h"
+#include <deque>
+
+#define ASYNC_WRITE_CHUNK       (256 * 1024)          // one write() per chunk
+#define ASYNC_WRITE_ALIGN       4096                  // chunk buffer alignment, file offsets follow the muxer
+#define ASYNC_WRITE_MAX_QUEUED  (16 * 1024 * 1024)    // beyond this the muxer waits, chunks are never dropped
+#define ASYNC_WRITE_BACKLOG     (8 * 1024 * 1024)     // beyond this writers should drop whole GOPs upstream
+#define ASYNC_AVIO_BUFFER       (64 * 1024)
+#define ASYNC_SYNC_BYTES        (4 * 1024 * 1024)     // fdatasync after this much new data
+#define ASYNC_SYNC_MS           1000                  // or this long, whichever comes first
+
+// Recording file handed out as a custom AVIOContext. The muxer only copies into
+// chunk buffers; open, write, fallocate and fdatasync all happen on the writer
+// thread. A file never gets holes: callers shed load with isBackedUp() before the
+// muxer, and only past ASYNC_WRITE_MAX_QUEUED does the muxer wait for the card.
+struct AsyncFile {
+    std::string path;
+    int fd = -1;
+    int64_t preallocate = 0;
+
+    // Muxer side
+    int64_t position = 0;
+    int64_t size = 0;
+    uint8_t* chunk = nullptr;
+    size_t chunkLen = 0;
+    int64_t chunkOffset = 0;
+
+    // Writer thread side
+    uint64_t unsynced = 0;
+};
+
+class AsyncWriter {
+public:
+    static AsyncWriter& instance();
+
+    AVIOContext* open(const std::string& path, int64_t preallocate);
+    // Flushes the muxer buffer and queues the close, the file is released by the writer thread
+    void close(AVIOContext** pb);
+    // Everything written to pb so far is on the card once the writer thread gets here
+    void sync(AVIOContext* pb);
+
+    uint64_t getQueuedBytes() const { return mQueuedBytes; }
+    // Storage is falling behind, drop at the next keyframe rather than mid GOP
+    bool isBackedUp() const { return mQueuedBytes > ASYNC_WRITE_BACKLOG; }
+    uint64_t getStalls() const { return mStalls; }
+
+    AsyncWriter(const AsyncWriter&) = delete;
+    AsyncWriter& operator=(const AsyncWriter&) = delete;
+
+private:
+    typedef enum {
+        OpOpen,
+        OpWrite,
+        OpSync,
+        OpClose,
+    } OpType;
+
+    struct Op {
+        OpType type;
+        AsyncFile* file;
+        uint8_t* data;
+        size_t size;
+        int64_t offset;
+    };
+
+    AsyncWriter();
+    ~AsyncWriter();
+
+    static int writePacket(void* opaque, uint8_t* buf, int size);
+    static int64_t seek(void* opaque, int64_t offset, int whence);
+
+    void flushChunk(AsyncFile* file);
+    void push(const Op& op);
+    void writerThread();
+    void process(const Op& op);
+    void syncDirty();
+
+    std::thread mThread;
+    std::atomic<bool> mRunning{true};
+    std::mutex mMutex;
+    std::condition_variable mCondVar;
+    std::condition_variable mDrained;
+    std::deque<Op> mOps;
+    std::atomic<uint64_t> mQueuedBytes{0};
+    std::atomic<uint64_t> mStalls{0};
+
+    std::vector<AsyncFile*> mDirty;
+    uint64_t mUnsynced = 0;
+    int64_t mLastSync = 0;
+};
+
+#endif
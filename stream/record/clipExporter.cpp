@@ -0,0 +1,346 @@
+#include "clipExporter.h"
+#include <algorithm>
+#include <unistd.h>
+
+#define CLIP_PTS_TOLERANCE_US 1000  // index and demuxer round timestamps differently
+
+static const AVRational kMicroseconds = {1, 1000000};
+
+Result ClipExporter::openInput() {
+    if (avformat_open_input(&input_ctx, mSegmentPath.c_str(), nullptr, nullptr) < 0) {
+        LOG(ERROR) << "Failed to open segment " << mSegmentPath;
+        return Result::FILE_NOT_FOUND;
+    }
+    if (avformat_find_stream_info(input_ctx, nullptr) < 0) {
+        LOG(ERROR) << "Failed to read stream info of " << mSegmentPath;
+        return Result::INVALID_ARGUMENT;
+    }
+
+    for (unsigned int i = 0; i < input_ctx->nb_streams; i++) {
+        if (input_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+            input_stream = input_ctx->streams[i];
+            break;
+        }
+    }
+    if (!input_stream) {
+        LOG(ERROR) << "No video stream in " << mSegmentPath;
+        return Result::INVALID_ARGUMENT;
+    }
+
+    AVCodec* decoder = avcodec_find_decoder(input_stream->codecpar->codec_id);
+    if (!decoder) {
+        LOG(ERROR) << "Failed to find decoder for clip export.";
+        return Result::INVALID_ARGUMENT;
+    }
+    decoder_ctx = avcodec_alloc_context3(decoder);
+    avcodec_parameters_to_context(decoder_ctx, input_stream->codecpar);
+    decoder_ctx->thread_count = 1;
+    if (avcodec_open2(decoder_ctx, decoder, nullptr) < 0) {
+        LOG(ERROR) << "Failed to open decoder for clip export.";
+        return Result::INVALID_ARGUMENT;
+    }
+
+    // fMP4 segments carry avcC and length prefixed NALs, the clip is Annex-B
+    const AVCodecParameters* par = input_stream->codecpar;
+    if (par->extradata_size > 0 && par->extradata[0] == 1) {
+        const AVBitStreamFilter* filter = av_bsf_get_by_name("h264_mp4toannexb");
+        if (!filter || av_bsf_alloc(filter, &bsf_ctx) < 0) {
+            LOG(ERROR) << "Failed to create h264_mp4toannexb filter.";
+            return Result::UNKNOWN_ERROR;
+        }
+        avcodec_parameters_copy(bsf_ctx->par_in, par);
+        bsf_ctx->time_base_in = input_stream->time_base;
+        if (av_bsf_init(bsf_ctx) < 0) {
+            LOG(ERROR) << "Failed to init h264_mp4toannexb filter.";
+            return Result::UNKNOWN_ERROR;
+        }
+    }
+
+    frame = av_frame_alloc();
+    encoded_packet = av_packet_alloc();
+    return Result::SUCCESS;
+}
+
+Result ClipExporter::openOutput() {
+    avformat_alloc_output_context2(&output_ctx, nullptr, CLIP_FORMAT, mOutPath.c_str());
+    if (!output_ctx) {
+        LOG(ERROR) << "Failed to create clip output context.";
+        return Result::INVALID_ARGUMENT;
+    }
+
+    output_stream = avformat_new_stream(output_ctx, nullptr);
+    avcodec_parameters_copy(output_stream->codecpar, bsf_ctx ? bsf_ctx->par_out : input_stream->codecpar);
+    output_stream->codecpar->codec_tag = 0;
+    output_stream->time_base = input_stream->time_base;
+
+    if (avio_open(&output_ctx->pb, mOutPath.c_str(), AVIO_FLAG_WRITE) < 0) {
+        LOG(ERROR) << "Failed to open clip file " << mOutPath;
+        return Result::FILE_NOT_FOUND;
+    }
+    if (avformat_write_header(output_ctx, nullptr) < 0) {
+        LOG(ERROR) << "Failed to write clip header.";
+        return Result::INVALID_ARGUMENT;
+    }
+    return Result::SUCCESS;
+}
+
+Result ClipExporter::openEncoder() {
+    AVCodec* encoder = avcodec_find_encoder(AV_CODEC_ID_H264);
+    if (!encoder) {
+        LOG(ERROR) << "Failed to find H.264 encoder.";
+        return Result::INVALID_ARGUMENT;
+    }
+
+    encoder_ctx = avcodec_alloc_context3(encoder);
+    encoder_ctx->width = decoder_ctx->width;
+    encoder_ctx->height = decoder_ctx->height;
+    encoder_ctx->pix_fmt = decoder_ctx->pix_fmt;
+    encoder_ctx->time_base = input_stream->time_base;
+    encoder_ctx->framerate = input_stream->avg_frame_rate;
+    encoder_ctx->bit_rate = input_stream->codecpar->bit_rate > 0 ? input_stream->codecpar->bit_rate : CLIP_EDGE_BITRATE;
+    encoder_ctx->gop_size = 250;     // one IDR at the start of each re-encoded run
+    encoder_ctx->max_b_frames = 0;   // dts == pts, so it splices with copied GOPs
+    encoder_ctx->thread_count = 1;
+    av_opt_set(encoder_ctx->priv_data, "preset", CLIP_EDGE_PRESET, 0);
+    av_opt_set(encoder_ctx->priv_data, "tune", "zerolatency", 0);
+
+    if (avcodec_open2(encoder_ctx, encoder, nullptr) < 0) {
+        LOG(ERROR) << "Failed to open H.264 encoder for clip export.";
+        avcodec_free_context(&encoder_ctx);
+        return Result::INVALID_ARGUMENT;
+    }
+    return Result::SUCCESS;
+}
+
+void ClipExporter::close() {
+    if (output_ctx) {
+        if (output_ctx->pb) {
+            avio_closep(&output_ctx->pb);
+        }
+        avformat_free_context(output_ctx);
+        output_ctx = nullptr;
+    }
+    if (input_ctx) {
+        avformat_close_input(&input_ctx);
+    }
+    if (decoder_ctx) {
+        avcodec_free_context(&decoder_ctx);
+    }
+    if (encoder_ctx) {
+        avcodec_free_context(&encoder_ctx);
+    }
+    if (bsf_ctx) {
+        av_bsf_free(&bsf_ctx);
+    }
+    if (frame) {
+        av_frame_free(&frame);
+    }
+    if (encoded_packet) {
+        av_packet_free(&encoded_packet);
+    }
+    input_stream = nullptr;
+    output_stream = nullptr;
+}
+
+Result ClipExporter::writePacket(AVPacket* packet) {
+    av_packet_rescale_ts(packet, input_stream->time_base, output_stream->time_base);
+    if (mOutputBase == AV_NOPTS_VALUE) {
+        mOutputBase = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+    }
+    if (packet->pts != AV_NOPTS_VALUE) {
+        packet->pts -= mOutputBase;
+    }
+    if (packet->dts != AV_NOPTS_VALUE) {
+        packet->dts -= mOutputBase;
+    }
+    if (mLastDts != AV_NOPTS_VALUE && packet->dts <= mLastDts) {
+        packet->dts = mLastDts + 1;
+    }
+    if (packet->pts < packet->dts) {
+        packet->pts = packet->dts;
+    }
+    mLastDts = packet->dts;
+    packet->stream_index = output_stream->index;
+
+    if (av_interleaved_write_frame(output_ctx, packet) < 0) {
+        LOG(ERROR) << "Failed to write clip packet to " << mOutPath;
+        return Result::UNKNOWN_ERROR;
+    }
+    return Result::SUCCESS;
+}
+
+Result ClipExporter::copyPacket(AVPacket* packet) {
+    mCopiedPackets++;
+    if (!bsf_ctx) {
+        return writePacket(packet);
+    }
+
+    if (av_bsf_send_packet(bsf_ctx, packet) < 0) {
+        return Result::UNKNOWN_ERROR;
+    }
+    while (av_bsf_receive_packet(bsf_ctx, encoded_packet) >= 0) {
+        Result result = writePacket(encoded_packet);
+        av_packet_unref(encoded_packet);
+        if (result != Result::SUCCESS) {
+            return result;
+        }
+    }
+    return Result::SUCCESS;
+}
+
+Result ClipExporter::encodeFrame(AVFrame* input) {
+    if (!encoder_ctx) {
+        Result result = openEncoder();
+        if (result != Result::SUCCESS) {
+            return result;
+        }
+    }
+
+    if (input) {
+        input->pts = input->best_effort_timestamp;
+        input->pict_type = AV_PICTURE_TYPE_NONE;
+        mEncodedFrames++;
+    }
+    avcodec_send_frame(encoder_ctx, input);
+    while (avcodec_receive_packet(encoder_ctx, encoded_packet) >= 0) {
+        Result result = writePacket(encoded_packet);
+        av_packet_unref(encoded_packet);
+        if (result != Result::SUCCESS) {
+            return result;
+        }
+    }
+    return Result::SUCCESS;
+}
+
+Result ClipExporter::decodePacket(AVPacket* packet, int64_t startUs, int64_t endUs) {
+    avcodec_send_packet(decoder_ctx, packet);
+    while (avcodec_receive_frame(decoder_ctx, frame) >= 0) {
+        int64_t us = av_rescale_q(frame->best_effort_timestamp - mBasePts, input_stream->time_base, kMicroseconds);
+        Result result = Result::SUCCESS;
+        if (us >= startUs && us <= endUs) {
+            result = encodeFrame(frame);
+        }
+        av_frame_unref(frame);
+        if (result != Result::SUCCESS) {
+            return result;
+        }
+    }
+    return Result::SUCCESS;
+}
+
+Result ClipExporter::finishEncode(int64_t startUs, int64_t endUs) {
+    Result result = decodePacket(nullptr, startUs, endUs);
+    avcodec_flush_buffers(decoder_ctx);
+
+    if (encoder_ctx && result == Result::SUCCESS) {
+        result = encodeFrame(nullptr);
+    }
+    if (encoder_ctx) {
+        avcodec_free_context(&encoder_ctx);
+    }
+    return result;
+}
+
+Result ClipExporter::run(int64_t startUs, int64_t endUs) {
+    if (endUs <= startUs) {
+        return Result::INVALID_ARGUMENT;
+    }
+
+    SegmentIndex index;
+    if (index.open(mSegmentPath) != Result::SUCCESS || index.size() == 0) {
+        LOG(ERROR) << "Clip export needs the keyframe index of " << mSegmentPath;
+        return Result::INVALID_ARGUMENT;
+    }
+    const SegmentIndexEntry* gop = index.find(startUs);
+
+    Result result = openInput();
+    if (result == Result::SUCCESS) {
+        result = openOutput();
+    }
+    if (result != Result::SUCCESS) {
+        close();
+        unlink(mOutPath.c_str());
+        return result;
+    }
+
+    // TS is entered at the indexed byte offset, the MP4 demuxer has its own fragment index
+    int64_t gopPts = av_rescale_q(gop->ptsUs, kMicroseconds, input_stream->time_base);
+    if (bsf_ctx) {
+        mBasePts = input_stream->start_time != AV_NOPTS_VALUE ? input_stream->start_time : 0;
+        av_seek_frame(input_ctx, input_stream->index, mBasePts + gopPts, AVSEEK_FLAG_BACKWARD);
+    } else {
+        av_seek_frame(input_ctx, -1, gop->offset, AVSEEK_FLAG_BYTE);
+    }
+
+    const SegmentIndexEntry* entries = index.entries();
+    const SegmentIndexEntry* entriesEnd = entries + index.size();
+    // The last GOP ends at the END entry's pts, a growing segment's last GOP is never whole
+    const SegmentIndexEntry* segmentEnd = index.getEnd();
+    bool started = false;
+    bool encoding = false;
+    AVPacket* packet = av_packet_alloc();
+
+    while (result == Result::SUCCESS && av_read_frame(input_ctx, packet) >= 0) {
+        if (packet->stream_index != input_stream->index) {
+            av_packet_unref(packet);
+            continue;
+        }
+
+        bool key = packet->flags & AV_PKT_FLAG_KEY;
+        int64_t pts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+        if (!started) {
+            if (!key) {
+                av_packet_unref(packet);
+                continue;
+            }
+            started = true;
+            if (mBasePts == AV_NOPTS_VALUE) {
+                mBasePts = pts - gopPts;
+            }
+        }
+
+        // Decode order is past the range, nothing later can land inside it
+        if (packet->dts != AV_NOPTS_VALUE &&
+            av_rescale_q(packet->dts - mBasePts, input_stream->time_base, kMicroseconds) > endUs) {
+            av_packet_unref(packet);
+            break;
+        }
+
+        if (key) {
+            int64_t us = av_rescale_q(pts - mBasePts, input_stream->time_base, kMicroseconds);
+            const SegmentIndexEntry* next = std::upper_bound(entries, entriesEnd, us + CLIP_PTS_TOLERANCE_US,
+                [](int64_t value, const SegmentIndexEntry& entry) { return value < entry.ptsUs; });
+            bool bounded = next != entriesEnd || segmentEnd;
+            int64_t gopEnd = next != entriesEnd ? next->ptsUs : (segmentEnd ? segmentEnd->ptsUs : 0);
+            bool whole = us + CLIP_PTS_TOLERANCE_US >= startUs && bounded && gopEnd <= endUs;
+
+            if (whole && encoding) {
+                result = finishEncode(startUs, endUs);
+            }
+            encoding = !whole;
+        }
+
+        if (result == Result::SUCCESS) {
+            result = encoding ? decodePacket(packet, startUs, endUs) : copyPacket(packet);
+        }
+        av_packet_unref(packet);
+    }
+    av_packet_free(&packet);
+
+    if (encoding && result == Result::SUCCESS) {
+        result = finishEncode(startUs, endUs);
+    }
+    if (result == Result::SUCCESS && av_write_trailer(output_ctx) < 0) {
+        result = Result::UNKNOWN_ERROR;
+    }
+    close();
+
+    if (result != Result::SUCCESS) {
+        LOG(ERROR) << "Clip export of " << mSegmentPath << " failed";
+        unlink(mOutPath.c_str());
+        return result;
+    }
+    LOG(INFO) << "Exported clip " << mOutPath << ": " << mCopiedPackets << " packets copied, "
+              << mEncodedFrames << " edge frames re-encoded";
+    return Result::SUCCESS;
+}
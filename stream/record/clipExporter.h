@@ -0,0 +1,64 @@
+#ifndef CLIP_EXPORTER
+#define CLIP_EXPORTER
+
+#include "baseStream.h"
+#include "segmentIndex.h"
+
+#define CLIP_FORMAT         "mpegts"   // SPS/PPS in band, so copied and re-encoded GOPs can follow each other
+#define CLIP_EXTENSION      ".ts"
+#define CLIP_MARKER         "_clip_"   // <segment>_clip_..., same extension as segments but never one
+#define CLIP_EDGE_PRESET    "ultrafast"
+#define CLIP_EDGE_BITRATE   1000000    // used when the source bitrate is unknown
+
+// Cuts [startUs, endUs] out of one recorded segment. Times are relative to the segment
+// start like the index. GOPs fully inside the range are copied packet for packet; only
+// the GOPs the cut points fall into are decoded and re-encoded, so the cost is two
+// GOPs of encoding whatever the clip length.
+class ClipExporter {
+public:
+    ClipExporter(const std::string& segmentPath, const std::string& outPath)
+        : mSegmentPath(segmentPath), mOutPath(outPath) {
+    }
+
+    ~ClipExporter() {
+        close();
+    }
+
+    Result run(int64_t startUs, int64_t endUs);
+
+    uint64_t getCopiedPackets() const { return mCopiedPackets; }
+    uint64_t getEncodedFrames() const { return mEncodedFrames; }
+
+private:
+    Result openInput();
+    Result openOutput();
+    Result openEncoder();
+    void close();
+
+    Result copyPacket(AVPacket* packet);
+    Result decodePacket(AVPacket* packet, int64_t startUs, int64_t endUs);
+    Result encodeFrame(AVFrame* frame);
+    // End of a re-encoded run: drain decoder and encoder so the next copied GOP starts clean
+    Result finishEncode(int64_t startUs, int64_t endUs);
+    Result writePacket(AVPacket* packet);
+
+    std::string mSegmentPath;
+    std::string mOutPath;
+    int64_t mBasePts = AV_NOPTS_VALUE;
+    int64_t mLastDts = AV_NOPTS_VALUE;
+    int64_t mOutputBase = AV_NOPTS_VALUE;  // pts of the first packet written, the clip starts at zero
+    uint64_t mCopiedPackets = 0;
+    uint64_t mEncodedFrames = 0;
+
+    AVFormatContext* input_ctx = nullptr;
+    AVFormatContext* output_ctx = nullptr;
+    AVStream* input_stream = nullptr;
+    AVStream* output_stream = nullptr;
+    AVCodecContext* decoder_ctx = nullptr;
+    AVCodecContext* encoder_ctx = nullptr;
+    AVBSFContext* bsf_ctx = nullptr;   // length prefixed fMP4 input to Annex-B
+    AVFrame* frame = nullptr;
+    AVPacket* encoded_packet = nullptr;
+};
+
+#endif
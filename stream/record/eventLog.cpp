@@ -0,0 +1,153 @@
+#include "eventLog.h"
+#include "retentionManager.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+EventLog& EventLog::instance() {
+    static EventLog log;
+    return log;
+}
+
+const char* EventLog::typeToString(EventType type) {
+    switch (type) {
+        case EventSegmentStart: return "segment";
+        case EventMotionStart: return "motion_start";
+        case EventMotionStop: return "motion_stop";
+        case EventTrigger: return "trigger";
+        case EventConnection: return "connection";
+        default: return "unknown";
+    }
+}
+
+Result EventLog::open(const std::string& dir) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mFd >= 0) {
+        return Result::SUCCESS;
+    }
+
+    mDir = dir;
+    mPath = dir + "/" EVENT_LOG_FILE;
+    mFd = ::open(mPath.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (mFd < 0) {
+        LOG(ERROR) << "Failed to open event log " << mPath;
+        return Result::FILE_NOT_FOUND;
+    }
+
+    // Drop a record torn by a crash and continue the sequence after the last whole one
+    struct stat st;
+    fstat(mFd, &st);
+    off_t size = st.st_size - st.st_size % sizeof(EventRecord);
+    if (size != st.st_size && ftruncate(mFd, size) < 0) {
+        LOG(ERROR) << "Failed to truncate event log " << mPath;
+    }
+    if (size > 0) {
+        EventRecord last;
+        if (pread(mFd, &last, sizeof(last), size - sizeof(last)) == sizeof(last)) {
+            mLastTimeUs = last.timeUs;
+            mSequence = last.sequence + 1;
+        }
+    }
+
+    // Never a retention candidate
+    RetentionManager::instance().addActive(mPath);
+    return Result::SUCCESS;
+}
+
+void EventLog::append(EventType type, const std::string& source, const std::string& detail, int64_t timeUs) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mFd < 0) {
+        return;
+    }
+
+    EventRecord record = {};
+    // Keep the file sorted even if the wall clock steps back
+    record.timeUs = std::max(timeUs > 0 ? timeUs : av_gettime(), mLastTimeUs);
+    record.type = type;
+    record.sequence = mSequence++;
+    strncpy(record.source, source.c_str(), sizeof(record.source) - 1);
+    strncpy(record.detail, detail.c_str(), sizeof(record.detail) - 1);
+    mLastTimeUs = record.timeUs;
+
+    int fd = mFd;
+    RetentionManager::instance().post([fd, record]() {
+        if (write(fd, &record, sizeof(record)) != sizeof(record)) {
+            LOG(ERROR) << "Failed to append event " << typeToString((EventType)record.type);
+            return;
+        }
+        fdatasync(fd);
+    });
+}
+
+std::vector<EventMatch> EventLog::query(int64_t fromUs, int64_t toUs) {
+    std::vector<EventMatch> matches;
+    std::string path;
+    std::string dir;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        path = mPath;
+        dir = mDir;
+    }
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return matches;
+    }
+    struct stat st;
+    size_t count = fstat(fd, &st) == 0 ? st.st_size / sizeof(EventRecord) : 0;
+    if (count == 0) {
+        ::close(fd);
+        return matches;
+    }
+    void* map = mmap(nullptr, count * sizeof(EventRecord), PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        return matches;
+    }
+
+    const EventRecord* records = (const EventRecord*)map;
+    const EventRecord* end = records + count;
+    const EventRecord* it = std::lower_bound(records, end, fromUs,
+        [](const EventRecord& record, int64_t value) { return record.timeUs < value; });
+
+    for (; it != end && it->timeUs <= toUs; ++it) {
+        EventMatch match = {*it, "", 0};
+
+        // Newest segment of the same camera that started before the event
+        const EventRecord* segment = nullptr;
+        // Counts down on an index, a pointer stepped before records would already be UB
+        size_t scanned = 0;
+        for (size_t i = it - records + 1; i-- > 0 && scanned < EVENT_LOG_SEGMENT_SCAN; scanned++) {
+            const EventRecord* back = records + i;
+            if (back->type == EventSegmentStart && strncmp(back->source, it->source, sizeof(it->source)) == 0) {
+                segment = back;
+                break;
+            }
+        }
+        if (segment) {
+            std::string name(segment->detail, strnlen(segment->detail, sizeof(segment->detail)));
+            struct stat segmentStat;
+            // A raw archive may have been transcoded since, same stem in the record format
+            std::string raw = CAMERA_RECORD_EXT_RAW;
+            if (stat((dir + "/" + name).c_str(), &segmentStat) != 0 && name.size() > raw.size() &&
+                name.compare(name.size() - raw.size(), raw.size(), raw) == 0) {
+                name = name.substr(0, name.size() - raw.size()) + CAMERA_RECORD_EXT;
+            }
+            if (stat((dir + "/" + name).c_str(), &segmentStat) == 0) {
+                match.segment = name;
+                match.offsetUs = it->timeUs - segment->timeUs;
+            }
+        }
+        matches.push_back(match);
+    }
+
+    munmap(map, count * sizeof(EventRecord));
+    return matches;
+}
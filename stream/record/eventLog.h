@@ -0,0 +1,61 @@
+#ifndef EVENT_LOG
+#define EVENT_LOG
+
+#include "baseStream.h"
+
+#define EVENT_LOG_FILE          "events.log"
+#define EVENT_LOG_SEGMENT_SCAN  4096    // records searched back for the segment of an event
+
+typedef enum {
+    EventSegmentStart,
+    EventMotionStart,
+    EventMotionStop,
+    EventTrigger,
+    EventConnection,
+    EventTypeCount,
+} EventType;
+
+// Fixed size records appended in time order, a range query is a binary search over the mapped file
+struct EventRecord {
+    int64_t timeUs;     // wall clock
+    uint16_t type;      // EventType
+    uint16_t reserved;
+    uint32_t sequence;
+    char source[16];    // camera, e.g. video2
+    char detail[48];    // segment name, trigger reason, peer state
+};
+
+static_assert(sizeof(EventRecord) == 80, "event record layout");
+
+struct EventMatch {
+    EventRecord record;
+    std::string segment;    // empty if the footage was already removed by retention
+    int64_t offsetUs;       // from the segment start, as used by the index and playback
+};
+
+class EventLog {
+public:
+    static EventLog& instance();
+
+    Result open(const std::string& dir);
+    // Written on the storage thread, never blocks the caller on the card
+    void append(EventType type, const std::string& source, const std::string& detail, int64_t timeUs = 0);
+    std::vector<EventMatch> query(int64_t fromUs, int64_t toUs);
+
+    static const char* typeToString(EventType type);
+
+    EventLog(const EventLog&) = delete;
+    EventLog& operator=(const EventLog&) = delete;
+
+private:
+    EventLog() = default;
+
+    std::mutex mMutex;
+    std::string mDir;
+    std::string mPath;
+    int mFd = -1;
+    int64_t mLastTimeUs = 0;
+    uint32_t mSequence = 0;
+};
+
+#endif
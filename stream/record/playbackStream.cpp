@@ -0,0 +1,132 @@
+#include "playbackStream.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+Result PlaybackStream::start(const std::string& path, size_t offset, size_t end) {
+    return startAt(path, offset, end, 0);
+}
+
+Result PlaybackStream::startAt(const std::string& path, size_t offset, size_t end, size_t initEnd) {
+    stop();
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOG(ERROR) << "Playback file not found " << path;
+        return Result::FILE_NOT_FOUND;
+    }
+
+    // A segment still being recorded is sent up to its size right now
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0 || offset >= (size_t)st.st_size) {
+        LOG(ERROR) << "Invalid playback offset " << offset << " for " << path;
+        ::close(fd);
+        return Result::INVALID_ARGUMENT;
+    }
+
+    void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        LOG(ERROR) << "Failed to map " << path;
+        return Result::UNKNOWN_ERROR;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    mPath = path;
+    mMap = (uint8_t*)map;
+    mMapSize = st.st_size;
+    mEnd = (end == 0 || end > mMapSize) ? mMapSize : end;
+    mInitEnd = offset > initEnd ? initEnd : 0;
+    currentPosition = offset;
+
+    std::string name = path.substr(path.find_last_of('/') + 1);
+    transport->sendMessageToChannel(mLabel, "playback start " + name + " " + std::to_string(offset) + " " + std::to_string(mEnd));
+
+    mRunning = true;
+    mThread = std::thread(&PlaybackStream::sendThread, this);
+    LOG(INFO) << "Playback " << path << " [" << offset << ", " << mEnd << ") on " << mLabel;
+    return Result::SUCCESS;
+}
+
+Result PlaybackStream::startRange(const std::string& path, int64_t startUs, int64_t endUs) {
+    SegmentIndex index;
+    if (index.open(path) != Result::SUCCESS || index.size() == 0) {
+        LOG(WARNING) << "No index for " << path << ", sending the whole segment";
+        return start(path, 0);
+    }
+
+    const SegmentIndexEntry* first = index.find(startUs);
+    size_t offset = first ? first->offset : 0;
+
+    // MSE needs the init segment before any fragment, it ends where the first fragment starts
+    size_t initEnd = 0;
+    if (path.size() > strlen(CAMERA_RECORD_EXT_FMP4) &&
+        path.compare(path.size() - strlen(CAMERA_RECORD_EXT_FMP4), std::string::npos, CAMERA_RECORD_EXT_FMP4) == 0) {
+        initEnd = index.entries()[0].offset;
+    }
+
+    // Stop at the first keyframe after the range so the last GOP stays complete
+    size_t end = 0;
+    for (size_t i = 0; i < index.size(); i++) {
+        if (index.entries()[i].ptsUs > endUs) {
+            end = index.entries()[i].offset;
+            break;
+        }
+    }
+    return startAt(path, offset, end, initEnd);
+}
+
+void PlaybackStream::stop() {
+    mRunning = false;
+    if (mThread.joinable()) {
+        mThread.join();
+    }
+
+    if (mMap) {
+        munmap(mMap, mMapSize);
+        mMap = nullptr;
+        mMapSize = 0;
+    }
+}
+
+bool PlaybackStream::sendRange(size_t position, size_t end, bool progress) {
+    // Larger messages make libdatachannel throw, browsers accept 256 KiB
+    size_t chunk = std::min((size_t)PLAYBACK_CHUNK_SIZE, transport->getMaxMessageSize(mLabel));
+    if (chunk == 0) {
+        return false;
+    }
+
+    while (mRunning && position < end) {
+        // Only read ahead while the channel drains, live video shares the association
+        if (transport->getBufferedAmount(mLabel) > PLAYBACK_HIGH_WATER) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(PLAYBACK_POLL_MS));
+            continue;
+        }
+
+        size_t size = std::min(chunk, end - position);
+        if (!transport->streamBuffereToChannel(mLabel, mMap + position, size)) {
+            LOG(ERROR) << "Playback of " << mPath << " interrupted at " << position;
+            return false;
+        }
+        position += size;
+        if (progress) {
+            currentPosition = position;
+        }
+    }
+    return true;
+}
+
+void PlaybackStream::sendThread() {
+    if (mInitEnd > 0 && !sendRange(0, mInitEnd, false)) {
+        LOG(ERROR) << "Playback of " << mPath << " failed to send the init segment";
+        mRunning = false;
+        return;
+    }
+
+    if (sendRange(currentPosition, mEnd, true) && currentPosition >= mEnd) {
+        transport->sendMessageToChannel(mLabel, "playback end " + std::to_string(mEnd));
+        LOG(INFO) << "Playback of " << mPath << " finished";
+    }
+    mRunning = false;
+}
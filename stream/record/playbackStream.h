@@ -0,0 +1,53 @@
+#ifndef PLAYBACK_STREAM
+#define PLAYBACK_STREAM
+
+#include "baseStream.h"
+#include "segmentIndex.h"
+
+#define PLAYBACK_CHUNK_SIZE   (256 * 1024)    // bytes per DataChannel message, at most the peer's limit
+#define PLAYBACK_HIGH_WATER   (512 * 1024)    // stop reading the file while this much is unsent
+#define PLAYBACK_POLL_MS      5
+
+// Sends an existing recording over a DataChannel straight from a read only mapping.
+// The channel gets a text "playback start <name> <offset> <end>" message, the raw
+// bytes, then "playback end <offset>"; a viewer resumes by asking for that offset.
+class PlaybackStream {
+public:
+    PlaybackStream(std::shared_ptr<P2P> p2p, const std::string& label)
+        : transport(p2p), mLabel(label) {
+    }
+
+    ~PlaybackStream() {
+        stop();
+    }
+
+    // end == 0 sends up to the current end of the file
+    Result start(const std::string& path, size_t offset, size_t end = 0);
+    // Keyframe aligned range, times are relative to the segment start. An fMP4 range
+    // that starts mid file is preceded by the ftyp+moov init segment
+    Result startRange(const std::string& path, int64_t startUs, int64_t endUs);
+    void stop();
+
+    bool isRunning() const { return mRunning; }
+    size_t getPosition() const { return currentPosition; }
+
+private:
+    Result startAt(const std::string& path, size_t offset, size_t end, size_t initEnd);
+    void sendThread();
+    // Sends [position, end) in chunks while the channel drains, false once a send fails
+    bool sendRange(size_t position, size_t end, bool progress);
+
+    std::shared_ptr<P2P> transport;
+    std::string mLabel;
+    std::string mPath;
+    std::thread mThread;
+    std::atomic<bool> mRunning{false};
+
+    uint8_t* mMap = nullptr;
+    size_t mMapSize = 0;
+    size_t mEnd = 0;
+    size_t mInitEnd = 0;  // fMP4 ftyp+moov sent ahead of a range that starts mid file
+    std::atomic<size_t> currentPosition{0};
+};
+
+#endif
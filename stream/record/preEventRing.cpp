@@ -0,0 +1,50 @@
+#include "preEventRing.h"
+
+void PreEventRing::push(const AVPacket* packet) {
+    bool key = packet->flags & AV_PKT_FLAG_KEY;
+    if (mPackets.empty() && !key) {
+        return;
+    }
+
+    // Only a reference on the encoder buffer, no copy
+    AVPacket* cached = av_packet_clone(packet);
+    if (!cached) {
+        return;
+    }
+    mPackets.push_back(cached);
+    mBytes += cached->size;
+    mKeyframes += key ? 1 : 0;
+
+    while (mKeyframes > 1) {
+        int64_t span = av_rescale_q(mPackets.back()->pts - mPackets.front()->pts, mTimeBase, AVRational{1, 1000000});
+        if (span <= mDurationUs && mBytes <= mMaxBytes) {
+            break;
+        }
+        evictGop();
+    }
+
+    // A single GOP larger than the ring can't be kept aligned
+    if (mBytes > mMaxBytes) {
+        LOG(WARNING) << "Pre-event ring overflow in one GOP, restarting at next keyframe";
+        clear();
+    }
+}
+
+void PreEventRing::evictGop() {
+    do {
+        AVPacket* oldest = mPackets.front();
+        mPackets.pop_front();
+        mBytes -= oldest->size;
+        mKeyframes -= (oldest->flags & AV_PKT_FLAG_KEY) ? 1 : 0;
+        av_packet_free(&oldest);
+    } while (!mPackets.empty() && !(mPackets.front()->flags & AV_PKT_FLAG_KEY));
+}
+
+void PreEventRing::clear() {
+    for (AVPacket* cached : mPackets) {
+        av_packet_free(&cached);
+    }
+    mPackets.clear();
+    mBytes = 0;
+    mKeyframes = 0;
+}
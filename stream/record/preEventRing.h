@@ -0,0 +1,38 @@
+#ifndef PRE_EVENT_RING
+#define PRE_EVENT_RING
+
+#include "baseStream.h"
+#include <deque>
+
+#define RECORD_PRE_EVENT_US         (10LL * 1000000)   // footage kept from before a trigger
+#define RECORD_PRE_EVENT_MAX_BYTES  (8 * 1024 * 1024)
+#define RECORD_POST_EVENT_US        (30LL * 1000000)   // keep recording after the last trigger
+
+// Last few seconds of encoded packets, always starting on a keyframe. Whole GOPs are
+// evicted from the front, so flushing it always yields a decodable file.
+class PreEventRing {
+public:
+    PreEventRing(AVRational time_base, int64_t durationUs = RECORD_PRE_EVENT_US, size_t maxBytes = RECORD_PRE_EVENT_MAX_BYTES)
+        : mTimeBase(time_base), mDurationUs(durationUs), mMaxBytes(maxBytes) {
+    }
+
+    ~PreEventRing() {
+        clear();
+    }
+
+    void push(const AVPacket* packet);
+    void clear();
+    const std::deque<AVPacket*>& packets() const { return mPackets; }
+
+private:
+    void evictGop();
+
+    AVRational mTimeBase;
+    int64_t mDurationUs;
+    size_t mMaxBytes;
+    std::deque<AVPacket*> mPackets;
+    size_t mBytes = 0;
+    size_t mKeyframes = 0;
+};
+
+#endif
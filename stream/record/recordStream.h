@@ -2,11 +2,23 @@
 #define RECORD_STREAM
 
 #include "baseStream.h"
+#include "executor.h"
+#include "segmentWriter.h"
+#include "retentionManager.h"
+#include "preEventRing.h"
+#include "playbackStream.h"
+#include "clipExporter.h"
+#include "eventLog.h"
+#include "thumbnailSheet.h"
+#include "archiveTranscoder.h"
+
+#define RECORD_MAX_PENDING 30 // packets queued for the record transcode
+#define RECORD_TIMELAPSE_INTERVAL_US (10LL * 1000000) // one frame every 10 s, 24 h play back in 5 min
 
 class RecordStream {
 public:
     RecordStream(std::shared_ptr<BaseStream> base) 
-        : baseStream(base), mRunning(false) {         
+        : baseStream(base), mRunning(false), mStrand(TaskRecord, base.get()) {         
     }
 
     Result stop();
@@ -14,11 +26,59 @@ public:
     Result open();
     Result close();
     Result stream(std::shared_ptr<P2P> p2p, std::string label);
+    void setSegmentLimits(int64_t durationUs, int64_t maxBytes){
+        mSegmentDurationUs = durationUs;
+        mSegmentMaxBytes = maxBytes;
+    }
+    void setDiskQuota(uint64_t bytes){
+        mDiskQuota = bytes;
+    }
+    // Keep one captured frame every intervalUs and encode them back to back at the camera fps,
+    // 0 records every frame. Segment duration still counts capture time. Takes effect on open()
+    void setTimelapse(int64_t intervalUs){
+        mTimelapseUs = intervalUs;
+    }
+    // Write the camera packets as they are, no decode or encode. A background job turns
+    // finished archives into CAMERA_RECORD_FORMAT segments when the CPU is idle. Takes effect on open()
+    void setRawArchive(bool status){
+        mRawArchive = status;
+    }
+    // Idle-time re-encode of segments older than ageUs to a smaller file, 0 disables. Takes effect on open()
+    void setCompaction(int64_t ageUs, AVCodecID codec = AV_CODEC_ID_H264){
+        mCompactAgeUs = ageUs;
+        mCompactCodec = codec;
+    }
+    // Preview tile every intervalUs of footage into <segment>.thumbs sprite sheets, 0 disables.
+    // Takes effect on open()
+    void setThumbnailInterval(int64_t intervalUs){
+        mThumbnailUs = intervalUs;
+    }
+    // Fragmented MP4 instead of mpegts, takes effect on open()
+    void setFragmentedMp4(bool status){
+        mFormat = status ? CAMERA_RECORD_FORMAT_FMP4 : CAMERA_RECORD_FORMAT;
+    }
+
+    // Continuous: every packet goes to disk. Otherwise only event clips, each starting
+    // with the pre-event ring and ending RECORD_POST_EVENT_US after the last trigger
+    void setContinuous(bool status);
+    Result trigger(const std::string& reason);
 
+    // Review footage while recording, name is a segment file in CAMERA_RECORD_DIR
+    Result playback(std::shared_ptr<P2P> p2p, std::string label, const std::string& name, size_t offset);
+    Result playbackRange(std::shared_ptr<P2P> p2p, std::string label, const std::string& name, int64_t startUs, int64_t endUs);
+    void stopPlayback();
+
+    // Cut [startUs, endUs] of a segment into <segment>_clip_<start ms>_<end ms>.ts in the record
+    // directory, one export at a time. done(result, clip name) runs on the export thread
+    typedef std::function<void(Result result, const std::string& clip)> ClipCallback;
+    Result exportClip(const std::string& name, int64_t startUs, int64_t endUs, ClipCallback done);
+
+    // Camera name used for segment names and event log records
+    std::string getSource(){
+        return baseStream->file_name.substr(baseStream->file_name.find_last_of('/') + 1);
+    }
     
 private:
-    std::thread mThread; 
-    std::thread mStream;      
     std::atomic<bool> mRunning; 
     CameraState mState;
     std::shared_ptr<BaseStream> baseStream; 
@@ -26,18 +86,53 @@ private:
     std::atomic<bool> mP2P;
     std::string mLabel;
 
-    void recordThread();
+    Strand mStrand; // owns the codec and muxer contexts below
+    int64_t mLastPts = AV_NOPTS_VALUE;  // Track last PTS to ensure monotonic increase
+    bool mPaused = false;
+
+    void onPacket(const AVPacket* packet);
+    void recordPacket(AVPacket* packet);
+    void archivePacket(AVPacket* packet);
+    Result openArchive();
+
+    std::unique_ptr<SegmentWriter> mWriter;
+    int64_t mSegmentDurationUs = RECORD_SEGMENT_DURATION_US;
+    int64_t mSegmentMaxBytes = RECORD_SEGMENT_MAX_BYTES;
+    uint64_t mDiskQuota = RECORD_DISK_QUOTA;
+    const char* mFormat = CAMERA_RECORD_FORMAT;
+    bool mRawArchive = false;
+    std::unique_ptr<ArchiveTranscoder> mTranscoder;
+    int64_t mCompactAgeUs = COMPACT_AGE_US;
+    AVCodecID mCompactCodec = AV_CODEC_ID_H264;
+    int64_t mTimelapseUs = 0;
+    int64_t mTimelapseLastUs = AV_NOPTS_VALUE;  // capture thread
+    int64_t mTimelapseFrames = 0;               // record strand
+    int64_t mThumbnailUs = THUMBNAIL_INTERVAL_US;
+    std::unique_ptr<ThumbnailSheet> mThumbnails;
+    std::unique_ptr<PreEventRing> mRing;
+    bool mContinuous = true;
+    bool mEventWriting = false;
+    int64_t mEventUntil = 0;
+
+    void startEvent(const std::string& reason);
+    void addThumbnail();
+    void closeWriter();
+
+    std::unique_ptr<PlaybackStream> mPlayback;
+    std::mutex mPlaybackMutex;
+    std::string getRecordPath(const std::string& name);
+
+    std::thread mExportThread;
+    std::atomic<bool> mExporting{false};
 
     AVCodec* decoder = nullptr;
-    AVFormatContext* record_format_ctx = nullptr;
     struct SwsContext* sws_ctx = nullptr;
     AVCodecContext* decoder_ctx = nullptr;
     AVCodecContext* encoder_ctx = nullptr;
-    AVStream* video_stream = nullptr;
     AVFrame* frame = nullptr;
     AVFrame* yuv_frame = nullptr;
+    AVPacket* encoded_packet = nullptr;
     AVCodec* encoder = nullptr;
-    size_t currentPosition = 0;
 };
 
 
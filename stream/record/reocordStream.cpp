@@ -1,7 +1,19 @@
 #include "recordStream.h"
 #include <fstream>
+#include <algorithm>
+#include <cstring>
+
+extern "C" {
+#include <libavutil/time.h>
+}
 
 Result RecordStream::open() {
+    mTranscoder = std::make_unique<ArchiveTranscoder>(CAMERA_RECORD_DIR, getSource(), baseStream->governor);
+    mTranscoder->setCompaction(mCompactAgeUs, mCompactCodec);
+    if (mRawArchive) {
+        return openArchive();
+    }
+
     uint8_t fps = baseStream->getFps();
 
     decoder = avcodec_find_decoder(baseStream->format_ctx->streams[baseStream->video_stream_index]->codecpar->codec_id);
@@ -18,12 +30,6 @@ Result RecordStream::open() {
         return Result::INVALID_ARGUMENT;
     }
 
-    avformat_alloc_output_context2(&record_format_ctx, nullptr, CAMERA_RECORD_FORMAT, CAMERA_RECORD_FILE);
-    if (!record_format_ctx) {
-        LOG(ERROR) << "Failed to create output format context.";
-        return Result::INVALID_ARGUMENT;
-    }
-
     // Find the encoder (H.264) and allocate encoder context
     encoder = avcodec_find_encoder(AV_CODEC_ID_H264);
     if (!encoder) {
@@ -41,7 +47,14 @@ Result RecordStream::open() {
     encoder_ctx->framerate = AVRational{fps, 1};
     encoder_ctx->gop_size = 25;      
     encoder_ctx->max_b_frames = 2;   
+    if (mTimelapseUs > 0) {
+        // Each frame stands for mTimelapseUs of capture, B-frames would hold picks back by minutes.
+        // A keyframe at least once per segment, rotation waits for one
+        encoder_ctx->max_b_frames = 0;
+        encoder_ctx->gop_size = (int)std::max<int64_t>(1, std::min<int64_t>(25, mSegmentDurationUs / mTimelapseUs));
+    }
     encoder_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+    encoder_ctx->thread_count = 1; // parallelism comes from the shared executor, not x264 threads
 
     // Set encoder options for fast encoding
     av_opt_set(encoder_ctx->priv_data, "preset", "ultrafast", 0); // Fastest encoding preset
@@ -55,17 +68,29 @@ Result RecordStream::open() {
         return Result::INVALID_ARGUMENT;
     }
 
-    video_stream = avformat_new_stream(record_format_ctx, nullptr);
-    avcodec_parameters_from_context(video_stream->codecpar, encoder_ctx);
-    video_stream->time_base = encoder_ctx->time_base;
-
-    if (avio_open(&record_format_ctx->pb, CAMERA_RECORD_FILE, AVIO_FLAG_WRITE) < 0) {
-        LOG(ERROR) << "Failed to open output file.";
-        return Result::INVALID_ARGUMENT;
+    // Segments are named after the device, e.g. video2_20240101_120000.ts
+    std::string prefix = getSource();
+    if (mTimelapseUs > 0) {
+        prefix += "_timelapse";
+        mTimelapseLastUs = AV_NOPTS_VALUE;
+        mTimelapseFrames = 0;
     }
-    if (avformat_write_header(record_format_ctx, nullptr) < 0) {
-        LOG(ERROR) << "Failed to write header for output file.";
-        return Result::INVALID_ARGUMENT;
+    // Only the first camera to open scans the directory, before any of them writes to it
+    RetentionManager::instance().setQuota(CAMERA_RECORD_DIR, mDiskQuota);
+    RetentionManager::instance().recover(CAMERA_RECORD_DIR);
+    mWriter = std::make_unique<SegmentWriter>(CAMERA_RECORD_DIR, prefix, mFormat);
+    // The segment duration is capture time, a timelapse output tick covers mTimelapseUs of it
+    int64_t segmentUs = mTimelapseUs > 0 ? av_rescale(mSegmentDurationUs, 1000000, (int64_t)fps * mTimelapseUs)
+                                         : mSegmentDurationUs;
+    mWriter->setLimits(segmentUs, mSegmentMaxBytes);
+    Result result = mWriter->setStream(encoder_ctx);
+    if (result != Result::SUCCESS) {
+        return result;
+    }
+    EventLog::instance().open(CAMERA_RECORD_DIR);
+    mRing = std::make_unique<PreEventRing>(encoder_ctx->time_base);
+    if (mThumbnailUs > 0) {
+        mThumbnails = std::make_unique<ThumbnailSheet>(encoder_ctx->width, encoder_ctx->height, mThumbnailUs);
     }
 
     if (decoder_ctx->pix_fmt == AV_PIX_FMT_YUVJ420P ||
@@ -81,6 +106,7 @@ Result RecordStream::open() {
         SWS_BILINEAR, nullptr, nullptr, nullptr);
 
     frame = av_frame_alloc();
+    encoded_packet = av_packet_alloc();
     yuv_frame = av_frame_alloc();
     yuv_frame->format = encoder_ctx->pix_fmt;
     yuv_frame->width = encoder_ctx->width;
@@ -91,13 +117,34 @@ Result RecordStream::open() {
     return Result::SUCCESS;
 }
 
+Result RecordStream::openArchive() {
+    AVStream* input = baseStream->format_ctx->streams[baseStream->video_stream_index];
+
+    // Same names as the transcoded segments, only the extension differs until the job swaps them
+    RetentionManager::instance().setQuota(CAMERA_RECORD_DIR, mDiskQuota);
+    RetentionManager::instance().recover(CAMERA_RECORD_DIR);
+    mWriter = std::make_unique<SegmentWriter>(CAMERA_RECORD_DIR, getSource(), CAMERA_RECORD_FORMAT_RAW);
+    mWriter->setLimits(mSegmentDurationUs, mSegmentMaxBytes);
+    Result result = mWriter->setStream(input->codecpar, input->time_base);
+    if (result != Result::SUCCESS) {
+        return result;
+    }
+    EventLog::instance().open(CAMERA_RECORD_DIR);
+    mRing = std::make_unique<PreEventRing>(input->time_base);
+
+    LOG_TAG_INFO(baseStream->file_name, "Recording raw " << avcodec_get_name(input->codecpar->codec_id) << " archive");
+    mState = CameraOpened;
+    return Result::SUCCESS;
+}
+
 Result RecordStream::start(){
     CAMERA_ASSERT(mState != CameraStarted);
 
     mRunning = true; 
-    mThread = std::thread(&RecordStream::recordThread, this);
+    baseStream->addPacketListener(this, [this](const AVPacket* packet) { onPacket(packet); });
+    mTranscoder->start();
 
-    LOG(INFO) << "Record started on a separate thread!";
+    LOG(INFO) << "Record started on the shared executor!";
     mState = CameraStarted;
 
     return Result::SUCCESS;
@@ -107,9 +154,9 @@ Result RecordStream::stop() {
     CAMERA_ASSERT(mState != CameraClosed);
 
     mRunning = false; 
-    if (mThread.joinable()) {
-        mThread.join();  
-    }
+    baseStream->removePacketListener(this);
+    mStrand.waitIdle();
+    mTranscoder->stop();
     mState = CameraStopping;
 
     return Result::SUCCESS;
@@ -118,14 +165,19 @@ Result RecordStream::stop() {
 Result RecordStream::close(){
     CAMERA_ASSERT(mState != CameraClosed);
 
-    if (record_format_ctx) {
-        av_write_trailer(record_format_ctx);
-        if (record_format_ctx->pb) {
-            avio_closep(&record_format_ctx->pb);
-        }
-        avformat_free_context(record_format_ctx);
-        record_format_ctx = nullptr;
+    stopPlayback();
+    if (mExportThread.joinable()) {
+        mExportThread.join();
+    }
+    if (mWriter) {
+        closeWriter();
+    }
+    mThumbnails.reset();
+    mTranscoder.reset();
+    if (mRing) {
+        mRing->clear();
     }
+    mEventWriting = false;
 
     if (encoder_ctx) {
         avcodec_free_context(&encoder_ctx);
@@ -142,6 +194,9 @@ Result RecordStream::close(){
         av_frame_free(&yuv_frame);
     }
 
+    av_frame_free(&frame);
+    av_packet_free(&encoded_packet);
+
     if (sws_ctx) {
         sws_freeContext(sws_ctx);
         sws_ctx = nullptr;
@@ -152,51 +207,214 @@ Result RecordStream::close(){
     return Result::SUCCESS;
 }
 
-void RecordStream::recordThread() {
-    int64_t last_pts = AV_NOPTS_VALUE;  // Track last PTS to ensure monotonic increase
-    std::vector<uint8_t> fileData;
-    const size_t chunkSize = 614400;
+void RecordStream::onPacket(const AVPacket* packet) {
+    if (!mRunning) {
+        return;
+    }
 
-    while (mRunning) {
-        AVPacket* packet = baseStream->packetQueue.pop();  
-        if (packet) {
-            LOG(INFO) << "Recording packet (size: " << packet->size << ")";
-            if(packet->size > 0){
-                avcodec_send_packet(decoder_ctx, packet);
-                while (avcodec_receive_frame(decoder_ctx, frame) >= 0) {
-                    sws_scale(sws_ctx, frame->data, frame->linesize, 0, frame->height, yuv_frame->data, yuv_frame->linesize);
-
-                    yuv_frame->pts = av_rescale_q(frame->pts, baseStream->format_ctx->streams[baseStream->video_stream_index]->time_base, encoder_ctx->time_base);
-                    if (yuv_frame->pts != AV_NOPTS_VALUE && yuv_frame->pts <= last_pts) {
-                        yuv_frame->pts = last_pts + 1;  
-                    }
-                    last_pts = yuv_frame->pts;
-
-                    avcodec_send_frame(encoder_ctx, yuv_frame);
-                    while (avcodec_receive_packet(encoder_ctx, packet) >= 0) {
-                        packet->pts = av_rescale_q(packet->pts, encoder_ctx->time_base, video_stream->time_base);
-                        packet->dts = av_rescale_q(packet->dts, encoder_ctx->time_base, video_stream->time_base);
-
-                        if (packet->pts < packet->dts) {
-                            packet->pts = packet->dts;
-                        }
-
-                        av_interleaved_write_frame(record_format_ctx, packet);
-
-                        if (mP2P) {
-                            if (!transport->streamBuffereToChannel(mLabel, packet->data, packet->size)) {
-                                LOG(ERROR) << "Failed to send file data over DataChannel";
-                            } else {
-                                LOG(INFO) << "[Sent " << packet->size << " bytes of file data to server]";
-                            }
-                        }
-                        av_packet_unref(packet);
-                    }
+    if (mRawArchive) {
+        // A copy to the writer queue, nothing for the governor to shed
+    } else if (mTimelapseUs > 0) {
+        // Picked before decoding, skipped packets cost nothing. Cheap enough to ignore the governor
+        AVRational time_base = baseStream->format_ctx->streams[baseStream->video_stream_index]->time_base;
+        int64_t now = packet->pts != AV_NOPTS_VALUE ? av_rescale_q(packet->pts, time_base, AVRational{1, 1000000})
+                                                    : av_gettime_relative();
+        if (mTimelapseLastUs != AV_NOPTS_VALUE && now - mTimelapseLastUs < mTimelapseUs) {
+            return;
+        }
+        mTimelapseLastUs = now;
+    } else {
+        if (baseStream->governor.isRecordPaused() != mPaused) {
+            mPaused = !mPaused;
+            LOG_TAG_WARNING(baseStream->file_name, (mPaused ? "Record transcode paused by load governor" : "Record transcode resumed"));
+        }
+        if (mPaused) {
+            return;
+        }
+    }
+
+    if (mStrand.getPending() >= RECORD_MAX_PENDING) {
+        LOG_TAG_WARNING(baseStream->file_name, "Record transcode behind, dropping packet");
+        return;
+    }
+
+    AVPacket* cloned = av_packet_clone(packet);
+    if (cloned) {
+        if (mRawArchive) {
+            mStrand.post([this, cloned]() { archivePacket(cloned); });
+        } else {
+            mStrand.post([this, cloned]() { recordPacket(cloned); });
+        }
+    }
+}
+
+void RecordStream::archivePacket(AVPacket* packet) {
+    mRing->push(packet);
+    if (mContinuous || mEventWriting) {
+        mWriter->write(packet);
+    }
+    if (mEventWriting && av_gettime_relative() > mEventUntil) {
+        LOG_TAG_INFO(baseStream->file_name, "Event recording finished " << mWriter->getPath());
+        closeWriter();
+        mEventWriting = false;
+    }
+    av_packet_free(&packet);
+}
+
+void RecordStream::recordPacket(AVPacket* packet) {
+    avcodec_send_packet(decoder_ctx, packet);
+    av_packet_free(&packet);
+
+    packet = encoded_packet;
+    while (avcodec_receive_frame(decoder_ctx, frame) >= 0) {
+        sws_scale(sws_ctx, frame->data, frame->linesize, 0, frame->height, yuv_frame->data, yuv_frame->linesize);
+
+        if (mTimelapseUs > 0) {
+            // Constant frame rate output, one encoder tick per picked frame
+            yuv_frame->pts = mTimelapseFrames++;
+        } else {
+            yuv_frame->pts = av_rescale_q(frame->pts, baseStream->format_ctx->streams[baseStream->video_stream_index]->time_base, encoder_ctx->time_base);
+            if (yuv_frame->pts != AV_NOPTS_VALUE && yuv_frame->pts <= mLastPts) {
+                yuv_frame->pts = mLastPts + 1;  
+            }
+        }
+        mLastPts = yuv_frame->pts;
+
+        avcodec_send_frame(encoder_ctx, yuv_frame);
+        while (avcodec_receive_packet(encoder_ctx, packet) >= 0) {
+            mRing->push(packet);
+            if (mContinuous || mEventWriting) {
+                mWriter->write(packet);
+            }
+            if (mEventWriting && av_gettime_relative() > mEventUntil) {
+                LOG_TAG_INFO(baseStream->file_name, "Event recording finished " << mWriter->getPath());
+                closeWriter();
+                mEventWriting = false;
+            }
+
+            if (mP2P) {
+                if (!transport->streamBuffereToChannel(mLabel, packet->data, packet->size)) {
+                    LOG_EVERY_N(ERROR, 100) << "Failed to send file data over DataChannel";
                 }
             }
             av_packet_unref(packet);
         }
+
+        // After the encode, so a keyframe that rotated the segment already counts for the new one
+        addThumbnail();
+    }
+}
+
+void RecordStream::addThumbnail() {
+    if (!mThumbnails || !mWriter->isOpen() || !(mContinuous || mEventWriting)) {
+        return;
+    }
+    int64_t ptsUs = av_rescale_q(yuv_frame->pts - mWriter->getStartPts(), mWriter->getTimeBase(), AVRational{1, 1000000});
+    mThumbnails->add(yuv_frame, mWriter->getPath(), std::max<int64_t>(ptsUs, 0));
+}
+
+void RecordStream::closeWriter() {
+    mWriter->close();
+    if (mThumbnails) {
+        mThumbnails->flush();
+    }
+    if (mRawArchive && mTranscoder) {
+        mTranscoder->wake();
+    }
+}
+
+void RecordStream::setContinuous(bool status) {
+    mStrand.post([this, status]() {
+        mContinuous = status;
+        if (!mContinuous && !mEventWriting && mWriter) {
+            closeWriter();
+        }
+    });
+}
+
+Result RecordStream::trigger(const std::string& reason) {
+    CAMERA_ASSERT(mState == CameraOpened || mState == CameraStarted);
+
+    EventLog::instance().append(EventTrigger, getSource(), reason);
+    mStrand.post([this, reason]() { startEvent(reason); });
+    return Result::SUCCESS;
+}
+
+void RecordStream::startEvent(const std::string& reason) {
+    mEventUntil = av_gettime_relative() + RECORD_POST_EVENT_US;
+    if (mContinuous || mEventWriting) {
+        LOG_TAG_INFO(baseStream->file_name, "Trigger " << reason << " during recording");
+        mEventWriting = !mContinuous;
+        return;
+    }
+
+    // New file that opens with the footage from before the trigger
+    mWriter->requestRotation();
+    for (const AVPacket* cached : mRing->packets()) {
+        AVPacket* packet = av_packet_clone(cached);
+        if (packet) {
+            mWriter->write(packet);
+            av_packet_free(&packet);
+        }
+    }
+    mEventWriting = true;
+    LOG_TAG_INFO(baseStream->file_name, "Trigger " << reason << ", flushed " << mRing->packets().size()
+                 << " pre-event packets to " << mWriter->getPath());
+}
+
+std::string RecordStream::getRecordPath(const std::string& name) {
+    // Only plain file names, never a path out of the record directory
+    return std::string(CAMERA_RECORD_DIR) + "/" + name.substr(name.find_last_of('/') + 1);
+}
+
+Result RecordStream::playback(std::shared_ptr<P2P> p2p, std::string label, const std::string& name, size_t offset) {
+    std::lock_guard<std::mutex> lock(mPlaybackMutex);
+
+    mPlayback = std::make_unique<PlaybackStream>(p2p, label);
+    return mPlayback->start(getRecordPath(name), offset);
+}
+
+Result RecordStream::playbackRange(std::shared_ptr<P2P> p2p, std::string label, const std::string& name, int64_t startUs, int64_t endUs) {
+    std::lock_guard<std::mutex> lock(mPlaybackMutex);
+
+    mPlayback = std::make_unique<PlaybackStream>(p2p, label);
+    return mPlayback->startRange(getRecordPath(name), startUs, endUs);
+}
+
+void RecordStream::stopPlayback() {
+    std::lock_guard<std::mutex> lock(mPlaybackMutex);
+
+    mPlayback.reset();
+}
+
+Result RecordStream::exportClip(const std::string& name, int64_t startUs, int64_t endUs, ClipCallback done) {
+    if (mExporting) {
+        LOG_TAG_WARNING(baseStream->file_name, "Clip export already running");
+        return Result::INVALID_STATE;
+    }
+    if (mExportThread.joinable()) {
+        mExportThread.join();
     }
+
+    std::string path = getRecordPath(name);
+    if (path.size() > strlen(CAMERA_RECORD_EXT_RAW) &&
+        path.compare(path.size() - strlen(CAMERA_RECORD_EXT_RAW), std::string::npos, CAMERA_RECORD_EXT_RAW) == 0) {
+        LOG_TAG_WARNING(baseStream->file_name, "Clips are cut from " CAMERA_RECORD_FORMAT " segments, " << name << " is not transcoded yet");
+        return Result::INVALID_ARGUMENT;
+    }
+    std::string stem = path.substr(0, path.find('.', path.find_last_of('/')));
+    std::string clip = stem + CLIP_MARKER + std::to_string(startUs / 1000) + "_" + std::to_string(endUs / 1000) + CLIP_EXTENSION;
+
+    mExporting = true;
+    mExportThread = std::thread([this, path, clip, startUs, endUs, done]() {
+        ClipExporter exporter(path, clip);
+        Result result = exporter.run(startUs, endUs);
+        mExporting = false;
+        if (done) {
+            done(result, clip.substr(clip.find_last_of('/') + 1));
+        }
+    });
+    return Result::SUCCESS;
 }
 
 Result RecordStream::stream(std::shared_ptr<P2P> p2p, std::string label) {
@@ -0,0 +1,184 @@
+#include "retentionManager.h"
+#include "asyncWriter.h"
+#include "segmentRecovery.h"
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+RetentionManager& RetentionManager::instance() {
+    static RetentionManager manager;
+    return manager;
+}
+
+RetentionManager::RetentionManager() {
+    // Segments still finishing at exit are closed through the writer, so it has to outlive us
+    AsyncWriter::instance();
+    mThread = std::thread(&RetentionManager::storageThread, this);
+}
+
+RetentionManager::~RetentionManager() {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mRunning = false;
+    }
+    mCondVar.notify_all();
+    if (mThread.joinable()) {
+        mThread.join();
+    }
+}
+
+void RetentionManager::setQuota(const std::string& dir, uint64_t bytes) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mDir = dir;
+    mQuota = bytes;
+}
+
+void RetentionManager::addActive(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mActive.insert(path);
+}
+
+void RetentionManager::removeActive(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mActive.erase(path);
+}
+
+bool RetentionManager::isActive(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mActive.count(path) > 0;
+}
+
+void RetentionManager::recover(const std::string& dir) {
+    std::lock_guard<std::mutex> lock(mRecoverMutex);
+    if (!mRecovered.insert(dir).second) {
+        return;
+    }
+    recoverSegments(dir);
+}
+
+void RetentionManager::post(std::function<void()> job) {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mJobs.push_back(std::move(job));
+    }
+    mCondVar.notify_one();
+}
+
+void RetentionManager::finishSegment(AVFormatContext* format_ctx, const std::string& path) {
+    post([this, format_ctx, path]() mutable {
+        av_write_trailer(format_ctx);
+        AsyncWriter::instance().close(&format_ctx->pb);
+        avformat_free_context(format_ctx);
+
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mActive.erase(path);
+        }
+        LOG(INFO) << "Closed segment " << path;
+        sweep();
+    });
+}
+
+void RetentionManager::storageThread() {
+    while (true) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            bool woken = mCondVar.wait_for(lock, std::chrono::milliseconds(RETENTION_SWEEP_MS),
+                                           [this]() { return !mJobs.empty() || !mRunning; });
+            // Drain pending segments before exiting so every file gets its trailer
+            if (mJobs.empty() && !mRunning) {
+                break;
+            }
+            if (woken && !mJobs.empty()) {
+                job = std::move(mJobs.front());
+                mJobs.pop_front();
+            }
+        }
+
+        if (job) {
+            job();
+        } else {
+            sweep();
+        }
+    }
+}
+
+void RetentionManager::sweep() {
+    std::string dir;
+    uint64_t quota;
+    std::set<std::string> active;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        dir = mDir;
+        quota = mQuota;
+        active = mActive;
+    }
+    if (dir.empty()) {
+        return;
+    }
+
+    DIR* handle = opendir(dir.c_str());
+    if (!handle) {
+        return;
+    }
+
+    // Sidecars share the segment's stem and go together with it
+    struct Segment {
+        time_t mtime = 0;
+        uint64_t bytes = 0;
+        bool active = false;
+        std::vector<std::string> files;
+    };
+    std::map<std::string, Segment> segments;
+    uint64_t total = 0;
+
+    while (struct dirent* entry = readdir(handle)) {
+        std::string name = entry->d_name;
+        if (name[0] == '.') {
+            continue;
+        }
+        std::string path = dir + "/" + name;
+        struct stat st;
+        if (stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        Segment& segment = segments[name.substr(0, name.find('.'))];
+        if (segment.files.empty() || st.st_mtime < segment.mtime) {
+            segment.mtime = st.st_mtime;
+        }
+        segment.bytes += st.st_size;
+        segment.active |= active.count(path) > 0;
+        segment.files.push_back(path);
+        total += st.st_size;
+    }
+    closedir(handle);
+
+    if (total <= quota) {
+        return;
+    }
+
+    std::vector<Segment*> oldest;
+    for (auto& segment : segments) {
+        if (!segment.second.active) {
+            oldest.push_back(&segment.second);
+        }
+    }
+    std::sort(oldest.begin(), oldest.end(), [](const Segment* a, const Segment* b) { return a->mtime < b->mtime; });
+
+    for (Segment* segment : oldest) {
+        if (total <= quota) {
+            break;
+        }
+        for (const std::string& file : segment->files) {
+            if (unlink(file.c_str()) == 0) {
+                LOG(INFO) << "Retention removed " << file;
+            }
+        }
+        total -= segment->bytes;
+    }
+}
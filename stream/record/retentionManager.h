@@ -0,0 +1,50 @@
+#ifndef RETENTION_MANAGER
+#define RETENTION_MANAGER
+
+#include "baseStream.h"
+#include <set>
+#include <deque>
+
+#define RECORD_DISK_QUOTA   (2LL * 1024 * 1024 * 1024) // 2 GB of segments on the SD card
+#define RETENTION_SWEEP_MS  60000
+
+// Storage housekeeping thread shared by all cameras. Finished segments are finalized here
+// so trailer writes and fsync never block an encoder, then the oldest segments are
+// deleted until the record directory is back under quota.
+class RetentionManager {
+public:
+    static RetentionManager& instance();
+
+    void setQuota(const std::string& dir, uint64_t bytes);
+    void addActive(const std::string& path);
+    void removeActive(const std::string& path);
+    bool isActive(const std::string& path);
+    // Repair segments left unfinished by a crash. Runs once per directory on the caller, before
+    // its first writer opens, later callers wait for it and return
+    void recover(const std::string& dir);
+    void finishSegment(AVFormatContext* format_ctx, const std::string& path);
+    void post(std::function<void()> job);
+
+    RetentionManager(const RetentionManager&) = delete;
+    RetentionManager& operator=(const RetentionManager&) = delete;
+
+private:
+    RetentionManager();
+    ~RetentionManager();
+
+    void storageThread();
+    void sweep();
+
+    std::thread mThread;
+    std::atomic<bool> mRunning{true};
+    std::mutex mMutex;
+    std::condition_variable mCondVar;
+    std::deque<std::function<void()>> mJobs;
+    std::set<std::string> mActive;
+    std::mutex mRecoverMutex;
+    std::set<std::string> mRecovered;
+    std::string mDir;
+    uint64_t mQuota = RECORD_DISK_QUOTA;
+};
+
+#endif
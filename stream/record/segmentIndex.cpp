@@ -0,0 +1,157 @@
+#include "segmentIndex.h"
+#include "asyncWriter.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+
+std::string segmentIndexPath(const std::string& segmentPath) {
+    return segmentPath + SEGMENT_INDEX_EXT;
+}
+
+Result SegmentIndexWriter::open(const std::string& segmentPath, int64_t startTimeUs) {
+    close();
+
+    pb = AsyncWriter::instance().open(segmentIndexPath(segmentPath), 0);
+    if (!pb) {
+        LOG(ERROR) << "Failed to open index for " << segmentPath;
+        return Result::FILE_NOT_FOUND;
+    }
+
+    SegmentIndexHeader header = {};
+    header.magic = SEGMENT_INDEX_MAGIC;
+    header.version = SEGMENT_INDEX_VERSION;
+    header.entrySize = sizeof(SegmentIndexEntry);
+    header.startTimeUs = startTimeUs;
+    avio_write(pb, (const unsigned char*)&header, sizeof(header));
+    return Result::SUCCESS;
+}
+
+void SegmentIndexWriter::add(int64_t ptsUs, int64_t offset, uint32_t flags) {
+    if (!pb) {
+        return;
+    }
+
+    SegmentIndexEntry entry = {};
+    entry.ptsUs = ptsUs;
+    entry.offset = offset;
+    entry.flags = flags;
+    avio_write(pb, (const unsigned char*)&entry, sizeof(entry));
+}
+
+void SegmentIndexWriter::checkpoint() {
+    AsyncWriter::instance().sync(pb);
+}
+
+void SegmentIndexWriter::finish(int64_t ptsUs, int64_t offset) {
+    add(ptsUs, offset, SEGMENT_INDEX_FLAG_END);
+    close();
+}
+
+void SegmentIndexWriter::close() {
+    if (pb) {
+        AsyncWriter::instance().close(&pb);
+    }
+}
+
+Result SegmentIndex::open(const std::string& segmentPath) {
+    close();
+
+    std::string path = segmentIndexPath(segmentPath);
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return Result::FILE_NOT_FOUND;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(SegmentIndexHeader)) {
+        ::close(fd);
+        return Result::INVALID_ARGUMENT;
+    }
+
+    void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        LOG(ERROR) << "Failed to map index " << path;
+        return Result::UNKNOWN_ERROR;
+    }
+
+    const SegmentIndexHeader* header = (const SegmentIndexHeader*)map;
+    if (header->magic != SEGMENT_INDEX_MAGIC || header->entrySize != sizeof(SegmentIndexEntry)) {
+        LOG(ERROR) << "Invalid index " << path;
+        munmap(map, st.st_size);
+        return Result::INVALID_ARGUMENT;
+    }
+
+    mMap = map;
+    mMapSize = st.st_size;
+    mHeader = header;
+    mEntries = (const SegmentIndexEntry*)(header + 1);
+    // A torn last entry from a crash is ignored
+    mCount = (st.st_size - sizeof(SegmentIndexHeader)) / sizeof(SegmentIndexEntry);
+    mComplete = mCount > 0 && (mEntries[mCount - 1].flags & SEGMENT_INDEX_FLAG_END);
+    if (mComplete) {
+        mCount--;
+    }
+    return Result::SUCCESS;
+}
+
+void SegmentIndex::close() {
+    if (mMap) {
+        munmap(mMap, mMapSize);
+    }
+    mMap = nullptr;
+    mMapSize = 0;
+    mHeader = nullptr;
+    mEntries = nullptr;
+    mCount = 0;
+    mComplete = false;
+}
+
+const SegmentIndexEntry* SegmentIndex::find(int64_t ptsUs) const {
+    if (mCount == 0) {
+        return nullptr;
+    }
+
+    const SegmentIndexEntry* end = mEntries + mCount;
+    const SegmentIndexEntry* it = std::upper_bound(mEntries, end, ptsUs,
+        [](int64_t value, const SegmentIndexEntry& entry) { return value < entry.ptsUs; });
+    return it == mEntries ? mEntries : it - 1;
+}
+
+Result writeSegmentIndex(const std::string& segmentPath, int64_t startTimeUs,
+                         const std::vector<SegmentIndexEntry>& entries, int64_t endPtsUs, int64_t endOffset,
+                         uint32_t endFlags) {
+    std::string path = segmentIndexPath(segmentPath);
+    std::string temp = path + ".tmp";
+
+    std::vector<uint8_t> data(sizeof(SegmentIndexHeader) + (entries.size() + 1) * sizeof(SegmentIndexEntry));
+    SegmentIndexHeader* header = (SegmentIndexHeader*)data.data();
+    header->magic = SEGMENT_INDEX_MAGIC;
+    header->version = SEGMENT_INDEX_VERSION;
+    header->entrySize = sizeof(SegmentIndexEntry);
+    header->startTimeUs = startTimeUs;
+
+    SegmentIndexEntry* out = (SegmentIndexEntry*)(header + 1);
+    std::copy(entries.begin(), entries.end(), out);
+    SegmentIndexEntry& end = out[entries.size()];
+    end = {};
+    end.ptsUs = endPtsUs;
+    end.offset = endOffset;
+    end.flags = SEGMENT_INDEX_FLAG_END | endFlags;
+    size_t size = data.size();
+
+    int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return Result::FILE_NOT_FOUND;
+    }
+    bool ok = ::write(fd, data.data(), size) == (ssize_t)size && fdatasync(fd) == 0;
+    ::close(fd);
+    if (!ok || rename(temp.c_str(), path.c_str()) < 0) {
+        LOG(ERROR) << "Failed to write index " << path;
+        unlink(temp.c_str());
+        return Result::UNKNOWN_ERROR;
+    }
+    return Result::SUCCESS;
+}
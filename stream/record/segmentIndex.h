@@ -0,0 +1,91 @@
+#ifndef SEGMENT_INDEX
+#define SEGMENT_INDEX
+
+#include "baseStream.h"
+
+#define SEGMENT_INDEX_EXT      ".idx"
+#define SEGMENT_INDEX_MAGIC    0x31584449  // "IDX1"
+#define SEGMENT_INDEX_VERSION  1
+
+#define SEGMENT_INDEX_FLAG_KEY 0x01
+#define SEGMENT_INDEX_FLAG_END 0x80   // written on a clean close, pts of the last packet and offset of the end of the media data
+#define SEGMENT_INDEX_FLAG_COMPACTED 0x40  // on the end entry, background compaction already ran
+
+// Sidecar layout: one header followed by fixed size entries in pts order, so a
+// reader can mmap the file and binary search it without parsing anything.
+struct SegmentIndexHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t entrySize;
+    int64_t startTimeUs;    // wall clock of the first packet, entries are relative to it
+};
+
+struct SegmentIndexEntry {
+    int64_t ptsUs;
+    int64_t offset;         // byte offset of the packet in the segment
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(SegmentIndexHeader) == 16, "index header layout");
+static_assert(sizeof(SegmentIndexEntry) == 24, "index entry layout");
+
+std::string segmentIndexPath(const std::string& segmentPath);
+
+// Written alongside the segment through the async writer
+class SegmentIndexWriter {
+public:
+    ~SegmentIndexWriter() {
+        close();
+    }
+
+    Result open(const std::string& segmentPath, int64_t startTimeUs);
+    void add(int64_t ptsUs, int64_t offset, uint32_t flags);
+    // Make the entries written so far durable
+    void checkpoint();
+    // Mark the segment complete, without this the next startup recovers it
+    void finish(int64_t ptsUs, int64_t offset);
+    void close();
+
+private:
+    AVIOContext* pb = nullptr;
+};
+
+// Read only view of a finished or growing index
+class SegmentIndex {
+public:
+    ~SegmentIndex() {
+        close();
+    }
+
+    Result open(const std::string& segmentPath);
+    void close();
+
+    // Last keyframe at or before ptsUs, nullptr if the index is empty
+    const SegmentIndexEntry* find(int64_t ptsUs) const;
+
+    bool isComplete() const { return mComplete; }
+    bool isCompacted() const { return mComplete && (mEntries[mCount].flags & SEGMENT_INDEX_FLAG_COMPACTED); }
+    int64_t getStartTime() const { return mHeader ? mHeader->startTimeUs : 0; }
+    size_t size() const { return mCount; }
+    const SegmentIndexEntry* entries() const { return mEntries; }
+    // The END entry of a complete index, nullptr otherwise
+    const SegmentIndexEntry* getEnd() const { return mComplete ? mEntries + mCount : nullptr; }
+
+private:
+    void* mMap = nullptr;
+    size_t mMapSize = 0;
+    const SegmentIndexHeader* mHeader = nullptr;
+    const SegmentIndexEntry* mEntries = nullptr;
+    size_t mCount = 0;
+    bool mComplete = false;
+};
+
+// Synchronous write of a whole, complete index through a temporary file and rename, used by
+// recovery and background transcoding. The END entry gets endPtsUs and endOffset, the same
+// last pts and end of the media data SegmentWriter finishes with, and endFlags
+Result writeSegmentIndex(const std::string& segmentPath, int64_t startTimeUs,
+                         const std::vector<SegmentIndexEntry>& entries, int64_t endPtsUs, int64_t endOffset,
+                         uint32_t endFlags = 0);
+
+#endif
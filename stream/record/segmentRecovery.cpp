@@ -0,0 +1,350 @@
+#include "segmentRecovery.h"
+#include "retentionManager.h"
+#include "clipExporter.h"
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+
+#define MP4_TYPE(a, b, c, d) (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+struct Mp4Box {
+    int64_t offset;
+    int64_t size;
+    int64_t header;
+    uint32_t type;
+};
+
+static uint32_t readBe32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint64_t readBe64(const uint8_t* p) {
+    return ((uint64_t)readBe32(p) << 32) | readBe32(p + 4);
+}
+
+static bool hasSuffix(const std::string& name, const std::string& suffix) {
+    return name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Whole TS packets from the start of the file, dropping a torn or garbled tail
+static int64_t validTsSize(const uint8_t* data, int64_t size) {
+    int64_t valid = size - size % TS_PACKET_SIZE;
+    while (valid >= TS_PACKET_SIZE && data[valid - TS_PACKET_SIZE] != TS_SYNC_BYTE) {
+        valid -= TS_PACKET_SIZE;
+    }
+    return valid;
+}
+
+static uint16_t tsPid(const uint8_t* packet) {
+    return ((packet[1] & 0x1F) << 8) | packet[2];
+}
+
+// 90 kHz pts of a video PES starting in this packet, -1 otherwise
+static int64_t parseTsVideoPts(const uint8_t* packet, uint16_t& pid, bool& key) {
+    pid = tsPid(packet);
+    key = false;
+    if (packet[0] != TS_SYNC_BYTE || !(packet[1] & 0x40)) {
+        return -1;
+    }
+
+    int control = (packet[3] >> 4) & 0x03;
+    size_t pos = 4;
+    if (control & 0x02) {
+        // The muxer sets random_access_indicator on keyframes
+        key = packet[4] > 0 && (packet[5] & 0x40);
+        pos += 1 + packet[4];
+    }
+    if (!(control & 0x01) || pos + 14 > TS_PACKET_SIZE) {
+        return -1;
+    }
+
+    const uint8_t* pes = packet + pos;
+    if (pes[0] != 0x00 || pes[1] != 0x00 || pes[2] != 0x01 || (pes[3] & 0xF0) != 0xE0 || !(pes[7] & 0x80)) {
+        return -1;
+    }
+    return ((int64_t)((pes[9] >> 1) & 0x07) << 30) | ((int64_t)pes[10] << 22) |
+           ((int64_t)(pes[11] >> 1) << 15) | ((int64_t)pes[12] << 7) | (pes[13] >> 1);
+}
+
+// Start of the last video PES. Video PES have no length in TS, so nothing tells whether the
+// one being written at the crash is whole: it goes, with the PAT/PMT in front of it
+static int64_t lastTsPesStart(const uint8_t* data, int64_t size) {
+    for (int64_t offset = size - TS_PACKET_SIZE; offset >= 0; offset -= TS_PACKET_SIZE) {
+        uint16_t pid;
+        bool key;
+        if (parseTsVideoPts(data + offset, pid, key) < 0) {
+            continue;
+        }
+        while (offset >= TS_PACKET_SIZE && (tsPid(data + offset - TS_PACKET_SIZE) == TS_PAT_PID ||
+                                            tsPid(data + offset - TS_PACKET_SIZE) == TS_PMT_PID)) {
+            offset -= TS_PACKET_SIZE;
+        }
+        return offset;
+    }
+    return size;
+}
+
+// Returns the pts of the last video PES relative to the first entry, -1 if there is none
+static int64_t indexTs(const uint8_t* data, int64_t size, std::vector<SegmentIndexEntry>& entries) {
+    // The keyframe of the last checkpointed entry gives the pts origin
+    bool known = !entries.empty();
+    int64_t from = known ? entries.back().offset : 0;
+    int64_t basePts = -1;
+    int64_t tables = -1;
+    int64_t lastPts = -1;
+
+    for (int64_t offset = from; offset + TS_PACKET_SIZE <= size; offset += TS_PACKET_SIZE) {
+        uint16_t pid;
+        bool key;
+        int64_t pts = parseTsVideoPts(data + offset, pid, key);
+
+        // PAT/PMT right before a keyframe belong to it, a player needs them to start there
+        if (pid == TS_PAT_PID || pid == TS_PMT_PID) {
+            if (tables < 0) {
+                tables = offset;
+            }
+            continue;
+        }
+        int64_t start = tables >= 0 ? tables : offset;
+        tables = -1;
+        if (pts >= 0 && basePts >= 0) {
+            lastPts = std::max(lastPts, pts);
+        }
+        if (pts < 0 || !key) {
+            continue;
+        }
+
+        if (basePts < 0) {
+            lastPts = pts;
+            if (known) {
+                basePts = pts - entries.back().ptsUs * 9 / 100;
+                continue;
+            }
+            basePts = pts;
+        }
+        SegmentIndexEntry entry = {};
+        entry.ptsUs = (pts - basePts) * 100 / 9;
+        entry.offset = start;
+        entry.flags = SEGMENT_INDEX_FLAG_KEY;
+        entries.push_back(entry);
+    }
+    return lastPts < 0 ? -1 : (lastPts - basePts) * 100 / 9;
+}
+
+static bool readMp4Box(const uint8_t* data, int64_t end, int64_t pos, Mp4Box& box) {
+    if (pos + 8 > end) {
+        return false;
+    }
+
+    box.offset = pos;
+    box.size = readBe32(data + pos);
+    box.type = readBe32(data + pos + 4);
+    box.header = 8;
+    if (box.size == 1) {
+        if (pos + 16 > end) {
+            return false;
+        }
+        box.size = readBe64(data + pos + 8);
+        box.header = 16;
+    } else if (box.size == 0) {
+        box.size = end - pos;
+    }
+    return box.size >= box.header && pos + box.size <= end;
+}
+
+static bool findMp4Box(const uint8_t* data, const Mp4Box& parent, uint32_t type, Mp4Box& box) {
+    int64_t end = parent.offset + parent.size;
+    for (int64_t pos = parent.offset + parent.header; readMp4Box(data, end, pos, box); pos += box.size) {
+        if (box.type == type) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint32_t mp4Timescale(const uint8_t* data, const Mp4Box& moov) {
+    Mp4Box trak, mdia, mdhd;
+    if (!findMp4Box(data, moov, MP4_TYPE('t', 'r', 'a', 'k'), trak) ||
+        !findMp4Box(data, trak, MP4_TYPE('m', 'd', 'i', 'a'), mdia) ||
+        !findMp4Box(data, mdia, MP4_TYPE('m', 'd', 'h', 'd'), mdhd)) {
+        return 0;
+    }
+    const uint8_t* payload = data + mdhd.offset + mdhd.header;
+    return readBe32(payload + (payload[0] == 1 ? 20 : 12));
+}
+
+// baseMediaDecodeTime of the fragment, -1 without a tfdt
+static int64_t mp4FragmentTime(const uint8_t* data, const Mp4Box& moof) {
+    Mp4Box traf, tfdt;
+    if (!findMp4Box(data, moof, MP4_TYPE('t', 'r', 'a', 'f'), traf) ||
+        !findMp4Box(data, traf, MP4_TYPE('t', 'f', 'd', 't'), tfdt)) {
+        return -1;
+    }
+    const uint8_t* payload = data + tfdt.offset + tfdt.header;
+    return payload[0] == 1 ? (int64_t)readBe64(payload + 4) : readBe32(payload + 4);
+}
+
+// Top level boxes are hopped over by size, so this reads a few bytes per fragment
+static int64_t indexMp4(const uint8_t* data, int64_t size, std::vector<SegmentIndexEntry>& entries) {
+    std::vector<std::pair<int64_t, int64_t>> fragments;  // moof offset, decode time
+    uint32_t timescale = 0;
+    int64_t valid = 0;
+    Mp4Box moof = {-1, 0, 0, 0};
+    Mp4Box box;
+
+    for (int64_t pos = 0; readMp4Box(data, size, pos, box); pos += box.size) {
+        if (box.type == MP4_TYPE('m', 'o', 'o', 'v')) {
+            timescale = mp4Timescale(data, box);
+            valid = pos + box.size;
+        } else if (box.type == MP4_TYPE('m', 'o', 'o', 'f')) {
+            moof = box;
+        } else if (box.type == MP4_TYPE('m', 'd', 'a', 't')) {
+            // A fragment only counts once its media data is complete
+            if (moof.offset >= 0) {
+                fragments.push_back({moof.offset, mp4FragmentTime(data, moof)});
+                moof.offset = -1;
+            }
+            valid = pos + box.size;
+        } else if (moof.offset < 0) {
+            valid = pos + box.size;
+        }
+    }
+    if (timescale == 0) {
+        return valid;
+    }
+
+    while (!entries.empty() && entries.back().offset >= valid) {
+        entries.pop_back();
+    }
+
+    int64_t from = entries.empty() ? -1 : entries.back().offset;
+    int64_t baseTime = -1;
+    for (const auto& fragment : fragments) {
+        if (fragment.second < 0) {
+            continue;
+        }
+        if (fragment.first == from) {
+            baseTime = fragment.second - entries.back().ptsUs * timescale / 1000000;
+        }
+        if (fragment.first <= from) {
+            continue;
+        }
+        if (baseTime < 0) {
+            baseTime = fragment.second;
+        }
+        SegmentIndexEntry entry = {};
+        entry.ptsUs = (fragment.second - baseTime) * 1000000 / timescale;
+        entry.offset = fragment.first;
+        entry.flags = SEGMENT_INDEX_FLAG_KEY;
+        entries.push_back(entry);
+    }
+    return valid;
+}
+
+Result recoverSegment(const std::string& path) {
+    std::vector<SegmentIndexEntry> entries;
+    int64_t startTimeUs = 0;
+    {
+        SegmentIndex index;
+        if (index.open(path) == Result::SUCCESS) {
+            if (index.isComplete()) {
+                return Result::SUCCESS;
+            }
+            entries.assign(index.entries(), index.entries() + index.size());
+            startTimeUs = index.getStartTime();
+        }
+    }
+    size_t checkpointed = entries.size();
+
+    int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        return Result::FILE_NOT_FOUND;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        ::close(fd);
+        return Result::INVALID_ARGUMENT;
+    }
+
+    void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        ::close(fd);
+        return Result::UNKNOWN_ERROR;
+    }
+    const uint8_t* data = (const uint8_t*)map;
+
+    int64_t valid;
+    int64_t endPtsUs = -1;
+    if (hasSuffix(path, CAMERA_RECORD_EXT_FMP4)) {
+        valid = indexMp4(data, st.st_size, entries);
+    } else if (hasSuffix(path, CAMERA_RECORD_EXT_RAW)) {
+        // The demuxer reads up to a torn cluster on its own, the checkpointed entries are
+        // enough for the archive transcode to pick it up
+        valid = st.st_size;
+    } else {
+        valid = lastTsPesStart(data, validTsSize(data, st.st_size));
+        while (!entries.empty() && entries.back().offset >= valid) {
+            entries.pop_back();
+        }
+        endPtsUs = indexTs(data, valid, entries);
+    }
+    munmap(map, st.st_size);
+    // Without per packet pts the last fragment or keyframe start is as far as it is known
+    if (endPtsUs < 0) {
+        endPtsUs = entries.empty() ? 0 : entries.back().ptsUs;
+    }
+
+    if (valid < st.st_size) {
+        if (ftruncate(fd, valid) < 0) {
+            LOG(ERROR) << "Failed to truncate " << path << ": " << strerror(errno);
+        }
+        fdatasync(fd);
+    }
+    ::close(fd);
+
+    if (startTimeUs == 0) {
+        startTimeUs = (int64_t)st.st_mtime * 1000000 - (entries.empty() ? 0 : entries.back().ptsUs);
+    }
+    Result result = writeSegmentIndex(path, startTimeUs, entries, endPtsUs, valid);
+
+    LOG(INFO) << "Recovered " << path << ": dropped " << st.st_size - valid << " bytes, "
+              << entries.size() << " keyframes, " << checkpointed << " from the last checkpoint";
+    return result;
+}
+
+void recoverSegments(const std::string& dir) {
+    DIR* handle = opendir(dir.c_str());
+    if (!handle) {
+        return;
+    }
+
+    std::vector<std::string> segments;
+    while (struct dirent* entry = readdir(handle)) {
+        std::string name = entry->d_name;
+        std::string path = dir + "/" + name;
+        if (hasSuffix(name, SEGMENT_INDEX_EXT ".tmp") || hasSuffix(name, THUMBNAIL_EXT ".tmp")) {
+            unlink(path.c_str());
+        } else if ((hasSuffix(name, CAMERA_RECORD_EXT) || hasSuffix(name, CAMERA_RECORD_EXT_FMP4) ||
+                    hasSuffix(name, CAMERA_RECORD_EXT_RAW)) &&
+                   name.find(CLIP_MARKER) == std::string::npos) {
+            segments.push_back(path);
+        }
+    }
+    closedir(handle);
+
+    for (const std::string& path : segments) {
+        // Checked per segment, a writer may have opened one since the scan
+        if (RetentionManager::instance().isActive(path)) {
+            continue;
+        }
+        SegmentIndex index;
+        if (index.open(path) == Result::SUCCESS && index.isComplete()) {
+            continue;
+        }
+        index.close();
+        recoverSegment(path);
+    }
+}
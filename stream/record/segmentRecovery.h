@@ -0,0 +1,20 @@
+#ifndef SEGMENT_RECOVERY
+#define SEGMENT_RECOVERY
+
+#include "baseStream.h"
+#include "segmentIndex.h"
+#include "thumbnailSheet.h"
+
+#define TS_PACKET_SIZE  188
+#define TS_SYNC_BYTE    0x47
+#define TS_PAT_PID      0x0000
+#define TS_PMT_PID      0x1000  // ffmpeg mpegts muxer default
+
+// A segment whose index has no closing entry was cut off by a crash. It is truncated
+// in front of the last TS PES or after the last complete MP4 fragment, then only the part
+// after the last index checkpoint is scanned for keyframes, not the whole file.
+Result recoverSegment(const std::string& path);
+// Only safe before the directory's writers start, leftover .tmp files are deleted
+void recoverSegments(const std::string& dir);
+
+#endif
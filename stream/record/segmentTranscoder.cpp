@@ -0,0 +1,290 @@
+#include "segmentTranscoder.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+
+static const AVRational kMicroseconds = {1, 1000000};
+
+Result SegmentTranscoder::openInput() {
+    if (avformat_open_input(&input_ctx, mInPath.c_str(), nullptr, nullptr) < 0) {
+        LOG(ERROR) << "Failed to open recording " << mInPath;
+        return Result::FILE_NOT_FOUND;
+    }
+    if (avformat_find_stream_info(input_ctx, nullptr) < 0) {
+        LOG(ERROR) << "Failed to read stream info of " << mInPath;
+        return Result::INVALID_ARGUMENT;
+    }
+
+    for (unsigned int i = 0; i < input_ctx->nb_streams; i++) {
+        if (input_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+            input_stream = input_ctx->streams[i];
+            break;
+        }
+    }
+    if (!input_stream) {
+        LOG(ERROR) << "No video stream in " << mInPath;
+        return Result::INVALID_ARGUMENT;
+    }
+
+    AVCodec* decoder = avcodec_find_decoder(input_stream->codecpar->codec_id);
+    if (!decoder) {
+        LOG(ERROR) << "Failed to find decoder for transcode.";
+        return Result::INVALID_ARGUMENT;
+    }
+    decoder_ctx = avcodec_alloc_context3(decoder);
+    avcodec_parameters_to_context(decoder_ctx, input_stream->codecpar);
+    decoder_ctx->thread_count = 1;
+    if (avcodec_open2(decoder_ctx, decoder, nullptr) < 0) {
+        LOG(ERROR) << "Failed to open decoder for transcode.";
+        return Result::INVALID_ARGUMENT;
+    }
+
+    frame = av_frame_alloc();
+    encoded_packet = av_packet_alloc();
+    return Result::SUCCESS;
+}
+
+Result SegmentTranscoder::openEncoder() {
+    AVCodec* encoder = avcodec_find_encoder(mCodecId);
+    if (!encoder) {
+        LOG(ERROR) << "Failed to find encoder for transcode.";
+        return Result::INVALID_ARGUMENT;
+    }
+
+    AVRational fps = input_stream->avg_frame_rate.num > 0 ? input_stream->avg_frame_rate : AVRational{25, 1};
+    encoder_ctx = avcodec_alloc_context3(encoder);
+    encoder_ctx->width = decoder_ctx->width;
+    encoder_ctx->height = decoder_ctx->height;
+    encoder_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+    encoder_ctx->time_base = input_stream->time_base;
+    encoder_ctx->framerate = fps;
+    encoder_ctx->bit_rate = mBitRate;
+    encoder_ctx->gop_size = fps.num / fps.den;  // one keyframe a second keeps the index as dense as the live record
+    encoder_ctx->max_b_frames = 0;              // dts == pts, index offsets and clip export stay simple
+    encoder_ctx->thread_count = 1;              // background work, never more than one core
+    av_opt_set(encoder_ctx->priv_data, "preset", mPreset, 0);
+
+    if (avcodec_open2(encoder_ctx, encoder, nullptr) < 0) {
+        LOG(ERROR) << "Failed to open encoder for transcode.";
+        avcodec_free_context(&encoder_ctx);
+        return Result::INVALID_ARGUMENT;
+    }
+
+    yuv_frame = av_frame_alloc();
+    yuv_frame->format = encoder_ctx->pix_fmt;
+    yuv_frame->width = encoder_ctx->width;
+    yuv_frame->height = encoder_ctx->height;
+    if (av_frame_get_buffer(yuv_frame, 32) < 0) {
+        LOG(ERROR) << "Failed to allocate transcode frame.";
+        return Result::UNKNOWN_ERROR;
+    }
+    if (mThumbnailUs > 0) {
+        mThumbnails = std::make_unique<ThumbnailSheet>(encoder_ctx->width, encoder_ctx->height, mThumbnailUs);
+    }
+    return Result::SUCCESS;
+}
+
+Result SegmentTranscoder::openOutput() {
+    avformat_alloc_output_context2(&output_ctx, nullptr, CAMERA_RECORD_FORMAT, mOutPath.c_str());
+    if (!output_ctx) {
+        LOG(ERROR) << "Failed to create transcode output context.";
+        return Result::INVALID_ARGUMENT;
+    }
+
+    output_stream = avformat_new_stream(output_ctx, nullptr);
+    avcodec_parameters_from_context(output_stream->codecpar, encoder_ctx);
+    output_stream->time_base = encoder_ctx->time_base;
+
+    if (avio_open(&output_ctx->pb, mOutPath.c_str(), AVIO_FLAG_WRITE) < 0) {
+        LOG(ERROR) << "Failed to open transcode output " << mOutPath;
+        return Result::FILE_NOT_FOUND;
+    }
+    if (avformat_write_header(output_ctx, nullptr) < 0) {
+        LOG(ERROR) << "Failed to write transcode header.";
+        return Result::INVALID_ARGUMENT;
+    }
+    return Result::SUCCESS;
+}
+
+void SegmentTranscoder::close() {
+    if (output_ctx) {
+        if (output_ctx->pb) {
+            avio_closep(&output_ctx->pb);
+        }
+        avformat_free_context(output_ctx);
+        output_ctx = nullptr;
+    }
+    if (input_ctx) {
+        avformat_close_input(&input_ctx);
+    }
+    avcodec_free_context(&decoder_ctx);
+    avcodec_free_context(&encoder_ctx);
+    if (sws_ctx) {
+        sws_freeContext(sws_ctx);
+        sws_ctx = nullptr;
+    }
+    av_frame_free(&frame);
+    av_frame_free(&yuv_frame);
+    av_packet_free(&encoded_packet);
+}
+
+Result SegmentTranscoder::writePackets() {
+    while (avcodec_receive_packet(encoder_ctx, encoded_packet) >= 0) {
+        bool key = encoded_packet->flags & AV_PKT_FLAG_KEY;
+        int64_t ptsUs = av_rescale_q(encoded_packet->pts - mBasePts, encoder_ctx->time_base, kMicroseconds);
+        // The muxer puts PAT/PMT right in front of a keyframe, the entry starts there
+        int64_t offset = avio_tell(output_ctx->pb);
+
+        av_packet_rescale_ts(encoded_packet, encoder_ctx->time_base, output_stream->time_base);
+        encoded_packet->stream_index = output_stream->index;
+        if (av_interleaved_write_frame(output_ctx, encoded_packet) < 0) {
+            LOG(ERROR) << "Failed to write transcoded packet to " << mOutPath;
+            av_packet_unref(encoded_packet);
+            return Result::UNKNOWN_ERROR;
+        }
+
+        mEndPtsUs = std::max(mEndPtsUs, ptsUs);
+        if (key) {
+            SegmentIndexEntry entry = {};
+            entry.ptsUs = ptsUs;
+            entry.offset = offset;
+            entry.flags = SEGMENT_INDEX_FLAG_KEY;
+            mEntries.push_back(entry);
+        }
+    }
+    return Result::SUCCESS;
+}
+
+Result SegmentTranscoder::encodeFrame(AVFrame* decoded) {
+    sws_ctx = sws_getCachedContext(sws_ctx,
+        decoded->width, decoded->height, (AVPixelFormat)decoded->format,
+        yuv_frame->width, yuv_frame->height, AV_PIX_FMT_YUV420P,
+        SWS_BILINEAR, nullptr, nullptr, nullptr);
+    if (!sws_ctx || av_frame_make_writable(yuv_frame) < 0) {
+        return Result::UNKNOWN_ERROR;
+    }
+    sws_scale(sws_ctx, decoded->data, decoded->linesize, 0, decoded->height, yuv_frame->data, yuv_frame->linesize);
+
+    int64_t pts = decoded->best_effort_timestamp;
+    if (pts == AV_NOPTS_VALUE || (mLastPts != AV_NOPTS_VALUE && pts <= mLastPts)) {
+        pts = mLastPts == AV_NOPTS_VALUE ? 0 : mLastPts + 1;
+    }
+    if (mBasePts == AV_NOPTS_VALUE) {
+        mBasePts = pts;
+    }
+    mLastPts = pts;
+    yuv_frame->pts = pts;
+
+    if (mThumbnails) {
+        mThumbnails->add(yuv_frame, mThumbnailPath, av_rescale_q(pts - mBasePts, encoder_ctx->time_base, kMicroseconds));
+    }
+    mFrames++;
+
+    if (avcodec_send_frame(encoder_ctx, yuv_frame) < 0) {
+        return Result::UNKNOWN_ERROR;
+    }
+    return writePackets();
+}
+
+Result SegmentTranscoder::run() {
+    Result result = openInput();
+    if (result == Result::SUCCESS) {
+        result = openEncoder();
+    }
+    if (result == Result::SUCCESS) {
+        result = openOutput();
+    }
+
+    AVPacket* packet = av_packet_alloc();
+    while (result == Result::SUCCESS) {
+        if (mYield && !mYield()) {
+            result = Result::INVALID_STATE;
+            break;
+        }
+        if (av_read_frame(input_ctx, packet) < 0) {
+            break;
+        }
+        if (packet->stream_index != input_stream->index) {
+            av_packet_unref(packet);
+            continue;
+        }
+
+        avcodec_send_packet(decoder_ctx, packet);
+        av_packet_unref(packet);
+        while (result == Result::SUCCESS && avcodec_receive_frame(decoder_ctx, frame) >= 0) {
+            result = encodeFrame(frame);
+        }
+    }
+    av_packet_free(&packet);
+
+    // Drain what the decoder and encoder still hold
+    if (result == Result::SUCCESS) {
+        avcodec_send_packet(decoder_ctx, nullptr);
+        while (result == Result::SUCCESS && avcodec_receive_frame(decoder_ctx, frame) >= 0) {
+            result = encodeFrame(frame);
+        }
+    }
+    if (result == Result::SUCCESS) {
+        avcodec_send_frame(encoder_ctx, nullptr);
+        result = writePackets();
+    }
+    if (result == Result::SUCCESS && (mFrames == 0 || av_write_trailer(output_ctx) < 0)) {
+        LOG(ERROR) << "Nothing transcoded from " << mInPath;
+        result = Result::INVALID_ARGUMENT;
+    }
+    if (result == Result::SUCCESS) {
+        avio_flush(output_ctx->pb);
+        mEndOffset = avio_tell(output_ctx->pb);
+    }
+    if (mThumbnails) {
+        if (result == Result::SUCCESS) {
+            mThumbnails->flush();
+        } else {
+            mThumbnails->discard();
+        }
+        mThumbnails.reset();
+    }
+    close();
+
+    // The caller swaps files next, the data has to be on the card first
+    if (result == Result::SUCCESS) {
+        int fd = ::open(mOutPath.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fdatasync(fd) < 0) {
+            result = Result::UNKNOWN_ERROR;
+        }
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+    return result;
+}
+
+Result SegmentTranscoder::verify() {
+    AVFormatContext* check_ctx = nullptr;
+    if (avformat_open_input(&check_ctx, mOutPath.c_str(), nullptr, nullptr) < 0) {
+        LOG(ERROR) << "Failed to reopen " << mOutPath;
+        return Result::FILE_NOT_FOUND;
+    }
+
+    uint64_t frames = 0;
+    uint64_t keyframes = 0;
+    if (avformat_find_stream_info(check_ctx, nullptr) >= 0) {
+        AVPacket* packet = av_packet_alloc();
+        while (av_read_frame(check_ctx, packet) >= 0) {
+            if (check_ctx->streams[packet->stream_index]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+                frames++;
+                keyframes += (packet->flags & AV_PKT_FLAG_KEY) ? 1 : 0;
+            }
+            av_packet_unref(packet);
+        }
+        av_packet_free(&packet);
+    }
+    avformat_close_input(&check_ctx);
+
+    if (frames != mFrames || keyframes == 0) {
+        LOG(ERROR) << "Verify failed for " << mOutPath << ": " << frames << " of " << mFrames << " frames, "
+                   << keyframes << " keyframes";
+        return Result::INVALID_ARGUMENT;
+    }
+    return Result::SUCCESS;
+}
@@ -0,0 +1,90 @@
+#ifndef SEGMENT_TRANSCODER
+#define SEGMENT_TRANSCODER
+
+#include "baseStream.h"
+#include "segmentIndex.h"
+#include "thumbnailSheet.h"
+
+#define TRANSCODE_PRESET    "veryfast"
+#define TRANSCODE_BITRATE   500000
+
+// Re-encodes one finished recording into a new file in the record format and collects
+// its keyframe index on the way. Runs on the caller's thread, a background job drives
+// it and decides what happens to the source afterwards.
+class SegmentTranscoder {
+public:
+    // Called before every packet, may block to throttle; false aborts the transcode
+    typedef std::function<bool()> YieldCallback;
+
+    SegmentTranscoder(const std::string& inPath, const std::string& outPath)
+        : mInPath(inPath), mOutPath(outPath) {
+    }
+
+    ~SegmentTranscoder() {
+        close();
+    }
+
+    void setEncoder(AVCodecID codecId, const char* preset, int64_t bitRate) {
+        mCodecId = codecId;
+        mPreset = preset;
+        mBitRate = bitRate;
+    }
+    void setYield(YieldCallback yield) {
+        mYield = yield;
+    }
+    // Sprite sheets from the decoded frames, named after segmentPath and only written on success
+    void setThumbnails(int64_t intervalUs, const std::string& segmentPath) {
+        mThumbnailUs = intervalUs;
+        mThumbnailPath = segmentPath;
+    }
+
+    // Output is complete and flushed to the card on success
+    Result run();
+    // Demuxes the finished output back, every encoded frame has to be there
+    Result verify();
+
+    const std::vector<SegmentIndexEntry>& getEntries() const { return mEntries; }
+    // For the index END entry: last packet pts relative to the first, and the output size
+    int64_t getEndPts() const { return mEndPtsUs; }
+    int64_t getEndOffset() const { return mEndOffset; }
+    uint64_t getFrames() const { return mFrames; }
+
+private:
+    Result openInput();
+    Result openEncoder();
+    Result openOutput();
+    void close();
+
+    Result encodeFrame(AVFrame* frame);
+    Result writePackets();
+
+    std::string mInPath;
+    std::string mOutPath;
+    AVCodecID mCodecId = AV_CODEC_ID_H264;
+    const char* mPreset = TRANSCODE_PRESET;
+    int64_t mBitRate = TRANSCODE_BITRATE;
+    YieldCallback mYield;
+    int64_t mThumbnailUs = 0;
+    std::string mThumbnailPath;
+    std::unique_ptr<ThumbnailSheet> mThumbnails;
+
+    std::vector<SegmentIndexEntry> mEntries;
+    int64_t mBasePts = AV_NOPTS_VALUE;
+    int64_t mLastPts = AV_NOPTS_VALUE;
+    int64_t mEndPtsUs = 0;
+    int64_t mEndOffset = 0;
+    uint64_t mFrames = 0;
+
+    AVFormatContext* input_ctx = nullptr;
+    AVFormatContext* output_ctx = nullptr;
+    AVStream* input_stream = nullptr;
+    AVStream* output_stream = nullptr;
+    AVCodecContext* decoder_ctx = nullptr;
+    AVCodecContext* encoder_ctx = nullptr;
+    struct SwsContext* sws_ctx = nullptr;
+    AVFrame* frame = nullptr;
+    AVFrame* yuv_frame = nullptr;
+    AVPacket* encoded_packet = nullptr;
+};
+
+#endif
@@ -0,0 +1,225 @@
+#include "segmentWriter.h"
+#include "retentionManager.h"
+#include "asyncWriter.h"
+#include "h264Parser.h"
+#include "eventLog.h"
+#include <sys/stat.h>
+#include <ctime>
+#include <algorithm>
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+Result SegmentWriter::setStream(const AVCodecContext* encoder) {
+    if (!codecpar) {
+        codecpar = avcodec_parameters_alloc();
+    }
+    if (avcodec_parameters_from_context(codecpar, encoder) < 0) {
+        LOG(ERROR) << "Failed to copy encoder parameters for segment writer.";
+        return Result::INVALID_ARGUMENT;
+    }
+    encoder_time_base = encoder->time_base;
+    return createDir();
+}
+
+Result SegmentWriter::setStream(const AVCodecParameters* par, AVRational time_base) {
+    if (!codecpar) {
+        codecpar = avcodec_parameters_alloc();
+    }
+    if (avcodec_parameters_copy(codecpar, par) < 0) {
+        LOG(ERROR) << "Failed to copy stream parameters for segment writer.";
+        return Result::INVALID_ARGUMENT;
+    }
+    codecpar->codec_tag = 0;  // v4l2 tag, let the muxer pick its own
+    encoder_time_base = time_base;
+    return createDir();
+}
+
+Result SegmentWriter::createDir() {
+    if (mkdir(mDir.c_str(), 0755) < 0 && errno != EEXIST) {
+        LOG(ERROR) << "Failed to create record directory " << mDir;
+        return Result::FILE_NOT_FOUND;
+    }
+    return Result::SUCCESS;
+}
+
+bool SegmentWriter::shouldRotate(const AVPacket* packet) {
+    if (!(packet->flags & AV_PKT_FLAG_KEY)) {
+        return false;
+    }
+    if (!format_ctx || mRotateRequested) {
+        return true;
+    }
+
+    int64_t duration = av_rescale_q(packet->pts - mStartPts, encoder_time_base, AVRational{1, 1000000});
+    return duration >= mMaxDurationUs || avio_tell(format_ctx->pb) >= mMaxBytes;
+}
+
+Result SegmentWriter::openSegment(const AVPacket* keyframe) {
+    char stamp[32];
+    time_t now = time(nullptr);
+    struct tm local;
+    localtime_r(&now, &local);
+    strftime(stamp, sizeof(stamp), "%Y%m%d_%H%M%S", &local);
+
+    // Size based rotation can happen twice within a second
+    std::string base = mDir + "/" + mPrefix + "_" + stamp;
+    std::string path = base + mExtension;
+    struct stat st;
+    for (int i = 1; stat(path.c_str(), &st) == 0; i++) {
+        path = base + "_" + std::to_string(i) + mExtension;
+    }
+
+    avformat_alloc_output_context2(&format_ctx, nullptr, mFormat, path.c_str());
+    if (!format_ctx) {
+        LOG(ERROR) << "Failed to create output format context.";
+        return Result::INVALID_ARGUMENT;
+    }
+
+    video_stream = avformat_new_stream(format_ctx, nullptr);
+    avcodec_parameters_copy(video_stream->codecpar, codecpar);
+    video_stream->time_base = encoder_time_base;
+
+    // MP4 wants SPS/PPS in the sample description, x264 repeats them on every keyframe
+    if (mFragmented) {
+        std::vector<uint8_t> avcc = buildH264AvcC(keyframe->data, keyframe->size);
+        if (avcc.empty()) {
+            LOG(ERROR) << "No SPS/PPS in keyframe, can't start MP4 segment.";
+            avformat_free_context(format_ctx);
+            format_ctx = nullptr;
+            return Result::INVALID_ARGUMENT;
+        }
+        av_freep(&video_stream->codecpar->extradata);
+        video_stream->codecpar->extradata = (uint8_t*)av_mallocz(avcc.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+        memcpy(video_stream->codecpar->extradata, avcc.data(), avcc.size());
+        video_stream->codecpar->extradata_size = avcc.size();
+    }
+
+    // Active before the file exists, so startup recovery never touches it
+    RetentionManager::instance().addActive(path);
+
+    // Muxer output goes through the writer thread, never straight to the card
+    format_ctx->pb = AsyncWriter::instance().open(path, mMaxBytes);
+    format_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    if (!format_ctx->pb) {
+        LOG(ERROR) << "Failed to open output file " << path;
+        RetentionManager::instance().removeActive(path);
+        avformat_free_context(format_ctx);
+        format_ctx = nullptr;
+        return Result::FILE_NOT_FOUND;
+    }
+
+    AVDictionary* options = nullptr;
+    if (mFragmented) {
+        av_dict_set(&options, "movflags", RECORD_FMP4_MOVFLAGS, 0);
+    }
+    int ret = avformat_write_header(format_ctx, &options);
+    av_dict_free(&options);
+    if (ret < 0) {
+        LOG(ERROR) << "Failed to write header for output file.";
+        RetentionManager::instance().removeActive(path);
+        AsyncWriter::instance().close(&format_ctx->pb);
+        avformat_free_context(format_ctx);
+        format_ctx = nullptr;
+        return Result::INVALID_ARGUMENT;
+    }
+
+    mPath = path;
+    int64_t startTime = av_gettime();
+    mIndex.open(mPath, startTime);
+    EventLog::instance().append(EventSegmentStart, mPrefix, mPath.substr(mPath.find_last_of('/') + 1), startTime);
+    LOG_TAG_INFO(mPrefix, "Recording segment " << mPath);
+    return Result::SUCCESS;
+}
+
+Result SegmentWriter::write(AVPacket* packet) {
+    // Shed load a whole GOP at a time before the muxer, the files stay intact
+    if (packet->flags & AV_PKT_FLAG_KEY) {
+        mSkipGop = AsyncWriter::instance().isBackedUp();
+        if (mSkipGop && ++mSkippedGops % 10 == 1) {
+            LOG_TAG_WARNING(mPrefix, "Storage backed up, skipped " << mSkippedGops << " GOPs");
+        }
+    }
+    if (mSkipGop) {
+        return Result::SUCCESS;
+    }
+
+    if (shouldRotate(packet)) {
+        close();
+        Result result = openSegment(packet);
+        if (result != Result::SUCCESS) {
+            return result;
+        }
+        mStartPts = packet->pts;
+        mRotateRequested = false;
+        mLastPtsUs = 0;
+        mCheckpointPtsUs = 0;
+    }
+
+    // Nothing to append to until the first keyframe opens a segment
+    if (!format_ctx) {
+        return Result::SUCCESS;
+    }
+
+    bool key = packet->flags & AV_PKT_FLAG_KEY;
+    int64_t ptsUs = av_rescale_q(packet->pts - mStartPts, encoder_time_base, AVRational{1, 1000000});
+    int64_t offset = avio_tell(format_ctx->pb);
+
+    // Same bitstream, only the NAL framing changes, no re-encode
+    if (mFragmented) {
+        convertH264ToAvcc(packet->data, packet->size, mAvccBuffer);
+        if (!mAvccPacket) {
+            mAvccPacket = av_packet_alloc();
+        }
+        if (av_new_packet(mAvccPacket, mAvccBuffer.size()) < 0) {
+            return Result::UNKNOWN_ERROR;
+        }
+        memcpy(mAvccPacket->data, mAvccBuffer.data(), mAvccBuffer.size());
+        av_packet_copy_props(mAvccPacket, packet);
+        packet = mAvccPacket;
+    }
+
+    av_packet_rescale_ts(packet, encoder_time_base, video_stream->time_base);
+    if (packet->pts < packet->dts) {
+        packet->pts = packet->dts;
+    }
+    packet->stream_index = video_stream->index;
+
+    if (av_interleaved_write_frame(format_ctx, packet) < 0) {
+        LOG(ERROR) << "Failed to write packet to " << mPath;
+        return Result::UNKNOWN_ERROR;
+    }
+
+    if (key) {
+        // A keyframe flushes the previous fragment, its own moof starts right after
+        if (mFragmented) {
+            offset = avio_tell(format_ctx->pb);
+        }
+        mIndex.add(ptsUs, offset, SEGMENT_INDEX_FLAG_KEY);
+
+        // Data first, both go through the same writer queue, so a durable entry
+        // never points past durable data
+        if (ptsUs - mCheckpointPtsUs >= RECORD_INDEX_CHECKPOINT_US) {
+            AsyncWriter::instance().sync(format_ctx->pb);
+            mIndex.checkpoint();
+            mCheckpointPtsUs = ptsUs;
+        }
+    }
+    mLastPtsUs = std::max(mLastPtsUs, ptsUs);
+    return Result::SUCCESS;
+}
+
+Result SegmentWriter::close() {
+    if (format_ctx) {
+        mIndex.finish(mLastPtsUs, avio_tell(format_ctx->pb));
+    }
+    mIndex.close();
+    if (format_ctx) {
+        // Trailer and close happen on the storage thread, the encoder moves straight on
+        RetentionManager::instance().finishSegment(format_ctx, mPath);
+        format_ctx = nullptr;
+        video_stream = nullptr;
+    }
+    return Result::SUCCESS;
+}
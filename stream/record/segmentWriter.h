@@ -0,0 +1,83 @@
+#ifndef SEGMENT_WRITER
+#define SEGMENT_WRITER
+
+#include "baseStream.h"
+#include "segmentIndex.h"
+#include <cstring>
+
+#define RECORD_SEGMENT_DURATION_US (300LL * 1000000)       // rotate every 5 minutes
+#define RECORD_SEGMENT_MAX_BYTES   (64LL * 1024 * 1024)    // or at 64 MB, whichever comes first
+#define RECORD_INDEX_CHECKPOINT_US (5LL * 1000000)        // index and data made durable this often
+#define RECORD_FMP4_MOVFLAGS       "frag_keyframe+empty_moov+default_base_moof"
+
+// Writes encoded packets into a rolling series of files. A new segment is only started
+// on a keyframe, so every file can be played on its own.
+class SegmentWriter {
+public:
+    SegmentWriter(const std::string& dir, const std::string& prefix, const char* format)
+        : mDir(dir), mPrefix(prefix), mFormat(format),
+          mExtension(strcmp(format, CAMERA_RECORD_FORMAT_FMP4) == 0  ? CAMERA_RECORD_EXT_FMP4
+                     : strcmp(format, CAMERA_RECORD_FORMAT_RAW) == 0 ? CAMERA_RECORD_EXT_RAW
+                                                                     : CAMERA_RECORD_EXT),
+          mFragmented(strcmp(format, CAMERA_RECORD_FORMAT_FMP4) == 0) {
+    }
+
+    ~SegmentWriter() {
+        close();
+        avcodec_parameters_free(&codecpar);
+        av_packet_free(&mAvccPacket);
+    }
+
+    Result setStream(const AVCodecContext* encoder);
+    // Packets copied from the input as they are, timestamps in time_base
+    Result setStream(const AVCodecParameters* par, AVRational time_base);
+    void setLimits(int64_t maxDurationUs, int64_t maxBytes) {
+        mMaxDurationUs = maxDurationUs;
+        mMaxBytes = maxBytes;
+    }
+
+    // Start a new segment at the next keyframe regardless of the limits
+    void requestRotation() {
+        mRotateRequested = true;
+    }
+
+    // Packet timestamps are in the encoder time base
+    Result write(AVPacket* packet);
+    Result close();
+
+    const std::string& getPath() const { return mPath; }
+    bool isOpen() const { return format_ctx != nullptr; }
+    // Encoder time base pts of the keyframe that opened the current segment
+    int64_t getStartPts() const { return mStartPts; }
+    AVRational getTimeBase() const { return encoder_time_base; }
+
+private:
+    Result createDir();
+    Result openSegment(const AVPacket* keyframe);
+    bool shouldRotate(const AVPacket* packet);
+
+    std::string mDir;
+    std::string mPrefix;
+    const char* mFormat;
+    const char* mExtension;
+    bool mFragmented;   // keyframe fragmented MP4, playable after a crash and by MSE as is
+    int64_t mMaxDurationUs = RECORD_SEGMENT_DURATION_US;
+    int64_t mMaxBytes = RECORD_SEGMENT_MAX_BYTES;
+
+    AVCodecParameters* codecpar = nullptr;
+    AVRational encoder_time_base = {1, 1};
+    AVFormatContext* format_ctx = nullptr;
+    AVStream* video_stream = nullptr;
+    std::string mPath;
+    int64_t mStartPts = AV_NOPTS_VALUE;
+    bool mRotateRequested = false;
+    SegmentIndexWriter mIndex;
+    int64_t mLastPtsUs = 0;
+    int64_t mCheckpointPtsUs = 0;
+    bool mSkipGop = false;      // storage backed up at the last keyframe, drop until the next one
+    uint64_t mSkippedGops = 0;
+    std::vector<uint8_t> mAvccBuffer;
+    AVPacket* mAvccPacket = nullptr;
+};
+
+#endif
@@ -0,0 +1,196 @@
+#include "thumbnailSheet.h"
+#include "retentionManager.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+
+ThumbnailSheet::ThumbnailSheet(int width, int height, int64_t intervalUs)
+    : mTileWidth(THUMBNAIL_WIDTH), mIntervalUs(intervalUs) {
+    // Keep the camera aspect ratio, even sizes so the chroma planes line up
+    mTileHeight = (int)((int64_t)THUMBNAIL_WIDTH * height / width) & ~1;
+
+    sheet_frame = av_frame_alloc();
+    sheet_frame->format = AV_PIX_FMT_YUVJ420P;
+    sheet_frame->width = mTileWidth * THUMBNAIL_COLUMNS;
+    sheet_frame->height = mTileHeight * THUMBNAIL_ROWS;
+    if (av_frame_get_buffer(sheet_frame, 32) < 0) {
+        LOG(ERROR) << "Failed to allocate thumbnail sheet";
+        av_frame_free(&sheet_frame);
+        return;
+    }
+    clear();
+}
+
+ThumbnailSheet::~ThumbnailSheet() {
+    flush();
+    av_frame_free(&sheet_frame);
+    if (sws_ctx) {
+        sws_freeContext(sws_ctx);
+        sws_ctx = nullptr;
+    }
+}
+
+void ThumbnailSheet::add(const AVFrame* frame, const std::string& segmentPath, int64_t ptsUs) {
+    if (!sheet_frame) {
+        return;
+    }
+    if (segmentPath != mSegmentPath) {
+        flush();
+        mSegmentPath = segmentPath;
+        mSheetNumber = 0;
+        mLastPtsUs = AV_NOPTS_VALUE;
+    }
+    if (mLastPtsUs != AV_NOPTS_VALUE && ptsUs - mLastPtsUs < mIntervalUs) {
+        return;
+    }
+
+    sws_ctx = sws_getCachedContext(sws_ctx,
+        frame->width, frame->height, (AVPixelFormat)frame->format,
+        mTileWidth, mTileHeight, AV_PIX_FMT_YUVJ420P,
+        SWS_FAST_BILINEAR, nullptr, nullptr, nullptr);
+    if (!sws_ctx || av_frame_make_writable(sheet_frame) < 0) {
+        return;
+    }
+
+    ThumbnailEntry entry = {};
+    entry.ptsUs = ptsUs;
+    entry.x = (uint16_t)((mEntries.size() % THUMBNAIL_COLUMNS) * mTileWidth);
+    entry.y = (uint16_t)((mEntries.size() / THUMBNAIL_COLUMNS) * mTileHeight);
+
+    // Scale straight into the tile's slot of the sheet planes, no intermediate frame
+    uint8_t* slot[4] = {
+        sheet_frame->data[0] + entry.y * sheet_frame->linesize[0] + entry.x,
+        sheet_frame->data[1] + (entry.y / 2) * sheet_frame->linesize[1] + entry.x / 2,
+        sheet_frame->data[2] + (entry.y / 2) * sheet_frame->linesize[2] + entry.x / 2,
+        nullptr,
+    };
+    sws_scale(sws_ctx, frame->data, frame->linesize, 0, frame->height, slot, sheet_frame->linesize);
+
+    mEntries.push_back(entry);
+    mLastPtsUs = ptsUs;
+
+    if (mEntries.size() == THUMBNAIL_COLUMNS * THUMBNAIL_ROWS) {
+        flush();
+    }
+}
+
+void ThumbnailSheet::clear() {
+    // Full range black, an unfilled slot never shows a tile of the previous sheet
+    if (av_frame_make_writable(sheet_frame) < 0) {
+        return;
+    }
+    for (int y = 0; y < sheet_frame->height; y++) {
+        memset(sheet_frame->data[0] + y * sheet_frame->linesize[0], 0, sheet_frame->width);
+    }
+    for (int y = 0; y < sheet_frame->height / 2; y++) {
+        memset(sheet_frame->data[1] + y * sheet_frame->linesize[1], 128, sheet_frame->width / 2);
+        memset(sheet_frame->data[2] + y * sheet_frame->linesize[2], 128, sheet_frame->width / 2);
+    }
+}
+
+bool ThumbnailSheet::encode(std::vector<uint8_t>& jpeg, int width, int height) {
+    const AVCodec* encoder = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+    if (!encoder) {
+        LOG(ERROR) << "MJPEG encoder not found";
+        return false;
+    }
+
+    AVCodecContext* encoder_ctx = avcodec_alloc_context3(encoder);
+    encoder_ctx->width = width;
+    encoder_ctx->height = height;
+    encoder_ctx->time_base = AVRational{1, 1};
+    encoder_ctx->pix_fmt = AV_PIX_FMT_YUVJ420P;
+    encoder_ctx->flags |= AV_CODEC_FLAG_QSCALE;
+    encoder_ctx->global_quality = FF_QP2LAMBDA * THUMBNAIL_QUALITY;
+    encoder_ctx->thread_count = 1;
+    if (avcodec_open2(encoder_ctx, encoder, nullptr) < 0) {
+        LOG(ERROR) << "Failed to open MJPEG encoder for thumbnails";
+        avcodec_free_context(&encoder_ctx);
+        return false;
+    }
+
+    // Only the filled rows and columns, the sheet buffer keeps its full size
+    int fullWidth = sheet_frame->width;
+    int fullHeight = sheet_frame->height;
+    sheet_frame->width = width;
+    sheet_frame->height = height;
+    sheet_frame->pts = 0;
+
+    AVPacket* packet = av_packet_alloc();
+    bool ok = avcodec_send_frame(encoder_ctx, sheet_frame) >= 0 && avcodec_receive_packet(encoder_ctx, packet) >= 0;
+    if (ok) {
+        jpeg.assign(packet->data, packet->data + packet->size);
+    }
+
+    sheet_frame->width = fullWidth;
+    sheet_frame->height = fullHeight;
+    av_packet_free(&packet);
+    avcodec_free_context(&encoder_ctx);
+    return ok;
+}
+
+void ThumbnailSheet::discard() {
+    if (!mEntries.empty()) {
+        mEntries.clear();
+        clear();
+    }
+}
+
+void ThumbnailSheet::flush() {
+    if (mEntries.empty()) {
+        return;
+    }
+
+    size_t count = mEntries.size();
+    int columns = count < THUMBNAIL_COLUMNS ? (int)count : THUMBNAIL_COLUMNS;
+    int rows = (int)((count + THUMBNAIL_COLUMNS - 1) / THUMBNAIL_COLUMNS);
+
+    std::vector<uint8_t> jpeg;
+    if (!encode(jpeg, columns * mTileWidth, rows * mTileHeight)) {
+        LOG(ERROR) << "Failed to encode thumbnail sheet for " << mSegmentPath;
+        mEntries.clear();
+        clear();
+        return;
+    }
+
+    size_t jpegOffset = sizeof(ThumbnailHeader) + count * sizeof(ThumbnailEntry);
+    std::vector<uint8_t> data(jpegOffset + jpeg.size());
+    ThumbnailHeader* header = (ThumbnailHeader*)data.data();
+    header->magic = THUMBNAIL_MAGIC;
+    header->version = THUMBNAIL_VERSION;
+    header->entrySize = sizeof(ThumbnailEntry);
+    header->count = count;
+    header->tileWidth = mTileWidth;
+    header->tileHeight = mTileHeight;
+    header->columns = columns;
+    header->rows = rows;
+    header->jpegOffset = jpegOffset;
+    header->jpegSize = jpeg.size();
+    memcpy(header + 1, mEntries.data(), count * sizeof(ThumbnailEntry));
+    memcpy(data.data() + jpegOffset, jpeg.data(), jpeg.size());
+
+    // Same stem as the segment, so retention removes the sheets together with it
+    std::string path = mSegmentPath;
+    if (mSheetNumber > 0) {
+        path += "." + std::to_string(mSheetNumber);
+    }
+    path += THUMBNAIL_EXT;
+    mSheetNumber++;
+    mEntries.clear();
+    clear();
+
+    RetentionManager::instance().post([path, data]() {
+        std::string temp = path + ".tmp";
+        int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            LOG(ERROR) << "Failed to open thumbnail sheet " << temp;
+            return;
+        }
+        bool ok = ::write(fd, data.data(), data.size()) == (ssize_t)data.size() && fdatasync(fd) == 0;
+        ::close(fd);
+        if (!ok || rename(temp.c_str(), path.c_str()) < 0) {
+            LOG(ERROR) << "Failed to write thumbnail sheet " << path;
+            unlink(temp.c_str());
+        }
+    });
+}
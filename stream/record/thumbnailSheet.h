@@ -0,0 +1,75 @@
+#ifndef THUMBNAIL_SHEET
+#define THUMBNAIL_SHEET
+
+#include "baseStream.h"
+
+#define THUMBNAIL_INTERVAL_US   (10LL * 1000000)   // one preview every 10 s of footage
+#define THUMBNAIL_WIDTH         160
+#define THUMBNAIL_COLUMNS       10
+#define THUMBNAIL_ROWS          10                 // 100 tiles, a full sheet covers ~16 min
+#define THUMBNAIL_QUALITY       6                  // MJPEG qscale, 2 (best) .. 31
+#define THUMBNAIL_EXT           ".thumbs"          // <segment>.thumbs, then <segment>.1.thumbs, ...
+#define THUMBNAIL_MAGIC         0x314D4854         // "THM1"
+#define THUMBNAIL_VERSION       1
+
+// File layout: header, count entries, then one baseline JPEG holding the tiles row by row
+struct ThumbnailHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t entrySize;
+    uint32_t count;
+    uint16_t tileWidth;
+    uint16_t tileHeight;
+    uint16_t columns;
+    uint16_t rows;
+    uint32_t jpegOffset;
+    uint32_t jpegSize;
+    uint32_t reserved;
+};
+
+struct ThumbnailEntry {
+    int64_t ptsUs;      // from the segment start, as used by the index and playback
+    uint16_t x;         // top left of the tile in the sheet
+    uint16_t y;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(ThumbnailHeader) == 32, "thumbnail header layout");
+static_assert(sizeof(ThumbnailEntry) == 16, "thumbnail entry layout");
+
+// Collects downscaled copies of frames the record path has already decoded, so a
+// scrub bar costs one small file per segment instead of seeking and decoding video.
+// Not thread safe, lives on the record strand.
+class ThumbnailSheet {
+public:
+    ThumbnailSheet(int width, int height, int64_t intervalUs);
+    ~ThumbnailSheet();
+
+    // Takes the first frame of each segment, then one per interval
+    void add(const AVFrame* frame, const std::string& segmentPath, int64_t ptsUs);
+    // Encodes the tiles collected so far and writes the sheet on the storage thread
+    void flush();
+    // Drops the tiles collected so far, e.g. when the segment they belong to was abandoned
+    void discard();
+
+    ThumbnailSheet(const ThumbnailSheet&) = delete;
+    ThumbnailSheet& operator=(const ThumbnailSheet&) = delete;
+
+private:
+    void clear();
+    bool encode(std::vector<uint8_t>& jpeg, int width, int height);
+
+    int mTileWidth;
+    int mTileHeight;
+    int64_t mIntervalUs;
+
+    std::string mSegmentPath;
+    int mSheetNumber = 0;
+    int64_t mLastPtsUs = AV_NOPTS_VALUE;
+    std::vector<ThumbnailEntry> mEntries;
+
+    AVFrame* sheet_frame = nullptr;
+    struct SwsContext* sws_ctx = nullptr;
+};
+
+#endif
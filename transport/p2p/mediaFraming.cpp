@@ -0,0 +1,319 @@
+#include "mediaFraming.h"
+#include <algorithm>
+#include <chrono>
+
+static void writeBe16(uint8_t* p, uint16_t value) {
+    p[0] = value >> 8;
+    p[1] = value;
+}
+
+static void writeBe32(uint8_t* p, uint32_t value) {
+    writeBe16(p, value >> 16);
+    writeBe16(p + 2, value);
+}
+
+static void writeBe64(uint8_t* p, uint64_t value) {
+    writeBe32(p, value >> 32);
+    writeBe32(p + 4, value);
+}
+
+static uint16_t readBe16(const uint8_t* p) {
+    return ((uint16_t)p[0] << 8) | p[1];
+}
+
+static uint32_t readBe32(const uint8_t* p) {
+    return ((uint32_t)readBe16(p) << 16) | readBe16(p + 2);
+}
+
+static uint64_t readBe64(const uint8_t* p) {
+    return ((uint64_t)readBe32(p) << 32) | readBe32(p + 4);
+}
+
+void writeMediaHeader(const MediaHeader& header, uint8_t* out) {
+    out[0] = header.version;
+    out[1] = header.flags;
+    writeBe16(out + 2, header.streamId);
+    writeBe32(out + 4, header.sequence);
+    writeBe16(out + 8, header.fragmentIndex);
+    writeBe16(out + 10, header.fragmentCount);
+    writeBe64(out + 12, header.ptsUs);
+    writeBe64(out + 20, header.sendTimeUs);
+}
+
+bool readMediaHeader(const uint8_t* data, size_t size, MediaHeader& header) {
+    if (size < MEDIA_HEADER_SIZE || data[0] != MEDIA_FRAMING_VERSION) {
+        return false;
+    }
+    header.version = data[0];
+    header.flags = data[1];
+    header.streamId = readBe16(data + 2);
+    header.sequence = readBe32(data + 4);
+    header.fragmentIndex = readBe16(data + 8);
+    header.fragmentCount = readBe16(data + 10);
+    header.ptsUs = readBe64(data + 12);
+    header.sendTimeUs = readBe64(data + 20);
+    return header.fragmentCount > 0 && header.fragmentIndex < header.fragmentCount;
+}
+
+int64_t mediaWallClockUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+bool MediaFragmenter::send(uint16_t streamId, const uint8_t* data, size_t size, int64_t ptsUs, uint8_t flags,
+                           size_t maxMessageSize, const SendCallback& sendMessage, uint16_t parityGroup) {
+    // Parity messages carry a prefix on top of a full fragment, data fragments shrink to match
+    size_t overhead = MEDIA_HEADER_SIZE + (parityGroup > 0 ? MEDIA_PARITY_PREFIX : 0);
+    if (maxMessageSize <= overhead) {
+        return false;
+    }
+    size_t chunk = maxMessageSize - overhead;
+    size_t count = std::max<size_t>(1, (size + chunk - 1) / chunk);
+    if (count > MEDIA_MAX_FRAGMENTS) {
+        return false;
+    }
+
+    MediaHeader header = {};
+    header.version = MEDIA_FRAMING_VERSION;
+    header.flags = flags;
+    header.streamId = streamId;
+    header.sequence = mSequence[streamId]++;
+    header.fragmentCount = count;
+    header.ptsUs = ptsUs;
+    header.sendTimeUs = mediaWallClockUs();
+
+    uint8_t headerBytes[MEDIA_HEADER_SIZE];
+    for (size_t i = 0; i < count; i++) {
+        size_t offset = i * chunk;
+        size_t length = std::min(chunk, size - offset);
+        header.fragmentIndex = i;
+
+        writeMediaHeader(header, headerBytes);
+        if (!sendMessage(headerBytes, data + offset, length)) {
+            return false;
+        }
+
+        if (parityGroup == 0) {
+            continue;
+        }
+        // Only the last fragment is short, so the first of a group sets the parity length
+        if (i % parityGroup == 0) {
+            mParity.assign(MEDIA_PARITY_PREFIX + length, 0);
+        }
+        uint8_t* parity = mParity.data() + MEDIA_PARITY_PREFIX;
+        for (size_t j = 0; j < length; j++) {
+            parity[j] ^= data[offset + j];
+        }
+        if (i % parityGroup == parityGroup - 1u || i == count - 1) {
+            MediaHeader parityHeader = header;
+            parityHeader.flags |= MEDIA_FLAG_PARITY;
+            parityHeader.fragmentIndex = i / parityGroup;
+            writeMediaHeader(parityHeader, headerBytes);
+            writeBe32(mParity.data(), size);
+            writeBe16(mParity.data() + 4, parityGroup);
+            if (!sendMessage(headerBytes, mParity.data(), mParity.size())) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool MediaReassembler::push(const uint8_t* data, size_t size) {
+    MediaHeader header;
+    if (!readMediaHeader(data, size, header)) {
+        return false;
+    }
+    if (header.flags & MEDIA_FLAG_BATCH) {
+        return pushBatch(data + MEDIA_HEADER_SIZE, size - MEDIA_HEADER_SIZE);
+    }
+    bool parity = header.flags & MEDIA_FLAG_PARITY;
+    if (parity && size < MEDIA_HEADER_SIZE + MEDIA_PARITY_PREFIX) {
+        return false;
+    }
+    header.flags &= ~MEDIA_FLAG_PARITY;
+
+    Stream& stream = mStreams[header.streamId];
+    if (!stream.started) {
+        stream.started = true;
+        stream.lastSequence = header.sequence - 1;
+    }
+    if ((int32_t)(header.sequence - stream.lastSequence) <= 0) {
+        return true;  // late fragment of a frame already delivered or abandoned
+    }
+
+    auto it = stream.pending.find(header.sequence);
+    if (it == stream.pending.end()) {
+        if (stream.pending.size() >= MEDIA_MAX_PENDING) {
+            uint32_t oldest = header.sequence;
+            for (const auto& entry : stream.pending) {
+                if ((int32_t)(entry.first - oldest) < 0) {
+                    oldest = entry.first;
+                }
+            }
+            if (oldest == header.sequence) {
+                return true;  // older than every frame in the window
+            }
+            abandon(stream, oldest);
+        }
+        it = stream.pending.emplace(header.sequence, Partial()).first;
+        Partial& partial = it->second;
+        partial.header = header;
+        partial.have.assign(header.fragmentCount, false);
+        partial.fragments.resize(header.fragmentCount);
+        partial.parity.resize(header.fragmentCount);
+    }
+    Partial& partial = it->second;
+
+    if (header.fragmentCount != partial.header.fragmentCount) {
+        return true;
+    }
+    if (parity) {
+        addParity(partial, header, data + MEDIA_HEADER_SIZE, size - MEDIA_HEADER_SIZE);
+    } else if (!partial.have[header.fragmentIndex]) {
+        partial.have[header.fragmentIndex] = true;
+        partial.fragments[header.fragmentIndex].assign(data + MEDIA_HEADER_SIZE, data + size);
+        partial.received++;
+        if (partial.groupSize > 0) {
+            recover(partial, header.fragmentIndex / partial.groupSize);
+        }
+    }
+
+    if (partial.received == partial.header.fragmentCount) {
+        complete(stream, partial);
+    }
+    return true;
+}
+
+bool MediaReassembler::pushBatch(const uint8_t* data, size_t size) {
+    size_t offset = 0;
+    while (offset + MEDIA_BATCH_LENGTH_SIZE <= size) {
+        size_t length = readBe32(data + offset);
+        offset += MEDIA_BATCH_LENGTH_SIZE;
+        if (length > size - offset) {
+            return false;
+        }
+        // Batches do not nest
+        MediaHeader header;
+        if (!readMediaHeader(data + offset, length, header) || (header.flags & MEDIA_FLAG_BATCH) ||
+            !push(data + offset, length)) {
+            return false;
+        }
+        offset += length;
+    }
+    return offset == size;
+}
+
+void MediaReassembler::addParity(Partial& partial, const MediaHeader& header, const uint8_t* payload, size_t size) {
+    uint16_t group = header.fragmentIndex;
+    uint32_t frameSize = readBe32(payload);
+    uint16_t groupSize = readBe16(payload + 4);
+    if (groupSize == 0 || (size_t)group * groupSize >= partial.header.fragmentCount || !partial.parity[group].empty()) {
+        return;
+    }
+    partial.frameSize = frameSize;
+    partial.groupSize = groupSize;
+    partial.parity[group].assign(payload + MEDIA_PARITY_PREFIX, payload + size);
+    recover(partial, group);
+}
+
+void MediaReassembler::recover(Partial& partial, uint16_t group) {
+    const std::vector<uint8_t>& parity = partial.parity[group];
+    if (parity.empty()) {
+        return;
+    }
+    size_t count = partial.header.fragmentCount;
+    size_t begin = (size_t)group * partial.groupSize;
+    size_t end = std::min(begin + partial.groupSize, count);
+    size_t missing = count;
+    for (size_t i = begin; i < end; i++) {
+        if (!partial.have[i]) {
+            if (missing != count) {
+                return;  // XOR parity only covers one loss per group
+            }
+            missing = i;
+        }
+    }
+    if (missing == count) {
+        return;
+    }
+
+    std::vector<uint8_t> fragment(parity);
+    for (size_t i = begin; i < end; i++) {
+        if (i == missing) {
+            continue;
+        }
+        const std::vector<uint8_t>& other = partial.fragments[i];
+        for (size_t j = 0; j < other.size() && j < fragment.size(); j++) {
+            fragment[j] ^= other[j];
+        }
+    }
+
+    // Full fragments are as long as the parity, the short last one follows from the frame size
+    size_t length = parity.size();
+    if (missing == count - 1 && end - begin > 1) {
+        size_t full = (count - 1) * parity.size();
+        if (partial.frameSize < full || partial.frameSize - full > parity.size()) {
+            return;
+        }
+        length = partial.frameSize - full;
+    }
+    fragment.resize(length);
+
+    partial.fragments[missing] = std::move(fragment);
+    partial.have[missing] = true;
+    partial.received++;
+    mRecoveredFragments++;
+}
+
+void MediaReassembler::abandon(Stream& stream, uint32_t sequence) {
+    uint32_t skipped = sequence - stream.lastSequence;
+    uint32_t incomplete = 0;
+    for (auto it = stream.pending.begin(); it != stream.pending.end();) {
+        if ((int32_t)(it->first - sequence) <= 0) {
+            it = stream.pending.erase(it);
+            incomplete++;
+        } else {
+            ++it;
+        }
+    }
+    stream.lost += skipped;
+    stream.lastSequence = sequence;
+    mIncompleteFrames += incomplete;
+    mLostFrames += skipped - incomplete;
+}
+
+void MediaReassembler::complete(Stream& stream, Partial& partial) {
+    uint32_t sequence = partial.header.sequence;
+    mFrames++;
+
+    MediaFrame frame;
+    frame.streamId = partial.header.streamId;
+    frame.sequence = sequence;
+    frame.flags = partial.header.flags;
+    frame.ptsUs = partial.header.ptsUs;
+    frame.sendTimeUs = partial.header.sendTimeUs;
+
+    size_t total = 0;
+    for (const auto& fragment : partial.fragments) {
+        total += fragment.size();
+    }
+    bool oversized = total > MEDIA_MAX_FRAME_SIZE;
+    if (!oversized) {
+        frame.data.reserve(total);
+        for (const auto& fragment : partial.fragments) {
+            frame.data.insert(frame.data.end(), fragment.begin(), fragment.end());
+        }
+    }
+
+    // Older frames still incomplete would arrive out of order now, give up on them
+    stream.pending.erase(sequence);
+    abandon(stream, sequence - 1);
+    frame.lost = stream.lost;
+    stream.lost = 0;
+    stream.lastSequence = sequence;
+
+    if (!oversized && mCallback) {
+        mCallback(frame);
+    }
+}
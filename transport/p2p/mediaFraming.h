@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+
+#define MEDIA_FRAMING_VERSION   1
+#define MEDIA_HEADER_SIZE       28
+#define MEDIA_MAX_FRAGMENTS     0xFFFF
+#define MEDIA_MAX_FRAME_SIZE    (16 * 1024 * 1024)  // reassembly refuses anything larger
+
+#define MEDIA_STREAM_LIVE       0
+#define MEDIA_STREAM_MOSAIC     1
+
+#define MEDIA_NO_PTS            INT64_MIN   // parameter sets, same value as AV_NOPTS_VALUE
+
+#define MEDIA_FLAG_PARITY       0x80        // header flag bit, the message is FEC parity
+#define MEDIA_PARITY_PREFIX     6           // u32 frame size, u16 group size ahead of the parity bytes
+#define MEDIA_FEC_GROUP         4           // data fragments per parity fragment, 25% overhead
+#define MEDIA_MAX_PENDING       4           // frames reassembled at once on unordered channels
+
+#define MEDIA_FLAG_BATCH        0x40        // header flag bit, the message packs several messages
+#define MEDIA_BATCH_LENGTH_SIZE 4           // u32 length ahead of each packed message
+#define MEDIA_COALESCE_DEADLINE_US  2000    // longest a small frame waits for company
+#define MEDIA_COALESCE_MAX_FRAME    1024    // larger frames are sent on their own
+#define MEDIA_COALESCE_MAX_BYTES    8192    // per batch, one lost batch should not cost many frames
+
+// Every DataChannel message carries one fragment of one encoded frame behind this
+// header, big endian on the wire:
+//   u8 version, u8 flags, u16 stream id, u32 sequence, u16 fragment index,
+//   u16 fragment count, i64 pts (us), i64 send time (us, sender wall clock)
+// All fragments of a frame share the sequence, which grows by one per frame and stream.
+// With FEC every group of up to N data fragments is followed by one parity message:
+// MEDIA_FLAG_PARITY set, fragment index = group index, and a payload of the frame size,
+// N, and the XOR of the group's fragments zero padded to the longest one. Any single
+// fragment lost from a group is rebuilt from the rest without waiting for a retransmit.
+// A batch carries small frames in one message: a header with MEDIA_FLAG_BATCH and no
+// pts, then per frame a u32 length and the frame's own single fragment message.
+struct MediaHeader {
+    uint8_t version;
+    uint8_t flags;
+    uint16_t streamId;
+    uint32_t sequence;
+    uint16_t fragmentIndex;
+    uint16_t fragmentCount;
+    int64_t ptsUs;
+    int64_t sendTimeUs;
+};
+
+void writeMediaHeader(const MediaHeader& header, uint8_t* out);
+bool readMediaHeader(const uint8_t* data, size_t size, MediaHeader& header);
+int64_t mediaWallClockUs();
+
+struct MediaFrame {
+    uint16_t streamId;
+    uint32_t sequence;
+    uint8_t flags;          // FRAME_FLAG_* of the send queue
+    int64_t ptsUs;
+    int64_t sendTimeUs;
+    uint32_t lost;          // frames of this stream missing or incomplete right before this one
+    std::vector<uint8_t> data;
+};
+
+// Splits frames into messages of at most maxMessageSize bytes, header included. The
+// payload is not copied here: each message is handed out as its MEDIA_HEADER_SIZE header
+// plus a pointer into the frame, for the transport to join in its own message buffer.
+class MediaFragmenter {
+public:
+    typedef std::function<bool(const uint8_t* header, const uint8_t* payload, size_t size)> SendCallback;
+
+    // sendMessage returns false only if the message was lost, e.g. on a closed channel; a
+    // message the transport merely buffered counts as sent. False as soon as one is lost,
+    // the rest of the frame is skipped.
+    // parityGroup > 0 adds a parity message after every parityGroup data fragments,
+    // meant for channels without retransmission.
+    bool send(uint16_t streamId, const uint8_t* data, size_t size, int64_t ptsUs, uint8_t flags,
+              size_t maxMessageSize, const SendCallback& sendMessage, uint16_t parityGroup = 0);
+
+private:
+    std::map<uint16_t, uint32_t> mSequence;
+    std::vector<uint8_t> mParity;   // prefix and XOR of the current group
+};
+
+// Receiver side: collects fragments per stream and hands out whole frames in sequence
+// order. Up to MEDIA_MAX_PENDING frames are collected at once, so an unordered channel
+// can interleave them; delivering a frame abandons the older ones still incomplete, and
+// sequence gaps are counted as lost. Parity messages rebuild single lost fragments.
+class MediaReassembler {
+public:
+    typedef std::function<void(const MediaFrame& frame)> FrameCallback;
+
+    void onFrame(FrameCallback callback) {
+        mCallback = callback;
+    }
+    // False if the message is not a valid media fragment
+    bool push(const uint8_t* data, size_t size);
+
+    uint64_t getFrames() const { return mFrames; }
+    uint64_t getLostFrames() const { return mLostFrames; }
+    uint64_t getIncompleteFrames() const { return mIncompleteFrames; }
+    uint64_t getRecoveredFragments() const { return mRecoveredFragments; }
+
+private:
+    struct Partial {
+        MediaHeader header;
+        uint16_t received = 0;
+        std::vector<bool> have;
+        std::vector<std::vector<uint8_t>> fragments;
+        std::vector<std::vector<uint8_t>> parity;   // by group, without the prefix
+        uint32_t frameSize = 0;
+        uint16_t groupSize = 0;                     // 0 until a parity message arrived
+    };
+
+    struct Stream {
+        bool started = false;   // a frame of this stream was seen, the sequence is meaningful
+        uint32_t lastSequence = 0;                  // delivered or given up
+        uint32_t lost = 0;                          // since the last delivered frame
+        std::map<uint32_t, Partial> pending;
+    };
+
+    bool pushBatch(const uint8_t* data, size_t size);
+    void addParity(Partial& partial, const MediaHeader& header, const uint8_t* payload, size_t size);
+    void recover(Partial& partial, uint16_t group);
+    // Gives up on pending frames up to sequence, counts them as incomplete
+    void abandon(Stream& stream, uint32_t sequence);
+    void complete(Stream& stream, Partial& partial);
+
+    FrameCallback mCallback;
+    std::map<uint16_t, Stream> mStreams;
+    uint64_t mFrames = 0;
+    uint64_t mLostFrames = 0;
+    uint64_t mIncompleteFrames = 0;
+    uint64_t mRecoveredFragments = 0;
+};
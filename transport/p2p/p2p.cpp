@@ -1,5 +1,7 @@
 
 #include <p2p.h>
+#include <algorithm>
+#include <chrono>
 
 
 std::string GatheringStateToString(rtc::PeerConnection::GatheringState state) {
@@ -84,10 +86,23 @@ void P2P::CreatePeerConnection() {
         LOG(INFO) << "[Gathering State: " << static_cast<int>(state) << "]";
     });
 }
-void P2P::CreateDataChannel(const std::string& label) {
+void P2P::ClosePeerConnection() {
     if (pc != nullptr) {
-        LOG(INFO) << "Creating data channel: " << label;
-        auto dc = pc->createDataChannel(label);
+        pc->close();
+    }
+}
+
+void P2P::CreateDataChannel(const std::string& label, bool unreliable) {
+    if (pc != nullptr) {
+        LOG(INFO) << "Creating data channel: " << label << (unreliable ? " (unordered, no retransmits)" : "");
+        rtc::DataChannelInit init;
+        if (unreliable) {
+            init.reliability.unordered = true;
+            init.reliability.maxRetransmits = 0;
+            std::lock_guard<std::mutex> lock(mMediaMutex);
+            mFecChannels.insert(label);
+        }
+        auto dc = pc->createDataChannel(label, init);
         LOG(INFO) << "Data channel created: " << dc->label();
 
         dc->onOpen([dc]() { 
@@ -155,12 +170,13 @@ bool P2P::streamBuffereToChannel(const std::string& label, const uint8_t* data,
         if (dc->label().compare(label) == 0) {
             if (dc->isOpen()) {
                 const rtc::byte* byteData = reinterpret_cast<const rtc::byte*>(data);
-                
-                if (dc->send(byteData, size)) {
-                    LOG(INFO) << "[Message sent to " << label << ": " << size << " byte" << "]";  
+
+                // false from send() only means buffered, pace on getBufferedAmount instead
+                try {
+                    dc->send(byteData, size);
                     return true;
-                } else {
-                    LOG(ERROR) << "Failed to send data to DataChannel " << label;
+                } catch (const std::exception& e) {
+                    LOG(ERROR) << "Failed to send data to DataChannel " << label << ": " << e.what();
                 }
             } else {
                 LOG(ERROR) << "DataChannel " << label << " is not open";
@@ -173,6 +189,218 @@ bool P2P::streamBuffereToChannel(const std::string& label, const uint8_t* data,
 }
 
 
+std::shared_ptr<MediaChannel> P2P::openMediaChannel(const std::string& label, uint16_t streamId) {
+    for (const auto& dc : dataChannels) {
+        if (dc->label().compare(label) == 0) {
+            std::lock_guard<std::mutex> lock(mMediaMutex);
+            uint16_t parityGroup = mFecChannels.count(label) > 0 ? MEDIA_FEC_GROUP : 0;
+            return std::make_shared<MediaChannel>(dc, streamId, parityGroup);
+        }
+    }
+    LOG(ERROR) << "DataChannel " << label << " not found";
+    return nullptr;
+}
+
+bool MediaChannel::send(const uint8_t* data, size_t size, int64_t ptsUs, uint8_t flags) {
+    if (!mChannel->isOpen()) {
+        return false;
+    }
+    if (mMaxMessageSize == 0) {
+        mMaxMessageSize = mChannel->maxMessageSize();
+    }
+
+    size_t limit = std::min<size_t>(mMaxMessageSize, MEDIA_COALESCE_MAX_BYTES);
+    size_t entry = MEDIA_BATCH_LENGTH_SIZE + MEDIA_HEADER_SIZE + size;
+    if (mCoalesceUs > 0 && size <= MEDIA_COALESCE_MAX_FRAME && MEDIA_HEADER_SIZE + entry <= limit) {
+        if (mBatchFrames > 0 && mBatch.size() + entry > limit && !flush()) {
+            return false;
+        }
+        if (mBatchFrames == 0) {
+            mBatch.reserve(limit);
+            mBatch.resize(MEDIA_HEADER_SIZE);   // written by flush
+            mBatchStartUs = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+        mBatchFrames++;
+        return mFragmenter.send(mStreamId, data, size, ptsUs, flags, mMaxMessageSize,
+            [this](const uint8_t* header, const uint8_t* payload, size_t length) {
+                uint32_t framed = MEDIA_HEADER_SIZE + length;
+                uint8_t prefix[MEDIA_BATCH_LENGTH_SIZE] = {(uint8_t)(framed >> 24), (uint8_t)(framed >> 16),
+                                                           (uint8_t)(framed >> 8), (uint8_t)framed};
+                mBatch.insert(mBatch.end(), reinterpret_cast<const rtc::byte*>(prefix),
+                              reinterpret_cast<const rtc::byte*>(prefix) + MEDIA_BATCH_LENGTH_SIZE);
+                mBatch.insert(mBatch.end(), reinterpret_cast<const rtc::byte*>(header),
+                              reinterpret_cast<const rtc::byte*>(header) + MEDIA_HEADER_SIZE);
+                mBatch.insert(mBatch.end(), reinterpret_cast<const rtc::byte*>(payload),
+                              reinterpret_cast<const rtc::byte*>(payload) + length);
+                return true;
+            });
+    }
+
+    // Frames leave in order, whatever is batched goes first
+    if (!flush()) {
+        return false;
+    }
+    return mFragmenter.send(mStreamId, data, size, ptsUs, flags, mMaxMessageSize,
+        [this](const uint8_t* header, const uint8_t* payload, size_t length) {
+            rtc::binary message;
+            message.reserve(MEDIA_HEADER_SIZE + length);
+            message.insert(message.end(), reinterpret_cast<const rtc::byte*>(header),
+                           reinterpret_cast<const rtc::byte*>(header) + MEDIA_HEADER_SIZE);
+            message.insert(message.end(), reinterpret_cast<const rtc::byte*>(payload),
+                           reinterpret_cast<const rtc::byte*>(payload) + length);
+            // Moved, libdatachannel queues this buffer as is
+            return post(std::move(message));
+        }, mParityGroup);
+}
+
+bool MediaChannel::post(rtc::binary&& message) {
+    // send() returning false only means the message was buffered behind earlier ones, it
+    // still goes out and bufferedAmount paces the sender. A closed channel throws.
+    try {
+        mChannel->send(std::move(message));
+    } catch (const std::exception&) {
+        return false;
+    }
+    return true;
+}
+
+bool MediaChannel::flush() {
+    if (mBatchFrames == 0) {
+        return true;
+    }
+    bool sent;
+    if (mBatchFrames == 1) {
+        // Nothing joined it, a plain message saves the batch header
+        size_t skip = MEDIA_HEADER_SIZE + MEDIA_BATCH_LENGTH_SIZE;
+        sent = post(rtc::binary(mBatch.begin() + skip, mBatch.end()));
+    } else {
+        MediaHeader header = {};
+        header.version = MEDIA_FRAMING_VERSION;
+        header.flags = MEDIA_FLAG_BATCH;
+        header.streamId = mStreamId;
+        header.fragmentCount = 1;
+        header.ptsUs = MEDIA_NO_PTS;
+        header.sendTimeUs = mediaWallClockUs();
+        writeMediaHeader(header, reinterpret_cast<uint8_t*>(mBatch.data()));
+        sent = post(std::move(mBatch));
+    }
+    mBatch.clear();
+    mBatchFrames = 0;
+    return sent;
+}
+
+void MediaChannel::onBufferedAmountLow(size_t threshold, std::function<void()> callback) {
+    mChannel->setBufferedAmountLowThreshold(threshold);
+    mChannel->onBufferedAmountLow(callback);
+}
+
+void P2P::onMediaFrame(MediaFrameCallback callback) {
+    std::lock_guard<std::mutex> lock(mMediaMutex);
+    mMediaCallback = callback;
+}
+
+size_t P2P::getMaxMessageSize(const std::string& label) {
+    for (const auto& dc : dataChannels) {
+        if (dc->label().compare(label) == 0) {
+            return dc->maxMessageSize();
+        }
+    }
+    return 0;
+}
+
+size_t P2P::getBufferedAmount(const std::string& label) {
+    for (const auto& dc : dataChannels) {
+        if (dc->label().compare(label) == 0) {
+            return dc->bufferedAmount();
+        }
+    }
+    return 0;
+}
+
+
+void P2P::AddVideoTrack() {
+    if (pc == nullptr) {
+        LOG(ERROR) << "PeerConnection is null!";
+        return;
+    }
+
+    rtc::Description::Video media(VIDEO_TRACK_MID, rtc::Description::Direction::SendOnly);
+    media.addH264Codec(VIDEO_TRACK_PAYLOAD_TYPE);
+    media.addSSRC(VIDEO_TRACK_SSRC, VIDEO_TRACK_CNAME);
+    auto track = pc->addTrack(media);
+
+    auto config = std::make_shared<rtc::RtpPacketizationConfig>(VIDEO_TRACK_SSRC, VIDEO_TRACK_CNAME,
+        VIDEO_TRACK_PAYLOAD_TYPE, rtc::RtpPacketizationConfig::VideoClockRate);
+    // The encoder writes start codes, the packetizer splits on them into FU-A/single NAL packets
+    auto packetizer = std::make_shared<rtc::H264RtpPacketizer>(rtc::NalUnit::Separator::StartSequence, config);
+    packetizer->addToChain(std::make_shared<rtc::RtcpSrReporter>(config));
+    packetizer->addToChain(std::make_shared<rtc::RtcpNackResponder>(VIDEO_TRACK_NACK_PACKETS));
+    packetizer->addToChain(std::make_shared<rtc::PliHandler>([this]() {
+        std::lock_guard<std::mutex> lock(mTrackMutex);
+        if (mKeyframeCallback) {
+            mKeyframeCallback();
+        }
+    }));
+    track->setMediaHandler(packetizer);
+
+    track->onOpen([]() {
+        LOG(INFO) << "[Video track open: " << VIDEO_TRACK_MID << "]";
+    });
+    track->onClosed([]() {
+        LOG(INFO) << "[Video track closed: " << VIDEO_TRACK_MID << "]";
+    });
+
+    std::lock_guard<std::mutex> lock(mTrackMutex);
+    mVideoTrack = track;
+    mRtpConfig = config;
+    LOG(INFO) << "Video track added: " << VIDEO_TRACK_MID << " ssrc " << VIDEO_TRACK_SSRC;
+}
+
+bool P2P::isVideoTrackOpen() {
+    std::lock_guard<std::mutex> lock(mTrackMutex);
+    return mVideoTrack && mVideoTrack->isOpen();
+}
+
+bool P2P::sendVideoFrame(const uint8_t* data, size_t size, int64_t ptsUs) {
+    std::lock_guard<std::mutex> lock(mTrackMutex);
+    if (!mVideoTrack || !mVideoTrack->isOpen()) {
+        return false;
+    }
+    // Every packet of the access unit carries its RTP timestamp, the sender report maps it to NTP
+    mRtpConfig->timestamp = mRtpConfig->startTimestamp + mRtpConfig->secondsToTimestamp(ptsUs / 1000000.0);
+    return mVideoTrack->send(reinterpret_cast<const rtc::byte*>(data), size);
+}
+
+void P2P::onKeyframeRequest(std::function<void()> callback) {
+    std::lock_guard<std::mutex> lock(mTrackMutex);
+    mKeyframeCallback = callback;
+}
+
+void P2P::HandleIncomingTrack(VideoFrameCallback callback) {
+    pc->onTrack([this, callback](std::shared_ptr<rtc::Track> track) {
+        LOG(INFO) << "[Got a track with mid: " << track->mid() << "]";
+
+        auto depacketizer = std::make_shared<rtc::H264RtpDepacketizer>();
+        depacketizer->addToChain(std::make_shared<rtc::RtcpReceivingSession>());
+        track->setMediaHandler(depacketizer);
+
+        // Start on an IDR instead of waiting out the sender's GOP
+        track->onOpen([weak = std::weak_ptr<rtc::Track>(track)]() {
+            if (auto opened = weak.lock()) {
+                opened->requestKeyframe();
+            }
+        });
+        track->onFrame([callback](rtc::binary data, rtc::FrameInfo info) {
+            callback(reinterpret_cast<const uint8_t*>(data.data()), data.size(), info.timestamp);
+        });
+
+        std::lock_guard<std::mutex> lock(mTrackMutex);
+        mRemoteTracks.push_back(track);
+    });
+}
+
+
 void P2P::HandleIncomingDataChannel() {
     pc->onDataChannel([this](std::shared_ptr<rtc::DataChannel> rv) {
         LOG(INFO) << "[Got a DataChannel with label: " << rv->label() << "]";
@@ -182,9 +410,11 @@ void P2P::HandleIncomingDataChannel() {
         rv->onClosed([this, label = rv->label()]() {
             LOG(INFO) << "[DataChannel closed: " << label << "]";
             reviceChannels.erase(label);
+            std::lock_guard<std::mutex> lock(mMediaMutex);
+            mReassemblers.erase(label);
         });
 
-        rv->onMessage([this](auto data) {
+        rv->onMessage([this, label = rv->label()](auto data) {
             if (std::holds_alternative<std::string>(data)) {
                 LOG(INFO) << "[Received string data: " << std::get<std::string>(data) << "]" << std::endl;
             }
@@ -193,7 +423,19 @@ void P2P::HandleIncomingDataChannel() {
                 const uint8_t* dataPtr = reinterpret_cast<const uint8_t*>(binaryData.data());
                 size_t dataSize = binaryData.size();
 
-                LOG(INFO) << "[Received binary data, size: " << dataSize << "]";
+                std::lock_guard<std::mutex> lock(mMediaMutex);
+                if (!mMediaCallback) {
+                    LOG(INFO) << "[Received binary data, size: " << dataSize << "]";
+                    return;
+                }
+                auto it = mReassemblers.find(label);
+                if (it == mReassemblers.end()) {
+                    it = mReassemblers.emplace(label, MediaReassembler()).first;
+                    it->second.onFrame([this, label](const MediaFrame& frame) { mMediaCallback(label, frame); });
+                }
+                if (!it->second.push(dataPtr, dataSize)) {
+                    LOG(WARNING) << "[Unframed binary data on " << label << ", size: " << dataSize << "]";
+                }
             }
         });
     });
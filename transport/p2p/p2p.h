@@ -4,6 +4,57 @@
 #include <rtc/rtc.hpp>
 #include <vector>
 #include <cstdint>
+#include <set>
+#include "mediaFraming.h"
+
+#define VIDEO_TRACK_MID             "video"
+#define VIDEO_TRACK_SSRC            42
+#define VIDEO_TRACK_CNAME           "camera"
+#define VIDEO_TRACK_PAYLOAD_TYPE    96
+#define VIDEO_TRACK_NACK_PACKETS    512     // sent RTP packets kept for retransmission
+
+// One media stream bound to a DataChannel resolved once by label. Meant for a single
+// sender thread: sending takes no lock, does no lookup or logging, and copies the payload
+// once, straight into the SCTP message that libdatachannel takes over.
+class MediaChannel {
+public:
+    MediaChannel(std::shared_ptr<rtc::DataChannel> channel, uint16_t streamId, uint16_t parityGroup)
+        : mChannel(channel), mStreamId(streamId), mParityGroup(parityGroup) {
+    }
+
+    // One encoded frame behind the media header, fragmented to the negotiated message size.
+    // With coalescing on, frames up to MEDIA_COALESCE_MAX_FRAME are only queued in the
+    // pending batch; a larger frame sends the batch ahead of itself.
+    bool send(const uint8_t* data, size_t size, int64_t ptsUs, uint8_t flags);
+    // Small frames wait up to deadlineUs for others to share their message, 0 disables.
+    // Not used with FEC, parity covers fragments, not batches.
+    void setCoalescing(int64_t deadlineUs) { mCoalesceUs = mParityGroup > 0 ? 0 : deadlineUs; }
+    // Sends the pending batch now
+    bool flush();
+    // Steady clock time in microseconds the pending batch is due, 0 without one
+    int64_t getFlushDeadline() const { return mBatchFrames > 0 ? mBatchStartUs + mCoalesceUs : 0; }
+    bool isOpen() const { return mChannel->isOpen(); }
+    size_t bufferedAmount() const { return mChannel->bufferedAmount(); }
+    // callback runs on the libdatachannel thread once the buffered amount falls to threshold,
+    // an empty callback detaches it
+    void onBufferedAmountLow(size_t threshold, std::function<void()> callback);
+    std::string label() const { return mChannel->label(); }
+
+private:
+    // Hands the message to libdatachannel, false only if the channel refused it
+    bool post(rtc::binary&& message);
+
+    std::shared_ptr<rtc::DataChannel> mChannel;
+    uint16_t mStreamId;
+    uint16_t mParityGroup;
+    size_t mMaxMessageSize = 0;     // negotiated, read once the channel is open
+    MediaFragmenter mFragmenter;
+
+    int64_t mCoalesceUs = 0;
+    rtc::binary mBatch;             // batch header space, then length + message per frame
+    size_t mBatchFrames = 0;
+    int64_t mBatchStartUs = 0;
+};
 
 struct Event {
     enum class Type {
@@ -24,7 +75,10 @@ public:
     void SetStunServer(const std::string& stun_server);
     void SetTurnServer(const std::string& turn_server);
     void CreatePeerConnection();
-    void CreateDataChannel(const std::string& label);
+    void ClosePeerConnection();
+    // unreliable opens it unordered with maxRetransmits=0 and sends media frames with XOR
+    // parity, a lost packet costs a frame at worst instead of stalling every later one
+    void CreateDataChannel(const std::string& label, bool unreliable = false);
     void setRemoteDescription(std::string des);
     void addRemoteCandidate(std::string candidate);
     void sendMessageToChannel(const std::string& label, const std::string& message);
@@ -36,6 +90,28 @@ public:
     std::shared_ptr<rtc::PeerConnection> pc;
 
     bool streamBuffereToChannel(const std::string& label, const uint8_t *data, size_t size);
+    size_t getBufferedAmount(const std::string& label);
+    // Largest message the peer accepts on the channel, 0 if there is no such label
+    size_t getMaxMessageSize(const std::string& label);
+    // Resolves the channel for a media stream up front, null if there is no such label.
+    // Each handle keeps its own sequence numbers, one handle per stream and channel.
+    std::shared_ptr<MediaChannel> openMediaChannel(const std::string& label, uint16_t streamId);
+    // Reassembled frames from incoming channels, runs on the libdatachannel thread
+    typedef std::function<void(const std::string& label, const MediaFrame& frame)> MediaFrameCallback;
+    void onMediaFrame(MediaFrameCallback callback);
+
+    // Sendonly H.264 track, added before the offer is created. Frames are RTP packetized
+    // with sender reports, NACKs are answered from the last VIDEO_TRACK_NACK_PACKETS and
+    // PLI/FIR from the receiver run the keyframe request callback
+    void AddVideoTrack();
+    bool isVideoTrackOpen();
+    // One Annex B access unit, pts in microseconds
+    bool sendVideoFrame(const uint8_t* data, size_t size, int64_t ptsUs);
+    // Runs on the libdatachannel thread, an empty callback detaches it
+    void onKeyframeRequest(std::function<void()> callback);
+    // Receiver side: depacketized access units of incoming H.264 tracks, timestamp in 90 kHz
+    typedef std::function<void(const uint8_t* data, size_t size, uint32_t timestamp)> VideoFrameCallback;
+    void HandleIncomingTrack(VideoFrameCallback callback);
 
 
     void pushEvent(Event event);
@@ -74,4 +150,15 @@ private:
     rtc::PeerConnection::State localState;
     std::vector<std::shared_ptr<rtc::DataChannel>> dataChannels;
     std::map<std::string, std::shared_ptr<rtc::DataChannel>> reviceChannels;
+
+    std::mutex mMediaMutex;
+    MediaFrameCallback mMediaCallback;
+    std::map<std::string, MediaReassembler> mReassemblers;
+    std::set<std::string> mFecChannels;
+
+    std::mutex mTrackMutex;
+    std::shared_ptr<rtc::Track> mVideoTrack;
+    std::shared_ptr<rtc::RtpPacketizationConfig> mRtpConfig;
+    std::function<void()> mKeyframeCallback;
+    std::vector<std::shared_ptr<rtc::Track>> mRemoteTracks;
 };
\ No newline at end of file
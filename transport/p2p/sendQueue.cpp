@@ -0,0 +1,217 @@
+#include "sendQueue.h"
+
+static int64_t steadyClockUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+std::shared_ptr<const uint8_t> copyFrameData(const uint8_t* data, size_t size) {
+    auto buffer = std::make_shared<std::vector<uint8_t>>(data, data + size);
+    return std::shared_ptr<const uint8_t>(buffer, buffer->data());
+}
+
+void SendQueue::start() {
+    if (mRunning) {
+        return;
+    }
+    mChannel = transport->openMediaChannel(mLabel, mStreamId);
+    if (!mChannel) {
+        return;
+    }
+    mChannel->setCoalescing(mCoalesceUs);
+    mRunning = true;
+    mChannel->onBufferedAmountLow(SEND_QUEUE_LOW_WATER, [this]() {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mCondVar.notify_all();
+    });
+    mThread = std::thread(&SendQueue::senderThread, this);
+}
+
+void SendQueue::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mRunning = false;
+    }
+    mCondVar.notify_all();
+    if (mThread.joinable()) {
+        mThread.join();
+        mChannel->onBufferedAmountLow(0, nullptr);
+    }
+}
+
+void SendQueue::dropFrame(bool gop) {
+    uint64_t dropped = gop ? ++mDroppedGop : ++mDroppedNonRef;
+    if (dropped % 100 == 1) {
+        LOG(WARNING) << "[" << mLabel << "] viewer backed up, dropped " << mDroppedNonRef << " non-reference, "
+                     << mDroppedGop << " GOP and " << mDroppedStale << " stale frames";
+    }
+}
+
+std::deque<SendQueue::QueuedFrame>::iterator SendQueue::eraseFrame(std::deque<QueuedFrame>::iterator it) {
+    if (it->replay) {
+        mReplayFrames--;
+    }
+    return mQueue.erase(it);
+}
+
+void SendQueue::skipToKeyframe() {
+    // Discard everything up to the next keyframe so the viewer resumes on something
+    // decodable instead of a broken reference chain
+    bool found = false;
+    for (auto it = mQueue.begin(); it != mQueue.end() && !found;) {
+        if (it->frame.flags & FRAME_FLAG_KEY) {
+            found = true;
+        } else if (it->frame.flags & FRAME_FLAG_CONFIG) {
+            ++it;
+        } else {
+            it = eraseFrame(it);
+            dropFrame(true);
+        }
+    }
+    mWaitKeyframe = !found;
+}
+
+void SendQueue::push(const EncodedFrame& frame) {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        if (!(frame.flags & FRAME_FLAG_CONFIG)) {
+            if (mWaitKeyframe && !(frame.flags & FRAME_FLAG_KEY)) {
+                dropFrame(true);
+                return;
+            }
+            mWaitKeyframe = false;
+
+            if (liveFrames() >= SEND_QUEUE_HARD_LIMIT) {
+                // Too far behind: resume at the first queued keyframe, what is before it goes
+                skipToKeyframe();
+                if (frame.flags & FRAME_FLAG_KEY) {
+                    // One GOP still fills the queue, a newer entry point beats it
+                    if (liveFrames() >= SEND_QUEUE_HARD_LIMIT) {
+                        for (auto it = mQueue.begin(); it != mQueue.end();) {
+                            if (it->frame.flags & FRAME_FLAG_CONFIG) {
+                                ++it;
+                                continue;
+                            }
+                            it = eraseFrame(it);
+                            dropFrame(true);
+                        }
+                    }
+                    mWaitKeyframe = false;
+                } else if (mWaitKeyframe || liveFrames() >= SEND_QUEUE_HARD_LIMIT) {
+                    // Nothing queued to resume at, or the queued GOP alone fills the queue:
+                    // the rest of this GOP waits out, the queued keyframe still decodes
+                    mWaitKeyframe = true;
+                    dropFrame(true);
+                    return;
+                }
+            } else if (liveFrames() >= SEND_QUEUE_SOFT_LIMIT && !(frame.flags & FRAME_FLAG_REFERENCE)) {
+                // Nothing references a disposable frame, so this only lowers the frame rate
+                dropFrame(false);
+                return;
+            }
+        }
+
+        mQueue.push_back({frame, steadyClockUs(), false});
+    }
+    mCondVar.notify_one();
+}
+
+void SendQueue::pushReplay(const std::vector<EncodedFrame>& frames) {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        int64_t now = steadyClockUs();
+        for (const EncodedFrame& frame : frames) {
+            mQueue.push_back({frame, now, true});
+        }
+        mReplayFrames += frames.size();
+        // The replay starts on its own entry point
+        mWaitKeyframe = false;
+    }
+    mCondVar.notify_one();
+}
+
+bool SendQueue::popFrame(EncodedFrame& frame) {
+    int64_t now = steadyClockUs();
+    while (!mQueue.empty()) {
+        QueuedFrame& front = mQueue.front();
+        int64_t age = now - front.queuedUs;
+        uint32_t flags = front.frame.flags;
+
+        // Parameter sets and keyframes always go, they are what a late viewer recovers on,
+        // and a replay is old by design
+        if (!front.replay && !(flags & (FRAME_FLAG_CONFIG | FRAME_FLAG_KEY))) {
+            if (age > SEND_QUEUE_STALE_GOP_US) {
+                skipToKeyframe();
+                continue;
+            }
+            if (age > SEND_QUEUE_STALE_US && !(flags & FRAME_FLAG_REFERENCE)) {
+                mQueue.pop_front();
+                mDroppedStale++;
+                continue;
+            }
+        }
+
+        frame = front.frame;
+        eraseFrame(mQueue.begin());
+        return true;
+    }
+    return false;
+}
+
+bool SendQueue::hasBufferSpace() {
+    return mChannel->bufferedAmount() <= SEND_QUEUE_HIGH_WATER;
+}
+
+void SendQueue::waitForFrame(std::unique_lock<std::mutex>& lock) {
+    while (mQueue.empty() && mRunning) {
+        int64_t deadline = mChannel->getFlushDeadline();
+        if (deadline == 0) {
+            mCondVar.wait(lock);
+            continue;
+        }
+        int64_t remaining = deadline - steadyClockUs();
+        if (remaining > 0) {
+            mCondVar.wait_for(lock, std::chrono::microseconds(remaining));
+            continue;
+        }
+        // Only this thread sends on the channel, push can go on meanwhile
+        lock.unlock();
+        mChannel->flush();
+        lock.lock();
+    }
+}
+
+void SendQueue::senderThread() {
+    while (mRunning) {
+        EncodedFrame frame;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            waitForFrame(lock);
+
+            // Paced by the channel: sleep until bufferedAmountLow instead of polling, the
+            // timeout only covers a callback lost to a closing channel
+            while (mRunning && !hasBufferSpace()) {
+                mCondVar.wait_for(lock, std::chrono::milliseconds(SEND_QUEUE_WAKE_MS));
+            }
+            if (!mRunning) {
+                break;
+            }
+            // Picked after the wait, frames that went stale meanwhile are dropped here
+            if (!popFrame(frame)) {
+                continue;
+            }
+        }
+
+        bool sent = mChannel->send(frame.data.get(), frame.size, frame.pts, frame.flags);
+        // A viewer waiting on the keyframe should not wait on the deadline as well
+        if (sent && (frame.flags & FRAME_FLAG_KEY)) {
+            sent = mChannel->flush();
+        }
+        if (sent) {
+            mSent++;
+        } else if (++mSendFailures % 100 == 1) {
+            LOG(ERROR) << "[" << mLabel << "] failed to send " << mSendFailures << " frames";
+        }
+    }
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "p2p.h"
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+
+#define FRAME_FLAG_KEY        0x01  // decoder entry point: IDR or recovery point
+#define FRAME_FLAG_REFERENCE  0x02  // later frames reference it (nal_ref_idc != 0)
+#define FRAME_FLAG_CONFIG     0x04  // SPS/PPS, never dropped
+
+#define SEND_QUEUE_SOFT_LIMIT     4          // queued frames before non-reference frames are dropped
+#define SEND_QUEUE_HARD_LIMIT     15         // queued frames before skipping to the first queued keyframe, else the next
+#define SEND_QUEUE_HIGH_WATER     (256 * 1024) // SCTP bytes buffered before the sender waits
+#define SEND_QUEUE_LOW_WATER      (64 * 1024)  // bufferedAmountLow threshold that wakes it again
+#define SEND_QUEUE_STALE_US       150000     // queued longer than this, non-reference frames are dropped
+#define SEND_QUEUE_STALE_GOP_US   500000     // and reference frames skip to the next keyframe
+#define SEND_QUEUE_WAKE_MS        100        // recheck if a bufferedAmountLow callback never comes
+
+struct EncodedFrame {
+    std::shared_ptr<const uint8_t> data;    // ref-counted, e.g. aliasing the encoder's packet buffer
+    size_t size = 0;
+    int64_t pts;        // microseconds, MEDIA_NO_PTS for parameter sets
+    uint32_t flags;
+};
+
+// Payload in a buffer of its own, for data that does not outlive the call
+std::shared_ptr<const uint8_t> copyFrameData(const uint8_t* data, size_t size);
+
+// Per-viewer queue between the encoder and one DataChannel. A slow viewer is thinned
+// here, first non-reference frames then whole GOPs, so the encoder never waits on it.
+// The sender only hands SCTP up to SEND_QUEUE_HIGH_WATER bytes and then sleeps until the
+// channel's bufferedAmountLow callback, so the backlog stays here where it can be dropped
+// by age instead of turning into seconds of latency inside the SCTP buffer.
+class SendQueue {
+public:
+    SendQueue(std::shared_ptr<P2P> p2p, const std::string& label, uint16_t streamId = MEDIA_STREAM_LIVE)
+        : transport(p2p), mLabel(label), mStreamId(streamId), mRunning(false) {
+    }
+
+    ~SendQueue() {
+        stop();
+    }
+
+    // Batch small frames into shared messages for up to deadlineUs, set before start.
+    // Keyframes flush the batch right away.
+    void setCoalescing(int64_t deadlineUs) {
+        mCoalesceUs = deadlineUs;
+    }
+
+    void start();
+    void stop();
+    void push(const EncodedFrame& frame);
+    // A joining viewer's catch-up burst, e.g. parameter sets plus the cached GOP. It is
+    // exempt from the limits and from ageing, and the limits only count frames behind it.
+    void pushReplay(const std::vector<EncodedFrame>& frames);
+
+    uint64_t getSentFrames() const { return mSent; }
+    uint64_t getDroppedFrames() const { return mDroppedNonRef + mDroppedGop + mDroppedStale; }
+
+private:
+    struct QueuedFrame {
+        EncodedFrame frame;
+        int64_t queuedUs;
+        bool replay;
+    };
+
+    void senderThread();
+    void dropFrame(bool gop);
+    void skipToKeyframe();
+    std::deque<QueuedFrame>::iterator eraseFrame(std::deque<QueuedFrame>::iterator it);
+    // Frames the limits apply to, a pending replay is not counted
+    size_t liveFrames() const { return mQueue.size() - mReplayFrames; }
+    // Front frame that is still worth sending, stale ones are dropped on the way
+    bool popFrame(EncodedFrame& frame);
+    bool hasBufferSpace();
+    // Waits for a frame, sending the pending batch once it is due
+    void waitForFrame(std::unique_lock<std::mutex>& lock);
+
+    std::shared_ptr<P2P> transport;
+    std::shared_ptr<MediaChannel> mChannel;    // resolved in start, only the sender thread sends on it
+    std::string mLabel;
+    uint16_t mStreamId;
+    int64_t mCoalesceUs = 0;
+    std::thread mThread;
+    std::atomic<bool> mRunning;
+
+    std::mutex mMutex;
+    std::condition_variable mCondVar;
+    std::deque<QueuedFrame> mQueue;
+    bool mWaitKeyframe = false;
+    size_t mReplayFrames = 0;
+
+    std::atomic<uint64_t> mSent{0};
+    std::atomic<uint64_t> mDroppedNonRef{0};
+    std::atomic<uint64_t> mDroppedGop{0};
+    std::atomic<uint64_t> mDroppedStale{0};
+    uint64_t mSendFailures = 0;
+};
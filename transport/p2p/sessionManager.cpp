@@ -0,0 +1,75 @@
+#include "sessionManager.h"
+#include <algorithm>
+
+std::shared_ptr<P2P> SessionManager::open(const std::string& viewer) {
+    close(viewer);
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mSessions.size() >= SESSION_MAX_VIEWERS) {
+        LOG(WARNING) << "Viewer " << viewer << " refused, " << mSessions.size() << " sessions open";
+        return nullptr;
+    }
+    auto p2p = std::make_shared<P2P>();
+    mSetup(p2p);
+    mSessions[viewer] = p2p;
+    LOG(INFO) << "Session opened for viewer '" << viewer << "', " << mSessions.size() << " open";
+    return p2p;
+}
+
+std::shared_ptr<P2P> SessionManager::get(const std::string& viewer) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mSessions.find(viewer);
+    return it == mSessions.end() ? nullptr : it->second;
+}
+
+void SessionManager::close(const std::string& viewer) {
+    std::shared_ptr<P2P> p2p;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mSessions.find(viewer);
+        if (it == mSessions.end()) {
+            return;
+        }
+        p2p = it->second;
+        mSessions.erase(it);
+        mClosing.emplace_back(viewer, p2p);
+    }
+    // The Closed state change still goes out through poll, so streams let go of the session
+    p2p->ClosePeerConnection();
+    LOG(INFO) << "Session closed for viewer '" << viewer << "'";
+}
+
+bool SessionManager::poll(const EventCallback& callback) {
+    std::vector<std::pair<std::string, std::shared_ptr<P2P>>> sessions;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        sessions.assign(mSessions.begin(), mSessions.end());
+        sessions.insert(sessions.end(), mClosing.begin(), mClosing.end());
+    }
+
+    bool handled = false;
+    Event event;
+    for (const auto& session : sessions) {
+        while (session.second->popEvent(event)) {
+            handled = true;
+            callback(session.first, session.second, event);
+
+            if (event.type == Event::Type::StateChange && (event.data == "Failed" || event.data == "Closed")) {
+                std::lock_guard<std::mutex> lock(mMutex);
+                auto it = mSessions.find(session.first);
+                if (it != mSessions.end() && it->second == session.second) {
+                    mSessions.erase(it);
+                }
+                mClosing.erase(std::remove(mClosing.begin(), mClosing.end(), session), mClosing.end());
+                LOG(INFO) << "Session of viewer '" << session.first << "' ended: " << event.data;
+                break;
+            }
+        }
+    }
+    return handled;
+}
+
+size_t SessionManager::size() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mSessions.size();
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "p2p.h"
+#include <map>
+#include <mutex>
+#include <utility>
+
+#define SESSION_MAX_VIEWERS 16  // each peer connection brings its own ICE/DTLS/SCTP state
+
+// One peer connection per viewer of a camera, keyed by the viewer id the signaling
+// carries. Sessions are created on request, configured by the setup callback before
+// the offer goes out, and dropped once their connection failed or closed.
+class SessionManager {
+public:
+    // Runs on a fresh P2P: servers, peer connection, channels and tracks
+    typedef std::function<void(std::shared_ptr<P2P> p2p)> SetupCallback;
+    typedef std::function<void(const std::string& viewer, std::shared_ptr<P2P> p2p, const Event& event)> EventCallback;
+
+    SessionManager(SetupCallback setup) : mSetup(setup) {
+    }
+
+    // A viewer opening again replaces its old session, e.g. after a reload
+    std::shared_ptr<P2P> open(const std::string& viewer);
+    std::shared_ptr<P2P> get(const std::string& viewer);
+    void close(const std::string& viewer);
+    // Hands out the pending events of every session, false if there were none. A session
+    // is removed right after its Failed or Closed state change was handed out.
+    bool poll(const EventCallback& callback);
+    size_t size();
+
+private:
+    SetupCallback mSetup;
+    std::mutex mMutex;
+    std::map<std::string, std::shared_ptr<P2P>> mSessions;
+    // Closed or replaced, polled until their Closed event went out
+    std::vector<std::pair<std::string, std::shared_ptr<P2P>>> mClosing;
+};